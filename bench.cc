@@ -0,0 +1,548 @@
+// Load generator for the pub/sub server. Runs a Server in-process on a
+// loopback port, connects N quiet Client subscribers to it and drives M
+// publisher threads at a fixed rate, then prints one JSON line of results.
+// Built with SESSION_COROUTINES (see mk, bench_coro) the server sessions and
+// clients use their coroutine actors instead of callbacks. With --unix the
+// subscribers connect over a Unix domain socket instead of loopback TCP.
+// With --inproc N, N consumer threads also take the messages from
+// InProcessSubscribers, and their latency is reported separately.
+//
+// Built with SESSION_IO_URING (bench_uring) the server sessions read and
+// write through io_uring rather than the epoll reactor. Either way all the
+// server threads' system calls are counted, io_uring_enter among them (see
+// SyscallCounter).
+//
+// With --busy-poll the server thread busy polls (see busy_poll.h) and the
+// publishers hand it messages through PublishIngress queues instead of
+// posting them. Either way the handover is timed as ingress_us. The
+// --poll-* options set how the poller backs off when idle, and --server-cpu
+// pins the server thread, which then spins throughout unless they say
+// otherwise (as the server does with --cpus).
+//
+// With --io-threads N the subscribers are spread over the server thread and
+// N more, each accepting its own share as with the server's --io-threads,
+// and the allocation and system call counts cover all of them.
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "busy_poll.h"
+#include "client.h"
+#include "server.h"
+
+struct BenchOptions {
+  BenchOptions()
+    : subscribers(100), publishers(1), rate(1000), size(64), duration(10),
+      warmup(3), inproc(0), io_threads(0), server_cpu(-1),
+      unix_socket(false), busy_poll(false), poll_tuned(false) {}
+
+  int subscribers;
+  int publishers;
+  int rate;      // Messages per second per publisher.
+  int size;      // Payload bytes.
+  int duration;  // Seconds.
+  int warmup;    // Seconds of load offered before measuring.
+  int inproc;    // In-process consumer threads.
+  int io_threads;  // Session threads besides the server's.
+  int server_cpu;  // The server thread's CPU, if pinned.
+  bool unix_socket;
+  bool busy_poll;
+  BusyPollOptions poll;
+  bool poll_tuned;  // Whether poll was given.
+};
+
+bool ParseOptions(int argc, char* argv[], BenchOptions& options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--unix") {
+      options.unix_socket = true;
+      continue;
+    }
+    if (arg == "--busy-poll") {
+      options.busy_poll = true;
+      continue;
+    }
+    if (i + 1 >= argc) return false;
+
+    int value = atoi(argv[++i]);
+    if (value < 0 || (value == 0 && arg != "--subscribers" &&
+                      arg != "--inproc" && arg != "--warmup" &&
+                      arg != "--io-threads" && arg != "--server-cpu" &&
+                      arg.compare(0, 7, "--poll-") != 0))
+      return false;
+
+    if (arg == "--subscribers") options.subscribers = value;
+    else if (arg == "--inproc") options.inproc = value;
+    else if (arg == "--io-threads") options.io_threads = value;
+    else if (arg == "--server-cpu") options.server_cpu = value;
+    else if (arg == "--poll-spins") options.poll.spins = value;
+    else if (arg == "--poll-yields") options.poll.yields = value;
+    else if (arg == "--poll-sleep-us") options.poll.sleep_us = value;
+    else if (arg == "--publishers") options.publishers = value;
+    else if (arg == "--rate") options.rate = value;
+    else if (arg == "--size") options.size = value;
+    else if (arg == "--duration") options.duration = value;
+    else if (arg == "--warmup") options.warmup = value;
+    else return false;
+    if (arg.compare(0, 7, "--poll-") == 0) options.poll_tuned = true;
+  }
+
+  // A unix socket has one listener, so only TCP can spread sessions.
+  return !(options.unix_socket && options.io_threads > 0);
+}
+
+// Counts operator new calls made on the server's threads, so that
+// allocations per message can be reported for the server alone rather than
+// for the in-process clients and publishers as well.
+thread_local bool count_allocs = false;
+std::atomic<int64_t> server_allocs(0);
+
+void* operator new(std::size_t size) {
+  if (count_allocs) server_allocs.fetch_add(1, std::memory_order_relaxed);
+  void* p = std::malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+// Out of line so that GCC does not warn about free() of memory from new.
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+// Likewise counts the server threads' system calls, as `perf stat -e
+// raw_syscalls:sys_enter` would: each thread opens a perf counter on that
+// tracepoint for itself. That needs tracefs mounted, to find the
+// tracepoint, and permission to count, as root or with a low enough
+// perf_event_paranoid; without them the counts are reported as null.
+class SyscallCounter {
+ public:
+  SyscallCounter() : id_(TracepointId()), failed_(id_ < 0) {}
+
+  ~SyscallCounter() {
+    for (int fd : fds_)
+      close(fd);
+  }
+
+  // Counts the calling thread's system calls from now on.
+  void CountThisThread() {
+    if (id_ < 0) return;
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.config = id_;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                     PERF_FLAG_FD_CLOEXEC);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd < 0)
+      failed_ = true;
+    else
+      fds_.push_back(fd);
+  }
+
+  // The calls counted so far, or -1 if a thread could not be counted.
+  int64_t Value() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t total = 0;
+    for (int fd : fds_) {
+      uint64_t count;
+      if (read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+      total += count;
+    }
+    return failed_ ? -1 : total;
+  }
+
+ private:
+  SyscallCounter(const SyscallCounter&);
+  SyscallCounter& operator=(const SyscallCounter&);
+
+  static int TracepointId() {
+    for (const char* tracing :
+         {"/sys/kernel/tracing", "/sys/kernel/debug/tracing"}) {
+      std::ifstream in(std::string(tracing) +
+                       "/events/raw_syscalls/sys_enter/id");
+      int id;
+      if (in >> id) return id;
+    }
+    return -1;
+  }
+
+  const int id_;
+  std::mutex mutex_;
+  std::vector<int> fds_;
+  bool failed_;
+};
+
+double CpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Descriptors the bench uses besides two per subscriber: listeners, the
+// reactors' and timers', standard streams and so on.
+enum { kSpareDescriptors = 64 };
+
+// Allows as many descriptors as the hard limit, for runs with 10k+
+// subscribers (two descriptors each, as the clients are in process), and
+// returns the limit.
+rlim_t RaiseDescriptorLimit() {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return RLIM_INFINITY;
+  if (limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0) getrlimit(RLIMIT_NOFILE, &limit);
+  }
+  return limit.rlim_cur;
+}
+
+// Hands messages to the server's thread at a fixed rate, through ingress if
+// given and otherwise by posting, scheduling each message against the start
+// time so that a late wakeup does not lower the offered load.
+void Publish(asio::io_context& io_context, Server& server,
+             PublishIngress* ingress, const std::string& payload, int rate,
+             Clock::time_point end, Counter& published) {
+  const Clock::duration interval = std::chrono::duration_cast<
+      Clock::duration>(std::chrono::seconds(1)) / rate;
+  Clock::time_point next = Clock::now();
+
+  while (next < end) {
+    if (ingress) {
+      ingress->Publish(payload);
+    } else {
+      asio::post(io_context, bind(&Server::PublishQueued, &server, payload,
+                                  Clock::now()));
+    }
+    published.Add(1);
+    next += interval;
+    std::this_thread::sleep_until(next);
+  }
+}
+
+// Connects n quiet subscribers to endpoint.
+template <typename C>
+void StartClients(asio::io_context& io_context, ClientMetrics& metrics,
+                  const typename C::Endpoint& endpoint, int n,
+                  std::vector<std::unique_ptr<C> >& clients) {
+  for (int i = 0; i < n; ++i) {
+    clients.emplace_back(new C(io_context, metrics, false));
+    clients.back()->Start(endpoint);
+  }
+}
+
+template <typename C>
+void StopClients(std::vector<std::unique_ptr<C> >& clients) {
+  for (auto& client : clients)
+    asio::post(client->strand(), bind(&C::Stop, client.get()));
+}
+
+// Takes messages from an InProcessSubscriber until stop is set, yielding
+// whenever there are none so that a consumer does not starve the server on
+// a machine with few cores.
+void Consume(InProcessSubscriber& subscriber, ClientMetrics& metrics,
+             const std::atomic<bool>& stop) {
+  std::string msg;
+  while (!stop.load(std::memory_order_relaxed)) {
+    if (!subscriber.Poll(msg)) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    ClientStats& stats = metrics.Local();
+    stats.messages_received.Add(1);
+    stats.bytes_received.Add(msg.size());
+    int64_t stamp_ns = 0;
+    std::size_t payload = 0;
+    if (Unstamp(msg, stamp_ns, payload)) {
+      int64_t latency_ns = WallClockNs() - stamp_ns;
+      stats.latency_ns.Record(latency_ns > 0 ? latency_ns : 0);
+    }
+  }
+}
+
+void PrintLatency(std::ostream& os, const char* name, const Histogram& h) {
+  os << "\"" << name << "\":{\"p50\":" << h.Percentile(50.0) / 1000.0
+     << ",\"p99\":" << h.Percentile(99.0) / 1000.0
+     << ",\"p99.9\":" << h.Percentile(99.9) / 1000.0
+     << ",\"max\":" << h.Max() / 1000.0 << "}";
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    BenchOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+      std::cerr << "Usage: bench [--subscribers <n>] [--publishers <n>]"
+                   " [--rate <msgs/sec>] [--size <bytes>]"
+                   " [--duration <secs>] [--warmup <secs>] [--inproc <n>]"
+                   " [--io-threads <n>] [--unix] [--busy-poll"
+                   " [--poll-spins <n>] [--poll-yields <n>]"
+                   " [--poll-sleep-us <us>]] [--server-cpu <cpu>]\n";
+      return 1;
+    }
+
+    // Past the limit the server's accepts fail, and it retries them at
+    // once, so the run measures that instead.
+    rlim_t descriptors = RaiseDescriptorLimit();
+    rlim_t needed = 2 * rlim_t(options.subscribers) + kSpareDescriptors;
+    if (descriptors != RLIM_INFINITY && needed > descriptors) {
+      std::cerr << "Warning: " << options.subscribers << " subscribers need"
+                << " about " << needed << " descriptors, over the limit of "
+                << descriptors << "\n";
+    }
+
+    SyscallCounter server_syscalls;
+    // The sessions hold timers on these, so they outlive the server.
+    asio::io_context server_io;
+    std::vector<std::unique_ptr<asio::io_context> > session_io;
+    ListenOptions listen;
+    listen.reuse_port = options.io_threads > 0;
+    Server server(server_io,
+                  tcp::endpoint(asio::ip::address_v4::loopback(), 0), listen);
+    server.set_timestamps(true);
+    std::string unix_path;
+    if (options.unix_socket) {
+      unix_path = "/tmp/bench." + std::to_string(getpid()) + ".sock";
+      server.ListenLocal(server_io, unix_path);
+    }
+    std::vector<std::unique_ptr<PublishIngress> > ingresses;
+    if (options.busy_poll) {
+      for (int i = 0; i < options.publishers; ++i)
+        ingresses.emplace_back(new PublishIngress(server));
+    }
+    std::thread server_thread([&]() {
+      count_allocs = true;
+      server_syscalls.CountThisThread();
+      bool pinned = options.server_cpu >= 0 &&
+                    PinThread(CpuSet(1, options.server_cpu));
+      if (options.server_cpu >= 0 && !pinned)
+        std::cerr << "Could not pin the server thread\n";
+      if (!options.busy_poll) {
+        server_io.run();
+        return;
+      }
+      BusyPoller poller(server_io, server.metrics(),
+                        pinned && !options.poll_tuned
+                            ? BusyPollOptions::Dedicated() : options.poll);
+      for (auto& ingress : ingresses)
+        poller.AddIngress(ingress.get());
+      poller.Run();
+    });
+
+    std::vector<std::thread> session_threads;
+    for (int i = 0; i < options.io_threads; ++i) {
+      session_io.emplace_back(new asio::io_context);
+      asio::io_context& io = *session_io.back();
+      server.Listen(io);
+      session_threads.emplace_back([&io, &server_syscalls]() {
+        count_allocs = true;
+        server_syscalls.CountThisThread();
+        io.run();
+      });
+    }
+
+    asio::io_context client_io;
+    ClientMetrics client_metrics;
+    std::vector<std::unique_ptr<Client> > tcp_clients;
+    std::vector<std::unique_ptr<UnixClient> > unix_clients;
+    if (options.unix_socket) {
+      StartClients(client_io, client_metrics,
+                   stream_protocol::endpoint(unix_path), options.subscribers,
+                   unix_clients);
+    } else {
+      StartClients(client_io, client_metrics, server.local_endpoint(),
+                   options.subscribers, tcp_clients);
+    }
+    std::thread client_thread([&]() { client_io.run(); });
+
+    ClientMetrics inproc_metrics;
+    std::atomic<bool> inproc_stop(false);
+    std::vector<boost::intrusive_ptr<InProcessSubscriber> > inproc;
+    std::vector<std::thread> consumers;
+    for (int i = 0; i < options.inproc; ++i) {
+      inproc.emplace_back(new InProcessSubscriber(server.metrics()));
+      server.Join(inproc.back());
+      consumers.emplace_back(Consume, std::ref(*inproc.back()),
+                             std::ref(inproc_metrics), std::cref(inproc_stop));
+    }
+
+    // Wait for every subscriber to connect before offering load.
+    for (;;) {
+      ClientStats stats;
+      client_metrics.Aggregate(stats);
+      if (stats.connects.Value() + stats.connect_failures.Value() >=
+          options.subscribers)
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    std::string payload(options.size, 'x');
+    std::vector<Counter> published(options.publishers);
+    std::vector<std::thread> publishers;
+    // Measure from the end of the warm-up, by which time the history, the
+    // session queues and their spare buffers have grown to their working
+    // sizes, so that the counts are of the steady state.
+    Clock::time_point start =
+        Clock::now() + std::chrono::seconds(options.warmup);
+    Clock::time_point end = start + std::chrono::seconds(options.duration);
+    for (int i = 0; i < options.publishers; ++i) {
+      publishers.emplace_back(Publish, std::ref(server_io), std::ref(server),
+                              options.busy_poll ? ingresses[i].get() : nullptr,
+                              std::cref(payload), options.rate, end,
+                              std::ref(published[i]));
+    }
+    std::this_thread::sleep_until(start);
+    double cpu_start = CpuSeconds();
+    int64_t allocs_start = server_allocs.load();
+    int64_t syscalls_start = server_syscalls.Value();
+    int64_t published_start = 0;
+    for (const auto& p : published)
+      published_start += p.Value();
+    int64_t delivered_start = 0;
+    {
+      ClientStats snapshot;
+      client_metrics.Aggregate(snapshot);
+      inproc_metrics.Aggregate(snapshot);
+      delivered_start = snapshot.messages_received.Value();
+    }
+
+    for (auto& t : publishers)
+      t.join();
+    double duration =
+        std::chrono::duration<double>(Clock::now() - start).count();
+
+    int64_t total_published = 0;
+    for (const auto& p : published)
+      total_published += p.Value();
+
+    // Allow in-flight messages to drain, up to a couple of seconds.
+    ClientStats stats;
+    ClientStats inproc_stats;
+    Clock::time_point drain_end = Clock::now() + std::chrono::seconds(2);
+    for (;;) {
+      ClientStats snapshot;
+      ClientStats inproc_snapshot;
+      client_metrics.Aggregate(snapshot);
+      inproc_metrics.Aggregate(inproc_snapshot);
+      if ((snapshot.messages_received.Value() >=
+               total_published * snapshot.connects.Value() &&
+           inproc_snapshot.messages_received.Value() >=
+               total_published * options.inproc) ||
+          Clock::now() >= drain_end) {
+        stats.Merge(snapshot);
+        inproc_stats.Merge(inproc_snapshot);
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    double cpu = CpuSeconds() - cpu_start;
+    int64_t allocs = server_allocs.load() - allocs_start;
+    int64_t syscalls_end = server_syscalls.Value();
+    int64_t syscalls = syscalls_end - syscalls_start;
+    int64_t delivered = stats.messages_received.Value() +
+                        inproc_stats.messages_received.Value() -
+                        delivered_start;
+    total_published -= published_start;
+
+    ServerStats server_stats;
+    server.metrics().Aggregate(server_stats);
+
+    StopClients(tcp_clients);
+    StopClients(unix_clients);
+    inproc_stop = true;
+    for (auto& t : consumers)
+      t.join();
+    client_io.stop();
+    client_thread.join();
+    for (auto& io : session_io)
+      io->stop();
+    for (auto& t : session_threads)
+      t.join();
+    server_io.stop();
+    server_thread.join();
+    if (options.unix_socket) unlink(unix_path.c_str());
+
+#if defined(SESSION_COROUTINES)
+    const char* sessions = "coroutines";
+#else
+    const char* sessions = "callbacks";
+#endif
+#if defined(SESSION_IO_URING)
+    const char* io = "io_uring";
+#else
+    const char* io = "epoll";
+#endif
+    std::cout << "{\"sessions\":\"" << sessions << "\""
+              << ",\"io\":\"" << io << "\""
+              << ",\"polling\":\""
+              << (options.busy_poll ? "busy" : "blocking") << "\""
+              << ",\"transport\":\""
+              << (options.unix_socket ? "unix" : "tcp") << "\""
+              << ",\"subscribers\":" << options.subscribers
+              << ",\"connected\":" << stats.connects.Value()
+              << ",\"inproc\":" << options.inproc
+              << ",\"io_threads\":" << options.io_threads
+              << ",\"server_cpu\":" << options.server_cpu
+              << ",\"publishers\":" << options.publishers
+              << ",\"rate\":" << options.rate
+              << ",\"size\":" << options.size
+              << ",\"duration_s\":" << duration
+              << ",\"elapsed_s\":" << elapsed
+              << ",\"published\":" << total_published
+              << ",\"delivered\":" << delivered
+              << ",\"publish_rate\":" << total_published / duration
+              << ",\"fanout_rate\":" << delivered / elapsed
+              << ",\"cpu_s\":" << cpu
+              << ",\"cpu_us_per_msg\":"
+              << (total_published ? cpu * 1e6 / total_published : 0.0)
+              << ",\"cpu_us_per_delivery\":"
+              << (delivered ? cpu * 1e6 / delivered : 0.0)
+              << ",\"server_allocs_per_msg\":"
+              << (total_published ? double(allocs) / total_published : 0.0)
+              << ",\"server_allocs_per_delivery\":"
+              << (delivered ? double(allocs) / delivered : 0.0)
+              << ",\"server_syscalls_per_msg\":";
+    if (syscalls_start >= 0 && syscalls_end >= 0) {
+      std::cout << (total_published ? double(syscalls) / total_published
+                                    : 0.0)
+                << ",\"server_syscalls_per_delivery\":"
+                << (delivered ? double(syscalls) / delivered : 0.0) << ",";
+    } else {
+      std::cout << "null,\"server_syscalls_per_delivery\":null,";
+    }
+    PrintLatency(std::cout, "latency_us", stats.latency_ns);
+    std::cout << ",";
+    PrintLatency(std::cout, "server_deliver_us", server_stats.deliver_ns);
+    std::cout << ",";
+    PrintLatency(std::cout, "ingress_us", server_stats.ingress_ns);
+    if (options.inproc) {
+      std::cout << ",";
+      PrintLatency(std::cout, "inproc_latency_us", inproc_stats.latency_ns);
+    }
+    std::cout << "}\n";
+  }
+  catch (std::exception& e) {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
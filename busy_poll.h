@@ -0,0 +1,149 @@
+#ifndef BUSY_POLL_H_
+#define BUSY_POLL_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "server.h"
+#include "spsc_queue.h"
+
+// Tells the core that the caller is spinning, easing the cost to a sibling
+// hyperthread without giving up the core.
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Messages from one publishing thread to the server, through an SpscQueue
+// that the channel thread's BusyPoller drains. Unlike posting PublishMessage
+// to the io_context, Publish() takes no lock and makes no system call to
+// wake the channel thread; the poller finds the message on its next pass.
+class PublishIngress {
+ public:
+  explicit PublishIngress(Server& server, std::size_t capacity = 4096)
+    : server_(server), queue_(capacity) {}
+
+  // Producer: queues msg, spinning while the channel thread catches up if
+  // the queue is full.
+  void Publish(const std::string& msg) {
+    Entry* entry = queue_.Back();
+    if (!entry) {
+      server_.metrics().Local().ingress_full.Add(1);
+      while (!(entry = queue_.Back()))
+        std::this_thread::yield();
+    }
+    entry->msg.assign(msg);
+    entry->queued = Clock::now();
+    queue_.Push();
+  }
+
+  // Consumer, on the channel thread: publishes up to max queued messages,
+  // returning how many.
+  std::size_t Drain(std::size_t max) {
+    std::size_t n = 0;
+    for (Entry* entry; n < max && (entry = queue_.Front()); ++n) {
+      server_.PublishQueued(entry->msg, entry->queued);
+      queue_.Pop();
+    }
+    return n;
+  }
+
+ private:
+  struct Entry {
+    std::string msg;
+    Clock::time_point queued;
+  };
+
+  Server& server_;
+  SpscQueue<Entry> queue_;
+};
+
+// How a BusyPoller backs off while its passes find nothing to do: it spins
+// for spins passes, then yields the CPU for yields passes, then sleeps
+// sleep_us between passes. With sleep_us 0 it never sleeps but goes back to
+// spinning once the yields are used up.
+struct BusyPollOptions {
+  BusyPollOptions() : spins(200), yields(20000), sleep_us(50) {}
+
+  // For a thread pinned to a core of its own, which has nothing to give the
+  // core up to: spins throughout, never yielding or sleeping.
+  static BusyPollOptions Dedicated() {
+    BusyPollOptions options;
+    options.yields = 0;
+    options.sleep_us = 0;
+    return options;
+  }
+
+  unsigned spins;
+  unsigned yields;
+  unsigned sleep_us;
+};
+
+// Runs an io_context on the calling thread by polling it in a loop instead
+// of blocking in the reactor, so that neither a socket becoming ready nor a
+// queued publish waits for the thread to be woken. The price is a core: best
+// run on a thread pinned to a CPU of its own (see PinThread()), with
+// BusyPollOptions::Dedicated().
+//
+// While passes find nothing to do the loop backs off as options say, and
+// returns to spinning as soon as a pass finds work. Runs until the
+// io_context is stopped or runs out of work.
+class BusyPoller {
+ public:
+  BusyPoller(asio::io_context& io_context, Metrics& metrics,
+             const BusyPollOptions& options = BusyPollOptions())
+    : io_context_(io_context), metrics_(metrics), options_(options) {}
+
+  // Drains ingress on every pass. Call before Run().
+  void AddIngress(PublishIngress* ingress) {
+    ingresses_.push_back(ingress);
+  }
+
+  void Run() {
+    const uint64_t backed_off = uint64_t(options_.spins) + options_.yields;
+    uint64_t idle = 0;
+    while (!io_context_.stopped()) {
+      std::size_t handled = io_context_.poll();
+      for (PublishIngress* ingress : ingresses_)
+        handled += ingress->Drain(kBatch);
+
+      if (handled) {
+        idle = 0;
+      } else if (idle < options_.spins) {
+        ++idle;
+        CpuRelax();
+      } else if (idle < backed_off) {
+        ++idle;
+        std::this_thread::yield();
+      } else if (options_.sleep_us) {
+        metrics_.Local().poll_sleeps.Add(1);
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(options_.sleep_us));
+      } else {
+        CpuRelax();
+      }
+    }
+  }
+
+ private:
+  // Messages taken from each ingress per pass, so that a busy publisher
+  // cannot starve the sockets.
+  enum { kBatch = 64 };
+
+  BusyPoller(const BusyPoller&);
+  BusyPoller& operator=(const BusyPoller&);
+
+  asio::io_context& io_context_;
+  Metrics& metrics_;
+  const BusyPollOptions options_;
+  std::vector<PublishIngress*> ingresses_;
+};
+
+#endif  // BUSY_POLL_H_
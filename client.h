@@ -0,0 +1,402 @@
+#ifndef CLIENT_H_
+#define CLIENT_H_
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/bind.hpp>
+
+#if defined(SESSION_COROUTINES)
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#endif
+
+#include "metrics.h"
+#include "timestamp.h"
+
+using boost::asio::ip::tcp;
+using boost::asio::local::stream_protocol;
+using boost::asio::steady_timer;
+using boost::bind;
+using boost::system::error_code;
+
+namespace asio = boost::asio;
+
+// A subscriber connection. Statistics go to the shared ClientMetrics; a
+// verbose client also prints each message and a periodic latency summary,
+// while a quiet one produces no console output at all. The socket and timers
+// use a strand as their executor, so every handler runs on the strand and
+// many clients may share an io_context run by a pool of threads.
+//
+// Built with SESSION_COROUTINES the connect/read, heartbeat, report and
+// deadline actors are coroutines spawned on the strand rather than chains of
+// callbacks.
+//
+// Protocol is tcp, or stream_protocol for a server's Unix domain socket on
+// the same host; Client and UnixClient below name the two.
+template <typename Protocol>
+class BasicClient {
+ public:
+  typedef asio::strand<asio::io_context::executor_type> Strand;
+  typedef typename Protocol::endpoint Endpoint;
+
+  BasicClient(asio::io_context& io_context, ClientMetrics& metrics,
+              bool verbose = true)
+    : verbose_(verbose),
+      metrics_(metrics),
+      stopped_(false),
+      requested_(false),
+      strand_(asio::make_strand(io_context)),
+      socket_(strand_),
+      deadline_(strand_),
+      heartbeat_timer_(strand_),
+      report_timer_(strand_) {
+  }
+
+  // Tries each endpoint in turn, e.g. a resolver's results, until one
+  // connects.
+  template <typename Endpoints>
+  void Start(const Endpoints& endpoints) {
+    endpoints_.assign(endpoints.begin(), endpoints.end());
+#if defined(SESSION_COROUTINES)
+    asio::co_spawn(strand_, Connection(), asio::detached);
+    asio::co_spawn(strand_, Watchdog(), asio::detached);
+#else
+    StartConnect(0);
+    deadline_.async_wait(bind(&BasicClient::CheckDeadline, this));
+#endif
+  }
+
+  void Start(const Endpoint& endpoint) {
+    Start(std::vector<Endpoint>(1, endpoint));
+  }
+
+  // Binds the connecting socket to the given local address, letting a load
+  // generator spread connections over several source addresses rather than
+  // run out of ephemeral ports on one. Ignored over a Unix domain socket.
+  void set_local_address(const asio::ip::address& address) {
+    local_address_ = address;
+  }
+
+  // Asks the server for its history from sequence from on, rather than from
+  // the first message, for a caller switching over from another transport
+  // that already has what comes before. The request is the first line sent,
+  // and the server must be run with --start-requests; any other publishes
+  // it as a message.
+  void set_from(uint64_t from) {
+    request_ = "from " + std::to_string(from) + "\n";
+  }
+
+  const Strand& strand() const {
+    return strand_;
+  }
+
+  void Stop() {
+    stopped_ = true;
+    error_code ignored_ec;
+    socket_.close(ignored_ec);
+    deadline_.cancel();
+    heartbeat_timer_.cancel();
+    report_timer_.cancel();
+  }
+
+ private:
+  static void BindLocal(tcp::socket& socket, const asio::ip::address& address,
+                        error_code& ec) {
+    socket.bind(tcp::endpoint(address, 0), ec);
+  }
+
+  static void BindLocal(stream_protocol::socket&, const asio::ip::address&,
+                        error_code&) {}
+
+  // Starts the connect deadline and opens the socket on the local address,
+  // if one was given. Returns false if the address could not be bound.
+  bool PrepareConnect(const Endpoint& endpoint) {
+    if (verbose_)
+      std::cout << "Trying " << endpoint << "...\n";
+
+    deadline_.expires_after(std::chrono::seconds(60));
+
+    if (!local_address_.is_unspecified()) {
+      error_code ec;
+      socket_.open(endpoint.protocol(), ec);
+      if (!ec) BindLocal(socket_, local_address_, ec);
+      if (ec) {
+        metrics_.Local().connect_failures.Add(1);
+        socket_.close(ec);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Returns true once connected, otherwise counts the failure.
+  bool ConnectDone(const error_code& ec, const Endpoint& endpoint) {
+    if (!socket_.is_open()) {
+      if (verbose_) std::cout << "Connect timed out\n";
+      metrics_.Local().connect_failures.Add(1);
+      return false;
+    } else if (ec) {
+      if (verbose_) std::cout << "Connect error: " << ec.message() << "\n";
+      metrics_.Local().connect_failures.Add(1);
+      socket_.close();
+      return false;
+    }
+
+    if (verbose_)
+      std::cout << "Connected to " << endpoint << "\n";
+    metrics_.Local().connects.Add(1);
+    return true;
+  }
+
+  void HandleLine() {
+    std::string line;
+    std::istream is(&input_buffer_);
+    std::getline(is, line);
+    if (line.empty()) return;
+
+    ClientStats& stats = metrics_.Local();
+    stats.messages_received.Add(1);
+    stats.bytes_received.Add(line.size() + 1);
+
+    // Messages published in timestamping mode carry their publish time.
+    int64_t stamp_ns = 0;
+    std::size_t payload = 0;
+    if (Unstamp(line, stamp_ns, payload)) {
+      int64_t latency_ns = WallClockNs() - stamp_ns;
+      stats.latency_ns.Record(latency_ns > 0 ? latency_ns : 0);
+    }
+
+    if (verbose_)
+      std::cout << "Received: " << line.substr(payload) << "\n";
+  }
+
+  // The request, if there is one, followed by heartbeats.
+  asio::const_buffer NextLine() {
+    if (requested_ || request_.empty()) return asio::buffer("\n", 1);
+    requested_ = true;
+    return asio::buffer(request_);
+  }
+
+  void Report() {
+    ClientStats stats;
+    metrics_.Aggregate(stats);
+    if (stats.latency_ns.Count()) {
+      std::cout << "Publish to receive latency (us): ";
+      stats.latency_ns.Print(std::cout, 1000.0);
+      std::cout << "\n";
+    }
+  }
+
+  // Closes the socket once the deadline passes, failing whichever operation
+  // is outstanding.
+  void EnforceDeadline() {
+    if (deadline_.expiry() <= steady_timer::clock_type::now()) {
+      socket_.close();
+      deadline_.expires_at(steady_timer::time_point::max());
+    }
+  }
+
+#if defined(SESSION_COROUTINES)
+  asio::awaitable<void> Connection() {
+    error_code ec;
+    for (std::size_t i = 0;; ++i) {
+      if (i == endpoints_.size()) {
+        Stop();
+        co_return;
+      }
+
+      Endpoint endpoint = endpoints_[i];
+      if (!PrepareConnect(endpoint)) continue;
+      co_await socket_.async_connect(endpoint,
+          asio::redirect_error(asio::use_awaitable, ec));
+      if (stopped_) co_return;
+      if (ConnectDone(ec, endpoint)) break;
+    }
+
+    asio::co_spawn(strand_, Heartbeats(), asio::detached);
+    if (verbose_) asio::co_spawn(strand_, Reports(), asio::detached);
+
+    for (;;) {
+      deadline_.expires_after(std::chrono::seconds(30));
+      co_await asio::async_read_until(socket_, input_buffer_, '\n',
+          asio::redirect_error(asio::use_awaitable, ec));
+      if (stopped_) co_return;
+
+      if (ec) {
+        if (verbose_)
+          std::cout << "Error on receive: " << ec.message() << "\n";
+        metrics_.Local().disconnects.Add(1);
+        Stop();
+        co_return;
+      }
+      HandleLine();
+    }
+  }
+
+  asio::awaitable<void> Heartbeats() {
+    error_code ec;
+    while (!stopped_) {
+      co_await asio::async_write(socket_, NextLine(),
+          asio::redirect_error(asio::use_awaitable, ec));
+      if (stopped_) co_return;
+
+      if (ec) {
+        if (verbose_)
+          std::cout << "Error on heartbeat: " << ec.message() << "\n";
+        Stop();
+        co_return;
+      }
+
+      heartbeat_timer_.expires_after(std::chrono::seconds(10));
+      co_await heartbeat_timer_.async_wait(
+          asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+
+  asio::awaitable<void> Reports() {
+    error_code ec;
+    for (;;) {
+      report_timer_.expires_after(std::chrono::seconds(10));
+      co_await report_timer_.async_wait(
+          asio::redirect_error(asio::use_awaitable, ec));
+      if (stopped_) co_return;
+      Report();
+    }
+  }
+
+  asio::awaitable<void> Watchdog() {
+    error_code ec;
+    while (!stopped_) {
+      EnforceDeadline();
+      co_await deadline_.async_wait(
+          asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+#else
+  void StartConnect(std::size_t i) {
+    if (i < endpoints_.size()) {
+      if (!PrepareConnect(endpoints_[i])) {
+        StartConnect(i + 1);
+        return;
+      }
+
+      socket_.async_connect(endpoints_[i],
+                            bind(&BasicClient::HandleConnect, this, _1, i));
+    } else {
+      Stop();
+    }
+  }
+
+  void HandleConnect(const error_code& ec, std::size_t i) {
+    if (stopped_)
+      return;
+
+    if (!ConnectDone(ec, endpoints_[i])) {
+      StartConnect(i + 1);
+    } else {
+      StartRead();
+      StartWrite();
+      if (verbose_) StartReport();
+    }
+  }
+
+  void StartRead() {
+    deadline_.expires_after(std::chrono::seconds(30));
+    asio::async_read_until(socket_, input_buffer_, '\n',
+        bind(&BasicClient::HandleRead, this, _1));
+  }
+
+  void HandleRead(const error_code& ec) {
+    if (stopped_)
+      return;
+
+    if (!ec) {
+      HandleLine();
+      StartRead();
+    } else {
+      if (verbose_)
+        std::cout << "Error on receive: " << ec.message() << "\n";
+      metrics_.Local().disconnects.Add(1);
+      Stop();
+    }
+  }
+
+  void StartWrite() {
+    if (stopped_)
+      return;
+
+    asio::async_write(socket_, NextLine(),
+        bind(&BasicClient::HandleWrite, this, _1));
+  }
+
+  void HandleWrite(const error_code& ec) {
+    if (stopped_)
+      return;
+
+    if (!ec) {
+      heartbeat_timer_.expires_after(std::chrono::seconds(10));
+      heartbeat_timer_.async_wait(bind(&BasicClient::StartWrite, this));
+    }
+    else {
+      if (verbose_)
+        std::cout << "Error on heartbeat: " << ec.message() << "\n";
+      Stop();
+    }
+  }
+
+  void StartReport() {
+    report_timer_.expires_after(std::chrono::seconds(10));
+    report_timer_.async_wait(bind(&BasicClient::HandleReport, this));
+  }
+
+  void HandleReport() {
+    if (stopped_)
+      return;
+
+    Report();
+    StartReport();
+  }
+
+  void CheckDeadline() {
+    if (stopped_)
+      return;
+
+    EnforceDeadline();
+    deadline_.async_wait(bind(&BasicClient::CheckDeadline, this));
+  }
+#endif
+
+private:
+  bool verbose_;
+  ClientMetrics& metrics_;
+  bool stopped_;
+  std::string request_;
+  bool requested_;
+  Strand strand_;
+  asio::ip::address local_address_;
+  std::vector<Endpoint> endpoints_;
+  typename Protocol::socket socket_;
+  asio::streambuf input_buffer_;
+  steady_timer deadline_;
+  steady_timer heartbeat_timer_;
+  steady_timer report_timer_;
+};
+
+typedef BasicClient<tcp> Client;
+typedef BasicClient<stream_protocol> UnixClient;
+
+#endif  // CLIENT_H_
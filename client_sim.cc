@@ -0,0 +1,199 @@
+// Capacity test driver: opens thousands of quiet Client connections to a
+// running server, multiplexed over one io_context and a small thread pool.
+// Connects are staggered at a fixed rate and the only output is a periodic
+// summary aggregated across all connections.
+
+#include <sys/resource.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client.h"
+
+struct SimOptions {
+  SimOptions()
+    : connections(1000), connect_rate(1000), threads(2), report_interval(5) {}
+
+  std::string host;
+  std::string port;
+  int connections;
+  int connect_rate;     // New connections per second.
+  int threads;
+  int report_interval;  // Seconds.
+  std::vector<asio::ip::address> local_addresses;
+};
+
+bool ParseOptions(int argc, char* argv[], SimOptions& options) {
+  if (argc < 3) return false;
+  options.host = argv[1];
+  options.port = argv[2];
+
+  for (int i = 3; i + 1 < argc; i += 2) {
+    std::string arg(argv[i]);
+    if (arg == "--connections") {
+      options.connections = atoi(argv[i + 1]);
+    } else if (arg == "--connect-rate") {
+      options.connect_rate = atoi(argv[i + 1]);
+    } else if (arg == "--threads") {
+      options.threads = atoi(argv[i + 1]);
+    } else if (arg == "--report-interval") {
+      options.report_interval = atoi(argv[i + 1]);
+    } else if (arg == "--local-addresses") {
+      std::istringstream is(argv[i + 1]);
+      std::string address;
+      while (std::getline(is, address, ','))
+        options.local_addresses.push_back(
+            asio::ip::make_address(address));
+    } else {
+      return false;
+    }
+  }
+
+  return argc % 2 == 1 && options.connections > 0 &&
+         options.connect_rate > 0 && options.threads > 0 &&
+         options.report_interval > 0;
+}
+
+// Each connection needs a descriptor; raise the soft limit as far as the hard
+// limit allows.
+void RaiseFileLimit() {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+class Simulator {
+ public:
+  Simulator(asio::io_context& io_context, const SimOptions& options,
+            const tcp::resolver::results_type& endpoints)
+    : io_context_(io_context),
+      options_(options),
+      endpoints_(endpoints),
+      strand_(asio::make_strand(io_context)),
+      connect_timer_(strand_),
+      report_timer_(strand_),
+      due_(0),
+      last_messages_(0),
+      last_bytes_(0) {
+    clients_.reserve(options_.connections);
+    connect_timer_.expires_after(std::chrono::seconds(0));
+    connect_timer_.async_wait(bind(&Simulator::HandleConnectTick, this, _1));
+    StartReport();
+  }
+
+ private:
+  enum { kTickMs = 10 };
+
+  // Starts the next batch of connections, spreading connect_rate evenly over
+  // the second in kTickMs slices. Each tick adds its share of the rate to
+  // due_, fractions included, and starts the whole connections that are due,
+  // so rates below one per tick or between multiples of 100/s keep to the
+  // rate asked for.
+  void HandleConnectTick(const error_code& ec) {
+    if (ec) return;
+
+    std::size_t target = std::size_t(options_.connections);
+    due_ += options_.connect_rate * kTickMs / 1000.0;
+    std::size_t batch = std::size_t(std::floor(due_));
+    due_ -= batch;
+
+    for (std::size_t i = 0; i < batch && clients_.size() < target; ++i) {
+      clients_.emplace_back(new Client(io_context_, metrics_, false));
+      if (!options_.local_addresses.empty()) {
+        clients_.back()->set_local_address(options_.local_addresses[
+            clients_.size() % options_.local_addresses.size()]);
+      }
+      clients_.back()->Start(endpoints_);
+    }
+
+    if (clients_.size() < target) {
+      connect_timer_.expires_at(connect_timer_.expiry() +
+                                std::chrono::milliseconds(kTickMs));
+      connect_timer_.async_wait(
+          bind(&Simulator::HandleConnectTick, this, _1));
+    }
+  }
+
+  void StartReport() {
+    report_timer_.expires_after(
+        std::chrono::seconds(options_.report_interval));
+    report_timer_.async_wait(bind(&Simulator::HandleReport, this, _1));
+  }
+
+  void HandleReport(const error_code& ec) {
+    if (ec) return;
+
+    ClientStats stats;
+    metrics_.Aggregate(stats);
+    int64_t messages = stats.messages_received.Value();
+    int64_t bytes = stats.bytes_received.Value();
+
+    std::ostringstream os;
+    os << "started=" << clients_.size()
+       << " connected=" << stats.connects.Value() - stats.disconnects.Value()
+       << " failed=" << stats.connect_failures.Value()
+       << " disconnects=" << stats.disconnects.Value()
+       << " msgs/s=" << (messages - last_messages_) / options_.report_interval
+       << " bytes/s=" << (bytes - last_bytes_) / options_.report_interval
+       << " latency_us ";
+    stats.latency_ns.Print(os, 1000.0);
+    std::cout << os.str() << std::endl;
+
+    last_messages_ = messages;
+    last_bytes_ = bytes;
+    StartReport();
+  }
+
+  asio::io_context& io_context_;
+  const SimOptions& options_;
+  tcp::resolver::results_type endpoints_;
+  Client::Strand strand_;
+  steady_timer connect_timer_;
+  steady_timer report_timer_;
+  ClientMetrics metrics_;
+  std::vector<std::unique_ptr<Client> > clients_;
+  double due_;  // Connections due to start, and the fraction of the next.
+  int64_t last_messages_;
+  int64_t last_bytes_;
+};
+
+int main(int argc, char* argv[]) {
+  try {
+    SimOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+      std::cerr << "Usage: client_sim <host> <port> [--connections <n>]"
+                   " [--connect-rate <per sec>] [--threads <n>]"
+                   " [--report-interval <secs>]"
+                   " [--local-addresses <addr,addr,...>]\n";
+      return 1;
+    }
+
+    RaiseFileLimit();
+
+    asio::io_context io_context;
+    tcp::resolver resolver(io_context);
+    Simulator simulator(io_context, options,
+                        resolver.resolve(options.host, options.port));
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < options.threads; ++i)
+      threads.emplace_back([&]() { io_context.run(); });
+    for (auto& t : threads)
+      t.join();
+  }
+  catch (std::exception& e) {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,110 @@
+#ifndef HANDLER_ALLOC_H_
+#define HANDLER_ALLOC_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Custom memory for asio completion handlers, after asio's custom allocation
+// example. An object that always has the same kind of operation outstanding
+// (a session's read, its write, a timer wait) keeps a HandlerMemory for it
+// and wraps each handler with MakeAllocHandler(), so that starting the
+// operation reuses one small block rather than calling operator new.
+//
+// A HandlerMemory serves one operation at a time and falls back to the heap
+// if it is already in use or the handler is too large. It is not thread safe:
+// the operation must be started and completed on the owner's thread.
+class HandlerMemory {
+ public:
+  HandlerMemory() : in_use_(false) {}
+
+  void* Allocate(std::size_t size) {
+    if (!in_use_ && size <= sizeof(storage_)) {
+      in_use_ = true;
+      return &storage_;
+    }
+    return ::operator new(size);
+  }
+
+  void Deallocate(void* pointer) {
+    if (pointer == &storage_)
+      in_use_ = false;
+    else
+      ::operator delete(pointer);
+  }
+
+ private:
+  HandlerMemory(const HandlerMemory&);
+  HandlerMemory& operator=(const HandlerMemory&);
+
+  std::aligned_storage<256>::type storage_;
+  bool in_use_;
+};
+
+// The standard allocator interface over a HandlerMemory, found by asio
+// through the handler's allocator_type.
+template <typename T>
+class HandlerAllocator {
+ public:
+  typedef T value_type;
+
+  explicit HandlerAllocator(HandlerMemory& memory) : memory_(memory) {}
+
+  template <typename U>
+  HandlerAllocator(const HandlerAllocator<U>& other)
+    : memory_(other.memory_) {}
+
+  T* allocate(std::size_t n) const {
+    return static_cast<T*>(memory_.Allocate(sizeof(T) * n));
+  }
+
+  void deallocate(T* pointer, std::size_t) const {
+    memory_.Deallocate(pointer);
+  }
+
+  bool operator==(const HandlerAllocator& other) const {
+    return &memory_ == &other.memory_;
+  }
+
+  bool operator!=(const HandlerAllocator& other) const {
+    return &memory_ != &other.memory_;
+  }
+
+ private:
+  template <typename> friend class HandlerAllocator;
+
+  HandlerMemory& memory_;
+};
+
+template <typename Handler>
+class AllocHandler {
+ public:
+  typedef HandlerAllocator<Handler> allocator_type;
+
+  AllocHandler(HandlerMemory& memory, Handler handler)
+    : memory_(memory),
+      handler_(std::move(handler)) {}
+
+  allocator_type get_allocator() const {
+    return allocator_type(memory_);
+  }
+
+  template <typename... Args>
+  void operator()(Args&&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+
+ private:
+  HandlerMemory& memory_;
+  Handler handler_;
+};
+
+template <typename Handler>
+inline AllocHandler<typename std::decay<Handler>::type> MakeAllocHandler(
+    HandlerMemory& memory, Handler&& handler) {
+  return AllocHandler<typename std::decay<Handler>::type>(
+      memory, std::forward<Handler>(handler));
+}
+
+#endif  // HANDLER_ALLOC_H_
@@ -0,0 +1,290 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/system/system_error.hpp>
+
+// Hot upgrade: a running server hands its listening sockets and its drained
+// subscriber sessions to a successor over a Unix domain socket, passing the
+// descriptors with SCM_RIGHTS so that no connection is dropped.
+//
+// The old server sends a sequence of records, each a 16 byte header
+//
+//   kind:u32  count:u32  payload_bytes:u64
+//
+// carrying count descriptors, followed by the payload:
+//
+//   listeners  no payload
+//   sessions   per descriptor: position:u64, input_bytes:u32, input
+//   end        no descriptors or payload; the successor may now take over
+//
+// A session's position is the sequence of the first message it has not been
+// sent, and its input is whatever it had read but not yet handled.
+
+enum HandoffKind {
+  kHandoffListeners = 1,
+  kHandoffSessions = 2,
+  kHandoffEnd = 3
+};
+
+// At most this many descriptors go in one record, below Linux's SCM_MAX_FD.
+enum { kHandoffBatch = 200 };
+
+struct HandoffSession {
+  int fd;
+  uint64_t position;
+  std::string input;
+};
+
+struct HandoffState {
+  std::vector<int> listeners;
+  std::vector<HandoffSession> sessions;
+};
+
+inline boost::system::system_error HandoffError(const char* what) {
+  return boost::system::system_error(
+      boost::system::error_code(errno, boost::system::system_category()),
+      what);
+}
+
+inline void HandoffWriteAll(int socket, const char* data, std::size_t length) {
+  while (length) {
+    ssize_t n = ::send(socket, data, length, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) throw HandoffError("handoff send");
+    data += n;
+    length -= n;
+  }
+}
+
+inline void HandoffReadAll(int socket, char* data, std::size_t length) {
+  while (length) {
+    ssize_t n = ::recv(socket, data, length, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) throw HandoffError("handoff receive");
+    if (n == 0) {
+      errno = ECONNRESET;
+      throw HandoffError("handoff receive");
+    }
+    data += n;
+    length -= n;
+  }
+}
+
+inline void HandoffEncodeHeader(uint32_t kind, uint32_t count,
+                                uint64_t payload_bytes, char* out) {
+  std::memcpy(out, &kind, 4);
+  std::memcpy(out + 4, &count, 4);
+  std::memcpy(out + 8, &payload_bytes, 8);
+}
+
+// Sends one record; the header carries the descriptors.
+inline void SendHandoffRecord(int socket, HandoffKind kind,
+                              const int* fds, std::size_t count,
+                              const std::string& payload) {
+  char header[16];
+  HandoffEncodeHeader(kind, count, payload.size(), header);
+
+  iovec iov = { header, sizeof(header) };
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * kHandoffBatch));
+  if (count) {
+    msg.msg_control = control.data();
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+  }
+
+  ssize_t n;
+  do {
+    n = ::sendmsg(socket, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) throw HandoffError("handoff sendmsg");
+  HandoffWriteAll(socket, header + n, sizeof(header) - n);
+  HandoffWriteAll(socket, payload.data(), payload.size());
+}
+
+inline void SendHandoff(int socket, const HandoffState& state) {
+  SendHandoffRecord(socket, kHandoffListeners, state.listeners.data(),
+                    state.listeners.size(), std::string());
+
+  for (std::size_t i = 0; i < state.sessions.size(); i += kHandoffBatch) {
+    std::size_t n = std::min<std::size_t>(kHandoffBatch,
+                                          state.sessions.size() - i);
+    std::vector<int> fds;
+    std::string payload;
+    for (std::size_t j = i; j < i + n; ++j) {
+      const HandoffSession& session = state.sessions[j];
+      uint32_t input_bytes = session.input.size();
+      fds.push_back(session.fd);
+      payload.append(reinterpret_cast<const char*>(&session.position), 8);
+      payload.append(reinterpret_cast<const char*>(&input_bytes), 4);
+      payload.append(session.input);
+    }
+    SendHandoffRecord(socket, kHandoffSessions, fds.data(), n, payload);
+  }
+
+  SendHandoffRecord(socket, kHandoffEnd, 0, 0, std::string());
+}
+
+inline void CloseHandoffFds(const std::vector<int>& fds) {
+  for (int fd : fds)
+    ::close(fd);
+}
+
+// Closes every descriptor in state and empties it.
+inline void CloseHandoff(HandoffState& state) {
+  CloseHandoffFds(state.listeners);
+  for (const HandoffSession& session : state.sessions)
+    ::close(session.fd);
+  state.listeners.clear();
+  state.sessions.clear();
+}
+
+// Receives records until the end record, adding their descriptors to state.
+// On failure every descriptor received is closed, including those already
+// in state, and state is left empty.
+inline void ReceiveHandoff(int socket, HandoffState& state) {
+  std::vector<int> fds;  // The current record's, until they are in state.
+  try {
+    for (;;) {
+      char header[16];
+      iovec iov = { header, sizeof(header) };
+      std::vector<char> control(CMSG_SPACE(sizeof(int) * kHandoffBatch));
+      msghdr msg;
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.data();
+      msg.msg_controllen = control.size();
+
+      ssize_t n;
+      do {
+        n = ::recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+      } while (n < 0 && errno == EINTR);
+      if (n < 0) throw HandoffError("handoff recvmsg");
+      if (n == 0) {
+        errno = ECONNRESET;
+        throw HandoffError("handoff recvmsg");
+      }
+
+      for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+          std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+          const int* data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+          fds.insert(fds.end(), data, data + count);
+        }
+      }
+      // Descriptors that did not fit were closed by the kernel, so the
+      // record cannot be used.
+      if (msg.msg_flags & MSG_CTRUNC) {
+        errno = EPROTO;
+        throw HandoffError("handoff descriptors truncated");
+      }
+      HandoffReadAll(socket, header + n, sizeof(header) - n);
+
+      uint32_t kind, count;
+      uint64_t payload_bytes;
+      std::memcpy(&kind, header, 4);
+      std::memcpy(&count, header + 4, 4);
+      std::memcpy(&payload_bytes, header + 8, 8);
+
+      std::string payload(payload_bytes, '\0');
+      HandoffReadAll(socket, &payload[0], payload_bytes);
+
+      if (kind == kHandoffEnd) {
+        CloseHandoffFds(fds);
+        return;
+      }
+      if (fds.size() != count) {
+        errno = EPROTO;
+        throw HandoffError("handoff descriptors");
+      }
+
+      if (kind == kHandoffListeners) {
+        state.listeners.insert(state.listeners.end(), fds.begin(), fds.end());
+        fds.clear();
+      } else if (kind == kHandoffSessions) {
+        const char* p = payload.data();
+        const char* end = p + payload.size();
+        std::size_t taken = 0;
+        for (; taken < fds.size(); ++taken) {
+          HandoffSession session = { fds[taken], 0, std::string() };
+          uint32_t input_bytes = 0;
+          if (end - p < 12) break;
+          std::memcpy(&session.position, p, 8);
+          std::memcpy(&input_bytes, p + 8, 4);
+          p += 12;
+          if (uint64_t(end - p) < input_bytes) break;
+          session.input.assign(p, input_bytes);
+          p += input_bytes;
+          state.sessions.push_back(session);
+        }
+        fds.erase(fds.begin(), fds.begin() + taken);
+        if (!fds.empty()) {
+          errno = EPROTO;
+          throw HandoffError("handoff sessions");
+        }
+      } else {
+        // A kind this version does not know.
+        CloseHandoffFds(fds);
+        fds.clear();
+      }
+    }
+  }
+  catch (...) {
+    CloseHandoffFds(fds);
+    CloseHandoff(state);
+    throw;
+  }
+}
+
+// Connects to a running server's handoff socket at path and receives what
+// it hands over. Blocks until the old server has drained its sessions.
+inline void TakeOver(const std::string& path, HandoffState& state) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    throw HandoffError("handoff connect");
+  }
+  std::memcpy(address.sun_path, path.data(), path.size());
+
+  int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket < 0) throw HandoffError("handoff socket");
+  if (::connect(socket, reinterpret_cast<sockaddr*>(&address),
+                sizeof(address)) != 0) {
+    ::close(socket);
+    throw HandoffError("handoff connect");
+  }
+
+  try {
+    ReceiveHandoff(socket, state);
+  }
+  catch (...) {
+    ::close(socket);
+    throw;
+  }
+  ::close(socket);
+}
+
+#endif  // HANDOFF_H_
@@ -0,0 +1,123 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <atomic>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+// Log-linear (HDR style) histogram of non-negative integer values. Each
+// power-of-two range is split into 32 linear sub-buckets, giving ~3% relative
+// error over the full 64-bit range in a fixed 15KB of counts.
+//
+// Record() is single writer: the owning thread updates buckets with relaxed
+// load/store pairs rather than locked read-modify-write instructions. Any
+// thread may read a histogram concurrently, e.g. to Merge() it into a
+// snapshot, and will see each bucket as some recent value.
+class Histogram {
+ public:
+  enum { kSubBucketBits = 5, kSubBuckets = 1 << kSubBucketBits };
+  enum { kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets };
+
+  Histogram() { Reset(); }
+
+  void Record(uint64_t value) {
+    Bump(counts_[Index(value)], 1);
+    Bump(count_, 1);
+    Bump(sum_, value);
+    if (value > max_.load(std::memory_order_relaxed))
+      max_.store(value, std::memory_order_relaxed);
+  }
+
+  void Merge(const Histogram& other) {
+    for (int i = 0; i < kBuckets; ++i) {
+      uint64_t n = other.counts_[i].load(std::memory_order_relaxed);
+      if (n) Bump(counts_[i], n);
+    }
+    Bump(count_, other.Count());
+    Bump(sum_, other.sum_.load(std::memory_order_relaxed));
+    if (other.Max() > Max())
+      max_.store(other.Max(), std::memory_order_relaxed);
+  }
+
+  void Reset() {
+    for (int i = 0; i < kBuckets; ++i)
+      counts_[i].store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+
+  double Mean() const {
+    uint64_t n = Count();
+    return n ? double(sum_.load(std::memory_order_relaxed)) / n : 0.0;
+  }
+
+  // Returns the upper bound of the bucket holding the given percentile
+  // (0-100), clamped to the largest value recorded.
+  uint64_t Percentile(double percentile) const {
+    uint64_t n = Count();
+    if (n == 0) return 0;
+
+    uint64_t rank = uint64_t(percentile / 100.0 * n + 0.5);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += counts_[i].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        uint64_t high = UpperBound(i);
+        return high < Max() ? high : Max();
+      }
+    }
+    return Max();
+  }
+
+  // Writes "count=.. p50=.. p99=.. p99.9=.. max=.." with values divided by
+  // scale, e.g. 1000 to print nanosecond samples as microseconds.
+  void Print(std::ostream& os, double scale = 1.0) const {
+    std::ios::fmtflags flags = os.flags();
+    os << std::fixed << std::setprecision(1)
+       << "count=" << Count()
+       << " p50=" << Percentile(50.0) / scale
+       << " p99=" << Percentile(99.0) / scale
+       << " p99.9=" << Percentile(99.9) / scale
+       << " max=" << Max() / scale;
+    os.flags(flags);
+  }
+
+  static int Index(uint64_t value) {
+    if (value < kSubBuckets) return int(value);
+    int shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + int(value >> shift) - kSubBuckets;
+  }
+
+  static uint64_t LowerBound(int index) {
+    if (index < kSubBuckets) return uint64_t(index);
+    int shift = index / kSubBuckets - 1;
+    return uint64_t(index % kSubBuckets + kSubBuckets) << shift;
+  }
+
+  static uint64_t UpperBound(int index) {
+    if (index + 1 >= kBuckets) return UINT64_MAX;
+    return LowerBound(index + 1) - 1;
+  }
+
+ private:
+  Histogram(const Histogram&);
+  Histogram& operator=(const Histogram&);
+
+  static void Bump(std::atomic<uint64_t>& v, uint64_t n) {
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> counts_[kBuckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+};
+
+#endif  // HISTOGRAM_H_
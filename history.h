@@ -0,0 +1,104 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// The message history kept in memory when there is no journal. Messages are
+// stored end to end in wire form, "<msg>\n", in large chunks, and where each
+// one starts is kept in fixed-size index blocks. Appending copies the
+// message but allocates only when a chunk or an index block fills, so a
+// steady stream of messages costs no allocation per message.
+class History {
+ public:
+  enum { kChunkSize = 1 << 20, kIndexBlock = 1 << 16 };
+
+  History() : count_(0), bytes_(0) {}
+
+  uint64_t count() const { return count_; }
+  uint64_t bytes() const { return bytes_; }
+
+  void Append(const std::string& msg) {
+    std::size_t length = msg.size() + 1;
+    if (chunks_.empty() ||
+        chunks_.back().capacity - chunks_.back().used < length)
+      AddChunk(length);
+
+    Chunk& chunk = chunks_.back();
+    char* p = chunk.data.get() + chunk.used;
+    std::memcpy(p, msg.data(), msg.size());
+    p[msg.size()] = '\n';
+
+    if (count_ % kIndexBlock == 0)
+      index_.emplace_back(new Entry[kIndexBlock]);
+    Entry& entry = index_.back()[count_ % kIndexBlock];
+    entry.chunk = chunks_.size() - 1;
+    entry.offset = chunk.used;
+    entry.length = msg.size();
+
+    chunk.used += length;
+    ++chunk.count;
+    ++count_;
+    bytes_ += length;
+  }
+
+  // Calls f(data, length) with each message from the first'th (counting
+  // from 0) on, without its newline.
+  template <typename F>
+  void Replay(uint64_t first, F f) const {
+    for (uint64_t i = first; i < count_; ++i) {
+      const Entry& entry = index_[i / kIndexBlock][i % kIndexBlock];
+      f(chunks_[entry.chunk].data.get() + entry.offset,
+        std::size_t(entry.length));
+    }
+  }
+
+  // Calls f(data, length, count) with the whole history in order, as runs
+  // of count messages in wire form. Appending never moves or changes a
+  // run's bytes, so they may be read for as long as the History lives.
+  template <typename F>
+  void ForEachRun(F f) const {
+    for (const Chunk& chunk : chunks_)
+      f(static_cast<const char*>(chunk.data.get()), chunk.used,
+        uint64_t(chunk.count));
+  }
+
+ private:
+  History(const History&);
+  History& operator=(const History&);
+
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    std::size_t capacity;
+    std::size_t used;
+    std::size_t count;
+  };
+
+  struct Entry {
+    uint64_t chunk;
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  // A message larger than a chunk gets a chunk of its own size.
+  void AddChunk(std::size_t length) {
+    std::size_t capacity = std::max<std::size_t>(kChunkSize, length);
+    chunks_.push_back(Chunk());
+    Chunk& chunk = chunks_.back();
+    chunk.data.reset(new char[capacity]);
+    chunk.capacity = capacity;
+    chunk.used = 0;
+    chunk.count = 0;
+  }
+
+  std::vector<Chunk> chunks_;
+  std::vector<std::unique_ptr<Entry[]> > index_;
+  uint64_t count_;
+  uint64_t bytes_;
+};
+
+#endif  // HISTORY_H_
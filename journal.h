@@ -0,0 +1,610 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/system/system_error.hpp>
+
+#include "metrics.h"
+
+// How appended messages are made durable. Appends only copy into a shared
+// mapping, so without a sync they survive a process crash but not a machine
+// crash. Syncs run on the journal's flusher thread, never on the publisher.
+enum JournalSync {
+  kSyncNone,      // Leave write-back to the kernel.
+  kSyncInterval,  // msync whatever is dirty every sync_ms.
+  kSyncGroup      // msync as soon as anything is dirty; messages appended
+                  // while a sync runs are committed together by the next.
+};
+
+struct JournalOptions {
+  JournalOptions()
+    : segment_size(64 << 20), max_segments(0), sync(kSyncNone),
+      sync_ms(100) {}
+
+  std::string directory;
+  std::size_t segment_size;
+  // Segments kept, the oldest being deleted as new ones are started; 0
+  // keeps them all.
+  std::size_t max_segments;
+  JournalSync sync;
+  int sync_ms;
+};
+
+// What a snapshot records of a segment, so that the segment can be reopened
+// without scanning the messages it already held.
+struct JournalSegmentState {
+  uint64_t base;
+  uint64_t count;
+  std::size_t size;
+  std::vector<std::size_t> index;
+};
+
+inline boost::system::system_error JournalError(const std::string& what) {
+  return boost::system::system_error(
+      boost::system::error_code(errno, boost::system::system_category()),
+      what);
+}
+
+// One preallocated, memory-mapped journal file holding consecutive messages
+// from base(), each stored as it goes on the wire, "<msg>\n". The unused tail
+// of the file is zeros, so on reopening the end is found by scanning for the
+// first NUL; a partly written message before it is discarded.
+//
+// Every kIndexStride'th message's offset is kept in a sparse index, so
+// finding a message scans at most kIndexStride - 1 others.
+//
+// Given its state from a snapshot, a segment trusts it if it still fits the
+// file and scans only what was appended afterwards.
+class JournalSegment {
+ public:
+  enum { kIndexStride = 64 };
+
+  // Opens the segment at path, creating it with the given capacity if it
+  // does not exist.
+  JournalSegment(const std::string& path, uint64_t base, std::size_t capacity,
+                 const JournalSegmentState* state = 0)
+    : path_(path),
+      base_(base),
+      count_(0),
+      size_(0),
+      capacity_(capacity),
+      data_(0) {
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0) throw JournalError("open " + path);
+
+    struct stat st;
+    if (::fstat(fd_, &st) != 0) {
+      ::close(fd_);
+      throw JournalError("stat " + path);
+    }
+
+    if (st.st_size == 0) {
+      // Allocate the blocks now, so that a full disk fails here rather than
+      // as a SIGBUS when a page of the mapping is first written.
+      errno = ::posix_fallocate(fd_, 0, capacity_);
+      if (errno != 0) {
+        ::close(fd_);
+        throw JournalError("allocate " + path);
+      }
+    } else {
+      capacity_ = st.st_size;
+    }
+
+    void* data = ::mmap(0, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd_, 0);
+    if (data == MAP_FAILED) {
+      ::close(fd_);
+      throw JournalError("mmap " + path);
+    }
+    data_ = static_cast<char*>(data);
+
+    if (state && Fits(*state)) {
+      count_ = state->count;
+      size_ = state->size;
+      index_ = state->index;
+    }
+    Recover();
+  }
+
+  ~JournalSegment() {
+    ::munmap(data_, capacity_);
+    ::close(fd_);
+  }
+
+  const std::string& path() const { return path_; }
+  uint64_t base() const { return base_; }
+  uint64_t end() const { return base_ + count_; }  // Next sequence.
+  std::size_t size() const { return size_; }  // Bytes used.
+  std::size_t capacity() const { return capacity_; }
+  const char* data() const { return data_; }
+  int fd() const { return fd_; }
+
+  JournalSegmentState state() const {
+    JournalSegmentState state = { base_, count_, size_, index_ };
+    return state;
+  }
+
+  // Returns false if the message does not fit.
+  bool Append(const char* msg, std::size_t length) {
+    if (size_ + length + 1 > capacity_) return false;
+
+    if (count_ % kIndexStride == 0) index_.push_back(size_);
+    std::memcpy(data_ + size_, msg, length);
+    data_[size_ + length] = '\n';
+    size_ += length + 1;
+    ++count_;
+    return true;
+  }
+
+  // Returns the offset of the given message, base() <= sequence < end().
+  std::size_t Find(uint64_t sequence) const {
+    uint64_t n = sequence - base_;
+    std::size_t offset = index_[n / kIndexStride];
+    for (n %= kIndexStride; n; --n) {
+      const char* nl = static_cast<const char*>(
+          std::memchr(data_ + offset, '\n', size_ - offset));
+      offset = nl - data_ + 1;
+    }
+    return offset;
+  }
+
+  // Renames an empty segment to path and makes it start at base, for a
+  // segment created before its base was known.
+  void Claim(const std::string& path, uint64_t base) {
+    if (std::rename(path_.c_str(), path.c_str()) != 0)
+      throw JournalError("rename " + path_);
+    path_ = path;
+    base_ = base;
+  }
+
+  // Writes back the dirty pages in [from, to) and waits for them. Returns
+  // false, with errno set, if they could not be written.
+  bool Sync(std::size_t from, std::size_t to) const {
+    std::size_t page = ::sysconf(_SC_PAGESIZE);
+    from -= from % page;
+    return ::msync(data_ + from, to - from, MS_SYNC) == 0;
+  }
+
+ private:
+  JournalSegment(const JournalSegment&);
+  JournalSegment& operator=(const JournalSegment&);
+
+  bool Fits(const JournalSegmentState& state) const {
+    return state.base == base_ && state.size <= capacity_ &&
+           state.index.size() == (state.count + kIndexStride - 1) /
+                                 kIndexStride &&
+           (state.size == 0 || data_[state.size - 1] == '\n');
+  }
+
+  // Scans for messages after the first size_ bytes.
+  void Recover() {
+    const char* nul = static_cast<const char*>(
+        std::memchr(data_ + size_, '\0', capacity_ - size_));
+    std::size_t limit = nul ? nul - data_ : capacity_;
+
+    const char* p = data_ + size_;
+    const char* nl;
+    while ((nl = static_cast<const char*>(
+                std::memchr(p, '\n', data_ + limit - p))) != 0) {
+      if (count_ % kIndexStride == 0) index_.push_back(p - data_);
+      ++count_;
+      p = nl + 1;
+    }
+    size_ = p - data_;
+
+    // Clear a torn message so that it cannot be read back as a prefix of
+    // whatever is appended over it.
+    if (limit > size_) std::memset(data_ + size_, 0, limit - size_);
+  }
+
+  std::string path_;
+  uint64_t base_;
+  uint64_t count_;
+  std::size_t size_;
+  std::size_t capacity_;
+  char* data_;
+  int fd_;
+  std::vector<std::size_t> index_;
+};
+
+// A run of whole messages in a segment, for sending straight from the file.
+// Holding the segment keeps its descriptor open.
+struct JournalRange {
+  std::shared_ptr<JournalSegment> segment;
+  std::size_t offset;
+  std::size_t length;
+  uint64_t messages;
+};
+
+// An append-only history of published messages in a directory of segments
+// named after their first sequence number. Sequences start at 1 and carry on
+// from the last message found when the journal is reopened.
+//
+// Each segment must start where the one before it ends. On opening, a gap
+// (say, a segment that lost its tail in a crash after the next was started)
+// ends the journal: the segments after it are renamed aside, to
+// "<name>.gap", rather than let sequences shift.
+//
+// With max_segments set, starting a segment deletes the oldest beyond that
+// many. A deleted segment's file is unlinked at once but stays mapped until
+// the last range or sync holding it lets go.
+//
+// Creating a segment (allocating its blocks and mapping it) takes
+// milliseconds, so the flusher thread keeps the next one ready as a spare
+// file, "spare.<pid>.tmp", and starting a segment only renames it. Should
+// there be no spare, or the message not fit it, the publishing thread
+// creates the segment itself.
+//
+// Append and Replay belong to the publishing thread; only the flusher thread
+// shares the journal, through the list of unsynced ranges and the spare.
+class Journal {
+ public:
+  // Segments described by a snapshot's states are reopened without being
+  // rescanned.
+  Journal(const JournalOptions& options, Metrics& metrics,
+          const std::vector<JournalSegmentState>& states =
+              std::vector<JournalSegmentState>())
+    : options_(options),
+      metrics_(metrics),
+      stopping_(false),
+      flusher_idle_(false),
+      spare_wanted_(true) {
+    if (::mkdir(options_.directory.c_str(), 0755) != 0 && errno != EEXIST)
+      throw JournalError("mkdir " + options_.directory);
+
+    Open(states);
+    flusher_ = std::thread(&Journal::Flush, this);
+  }
+
+  ~Journal() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    dirty_.notify_one();
+    flusher_.join();
+    if (spare_) ::unlink(spare_->path().c_str());
+  }
+
+  uint64_t first_sequence() const {
+    return segments_.empty() ? 1 : segments_.begin()->second->base();
+  }
+
+  uint64_t next_sequence() const {
+    return segments_.empty() ? 1 : segments_.rbegin()->second->end();
+  }
+
+  void GetStates(std::vector<JournalSegmentState>& states) const {
+    for (const auto& segment : segments_)
+      states.push_back(segment.second->state());
+  }
+
+  // Appends a message, rolling to a new segment when the current one is
+  // full. Returns false, having counted the error, if it could not be
+  // stored.
+  bool Append(const std::string& msg) {
+    std::shared_ptr<JournalSegment> segment;
+    std::size_t from;
+    try {
+      segment = Current();
+      from = segment->size();
+      if (!segment->Append(msg.data(), msg.size())) {
+        segment = Roll(msg.size() + 1);
+        from = 0;
+        segment->Append(msg.data(), msg.size());
+      }
+    }
+    catch (std::exception& e) {
+      std::cerr << "Journal: " << e.what() << "\n";
+      metrics_.Local().journal_errors.Add(1);
+      return false;
+    }
+
+    ServerStats& stats = metrics_.Local();
+    stats.journal_appends.Add(1);
+    stats.journal_bytes.Add(msg.size() + 1);
+
+    if (options_.sync != kSyncNone) MarkDirty(segment, from);
+    return true;
+  }
+
+  // Appends the ranges holding every message from sequence on, as they
+  // stand now; later appends are not included.
+  void Ranges(uint64_t sequence, std::vector<JournalRange>& ranges) const {
+    sequence = std::max(sequence, first_sequence());
+    Segments::const_iterator i = segments_.upper_bound(sequence);
+    if (i != segments_.begin()) --i;
+
+    for (; i != segments_.end(); ++i) {
+      const std::shared_ptr<JournalSegment>& segment = i->second;
+      if (sequence >= segment->end()) continue;
+      if (segment->base() > sequence) break;  // Never past a gap.
+
+      std::size_t offset = segment->Find(sequence);
+      JournalRange range = { segment, offset, segment->size() - offset,
+                             segment->end() - sequence };
+      ranges.push_back(range);
+      sequence = segment->end();
+    }
+  }
+
+  // Calls f(data, length) with each message from sequence on, without its
+  // newline.
+  template <typename F>
+  void Replay(uint64_t sequence, F f) const {
+    std::vector<JournalRange> ranges;
+    Ranges(sequence, ranges);
+    for (const JournalRange& range : ranges) {
+      const char* p = range.segment->data() + range.offset;
+      const char* end = p + range.length;
+      while (p < end) {
+        const char* nl = static_cast<const char*>(
+            std::memchr(p, '\n', end - p));
+        f(p, nl - p);
+        p = nl + 1;
+      }
+    }
+  }
+
+ private:
+  typedef std::map<uint64_t, std::shared_ptr<JournalSegment> > Segments;
+
+  // A range of a segment appended to but not yet synced.
+  struct Dirty {
+    std::shared_ptr<JournalSegment> segment;
+    std::size_t from;
+    std::size_t to;
+  };
+
+  Journal(const Journal&);
+  Journal& operator=(const Journal&);
+
+  // Named for the process, so that a predecessor that still has the journal
+  // open after a handoff does not remove its successor's spare.
+  std::string SparePath() const {
+    return options_.directory + "/spare." + std::to_string(::getpid()) +
+           ".tmp";
+  }
+
+  std::string SegmentPath(uint64_t base) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%020llu.journal",
+                  static_cast<unsigned long long>(base));
+    return options_.directory + "/" + name;
+  }
+
+  void Open(const std::vector<JournalSegmentState>& states) {
+    DIR* dir = ::opendir(options_.directory.c_str());
+    if (!dir) throw JournalError("opendir " + options_.directory);
+
+    // Spares left by earlier processes are removed.
+    std::vector<uint64_t> bases;
+    std::vector<std::string> spares;
+    while (dirent* entry = ::readdir(dir)) {
+      unsigned long long base;
+      char suffix[16];
+      if (std::sscanf(entry->d_name, "%20llu.%15s", &base, suffix) == 2 &&
+          std::strcmp(suffix, "journal") == 0)
+        bases.push_back(base);
+      else if (std::sscanf(entry->d_name, "spare.%20llu.%15s", &base,
+                           suffix) == 2 && std::strcmp(suffix, "tmp") == 0)
+        spares.push_back(options_.directory + "/" + entry->d_name);
+    }
+    ::closedir(dir);
+    for (const std::string& spare : spares)
+      ::unlink(spare.c_str());
+
+    std::map<uint64_t, const JournalSegmentState*> known;
+    for (const JournalSegmentState& state : states)
+      known[state.base] = &state;
+
+    for (uint64_t base : bases) {
+      const JournalSegmentState* state =
+          known.count(base) ? known[base] : 0;
+      segments_[base].reset(new JournalSegment(SegmentPath(base), base,
+                                               options_.segment_size, state));
+    }
+    TruncateAtGap();
+    Retire();
+  }
+
+  void TruncateAtGap() {
+    Segments::iterator i = segments_.begin();
+    uint64_t end = 0;
+    for (; i != segments_.end(); ++i) {
+      if (i != segments_.begin() && i->first != end) break;
+      end = i->second->end();
+    }
+
+    while (i != segments_.end()) {
+      std::string path = i->second->path();
+      std::cerr << "Journal: " << path << " does not follow on from sequence "
+                << end << ", setting it aside\n";
+      metrics_.Local().journal_errors.Add(1);
+      segments_.erase(i++);
+      if (std::rename(path.c_str(), (path + ".gap").c_str()) != 0)
+        throw JournalError("rename " + path);
+    }
+  }
+
+  std::shared_ptr<JournalSegment> Current() {
+    if (segments_.empty()) Roll(0);
+    return segments_.rbegin()->second;
+  }
+
+  std::shared_ptr<JournalSegment> Roll(std::size_t min_capacity) {
+    uint64_t base = next_sequence();
+
+    // An empty segment too small for the message is replaced, not followed.
+    Segments::iterator last = segments_.find(base);
+    if (last != segments_.end()) {
+      ::unlink(last->second->path().c_str());
+      segments_.erase(last);
+    }
+
+    std::shared_ptr<JournalSegment> segment = TakeSpare(min_capacity, base);
+    if (!segment) {
+      segment.reset(new JournalSegment(
+          SegmentPath(base), base,
+          std::max(options_.segment_size, min_capacity)));
+    }
+    segments_[base] = segment;
+    Retire();
+    return segment;
+  }
+
+  // Takes the spare segment as the one starting at base, if there is a
+  // spare with room for min_capacity bytes, and has the flusher make
+  // another.
+  std::shared_ptr<JournalSegment> TakeSpare(std::size_t min_capacity,
+                                            uint64_t base) {
+    std::shared_ptr<JournalSegment> spare;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (spare_ && spare_->capacity() < min_capacity) return spare;
+      spare.swap(spare_);
+    }
+
+    // Renamed before the next spare can be made at the same path.
+    if (spare) spare->Claim(SegmentPath(base), base);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      spare_wanted_ = true;
+    }
+    dirty_.notify_one();
+    return spare;
+  }
+
+  void Retire() {
+    while (options_.max_segments &&
+           segments_.size() > options_.max_segments) {
+      ::unlink(segments_.begin()->second->path().c_str());
+      segments_.erase(segments_.begin());
+      metrics_.Local().journal_segments_deleted.Add(1);
+    }
+  }
+
+  void MarkDirty(const std::shared_ptr<JournalSegment>& segment,
+                 std::size_t from) {
+    bool wake;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!unsynced_.empty() && unsynced_.back().segment == segment) {
+        unsynced_.back().to = segment->size();
+      } else {
+        Dirty dirty = { segment, from, segment->size() };
+        unsynced_.push_back(dirty);
+      }
+      wake = flusher_idle_;
+      flusher_idle_ = false;
+    }
+
+    // Only an idle flusher needs waking; a busy one picks these messages up
+    // with its next sync.
+    if (wake && options_.sync == kSyncGroup) dirty_.notify_one();
+  }
+
+  // The flusher thread. Makes a spare segment whenever one is wanted, and
+  // syncs on the policy's schedule until the journal is destroyed, then
+  // syncs whatever is left.
+  void Flush() {
+    std::vector<Dirty> syncing;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      flusher_idle_ = true;
+      if (options_.sync == kSyncInterval) {
+        dirty_.wait_for(lock, std::chrono::milliseconds(options_.sync_ms),
+                        [this]() { return stopping_ || spare_wanted_; });
+      } else {
+        bool group = options_.sync == kSyncGroup;
+        dirty_.wait(lock, [this, group]() {
+          return stopping_ || spare_wanted_ || (group && !unsynced_.empty());
+        });
+      }
+      flusher_idle_ = false;
+
+      syncing.swap(unsynced_);
+      bool stopping = stopping_;
+      bool make_spare = spare_wanted_ && !stopping;
+      spare_wanted_ = false;
+      lock.unlock();
+
+      if (make_spare) MakeSpare();
+
+      if (!syncing.empty()) {
+        ServerStats& stats = metrics_.Local();
+        Clock::time_point start = Clock::now();
+        for (const Dirty& dirty : syncing) {
+          if (!dirty.segment->Sync(dirty.from, dirty.to)) {
+            std::cerr << "Journal: " << JournalError(
+                "msync " + dirty.segment->path()).what() << "\n";
+            stats.journal_errors.Add(1);
+          }
+        }
+
+        stats.journal_syncs.Add(1);
+        stats.journal_sync_ns.Record(ElapsedNs(start));
+        syncing.clear();
+      }
+
+      lock.lock();
+      if (stopping && unsynced_.empty()) return;
+    }
+  }
+
+  // Creates the spare segment, on the flusher thread. If it cannot be
+  // created, the publishing thread will try for itself when it needs one.
+  void MakeSpare() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (spare_) return;
+    }
+
+    std::shared_ptr<JournalSegment> spare;
+    try {
+      spare.reset(new JournalSegment(SparePath(), 0, options_.segment_size));
+    }
+    catch (std::exception& e) {
+      std::cerr << "Journal: " << e.what() << "\n";
+      metrics_.Local().journal_errors.Add(1);
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    spare_ = spare;
+  }
+
+  JournalOptions options_;
+  Metrics& metrics_;
+  Segments segments_;
+
+  std::mutex mutex_;
+  std::condition_variable dirty_;
+  std::vector<Dirty> unsynced_;
+  bool stopping_;
+  bool flusher_idle_;
+  std::shared_ptr<JournalSegment> spare_;  // Ready to become the next.
+  bool spare_wanted_;
+  std::thread flusher_;
+};
+
+#endif  // JOURNAL_H_
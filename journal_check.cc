@@ -0,0 +1,211 @@
+// Exercises the on-disk journal (journal.h) in a scratch directory: appends
+// and replays across segments, recovery of a torn tail, group commit,
+// retention and a gap between segments. Prints what it measured and exits
+// non-zero if any check fails.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "journal.h"
+
+namespace {
+
+bool failed = false;
+
+void Check(bool ok, const std::string& what) {
+  std::cout << (ok ? "ok      " : "FAILED  ") << what << "\n";
+  if (!ok) failed = true;
+}
+
+std::string Message(uint64_t sequence) {
+  return "message " + std::to_string(sequence);
+}
+
+// The files in directory whose names end in suffix, in name order.
+std::vector<std::string> Files(const std::string& directory,
+                               const std::string& suffix = std::string()) {
+  std::vector<std::string> files;
+  DIR* dir = ::opendir(directory.c_str());
+  if (!dir) return files;
+  while (dirent* entry = ::readdir(dir)) {
+    std::string name(entry->d_name);
+    if (name[0] != '.' && name.size() >= suffix.size() &&
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+      files.push_back(name);
+  }
+  ::closedir(dir);
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+void RemoveAll(const std::string& directory) {
+  for (const std::string& file : Files(directory))
+    ::unlink((directory + "/" + file).c_str());
+  ::rmdir(directory.c_str());
+}
+
+// Whether replaying from sequence gives Message(sequence) onwards, up to but
+// not including end.
+bool ReplaysFrom(const Journal& journal, uint64_t sequence, uint64_t end) {
+  bool ok = true;
+  journal.Replay(sequence, [&](const char* data, std::size_t length) {
+    ok = ok && std::string(data, length) == Message(sequence++);
+  });
+  return ok && sequence == end;
+}
+
+// Zeroes the last length bytes in use in a segment file, as a crash part
+// way through writing its last message would leave it.
+bool Tear(const std::string& path, std::size_t length) {
+  int fd = ::open(path.c_str(), O_RDWR);
+  if (fd < 0) return false;
+  struct stat st;
+  std::vector<char> data;
+  if (::fstat(fd, &st) == 0) {
+    data.resize(st.st_size);
+    if (::pread(fd, &data[0], data.size(), 0) != ssize_t(data.size()))
+      data.clear();
+  }
+
+  std::size_t used = data.size();
+  while (used && data[used - 1] == '\0') --used;
+  bool ok = used >= length &&
+            ::pwrite(fd, std::string(length, '\0').data(), length,
+                     used - length) == ssize_t(length);
+  ::close(fd);
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string directory = argc > 1
+      ? argv[1] : "/tmp/journal_check." + std::to_string(::getpid());
+  RemoveAll(directory);
+
+  Metrics metrics;
+  JournalOptions options;
+  options.directory = directory;
+  options.segment_size = 1 << 20;
+  const uint64_t kMessages = 200000;
+
+  try {
+    {
+      // The flusher thread makes the first spare segment.
+      Journal journal(options, metrics);
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      Check(Files(directory, ".tmp").size() == 1, "spare segment made");
+
+      // Each roll takes the spare the flusher made after the one before, so
+      // pause now and then to let it.
+      int64_t total = 0;
+      std::vector<int64_t> rolls;
+      const JournalSegment* segment = 0;
+      for (uint64_t i = 1; i <= kMessages; ++i) {
+        Clock::time_point start = Clock::now();
+        journal.Append(Message(i));
+        int64_t ns = ElapsedNs(start);
+        total += ns;
+
+        std::vector<JournalRange> last;
+        journal.Ranges(i, last);
+        if (segment && last[0].segment.get() != segment) rolls.push_back(ns);
+        segment = last[0].segment.get();
+        if (i % 20000 == 0)
+          std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      }
+      std::cout << "appended " << kMessages << " messages over "
+                << Files(directory, ".journal").size() << " segments, "
+                << total / kMessages << " ns each; appends that rolled:";
+      for (int64_t ns : rolls)
+        std::cout << " " << ns << " ns";
+      std::cout << "\n";
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      Check(Files(directory, ".tmp").size() == 1, "next spare made");
+      Check(journal.next_sequence() == kMessages + 1, "sequences run on");
+      Check(ReplaysFrom(journal, 1, kMessages + 1), "replay from the start");
+    }
+
+    {
+      Journal journal(options, metrics);
+      Check(journal.next_sequence() == kMessages + 1, "reopen finds the end");
+      Check(ReplaysFrom(journal, 1, kMessages + 1), "replay after reopening");
+      Check(ReplaysFrom(journal, kMessages - 5, kMessages + 1),
+            "replay from the tail");
+    }
+
+    // Cut the last message short: it is dropped on reopening, and what is
+    // appended next does not pick up its remains.
+    std::vector<std::string> files = Files(directory, ".journal");
+    Check(Tear(directory + "/" + files.back(), 3), "tear the last message");
+    {
+      Journal journal(options, metrics);
+      Check(journal.next_sequence() == kMessages,
+            "torn message dropped on reopening");
+      journal.Append(Message(kMessages));
+      Check(ReplaysFrom(journal, kMessages - 5, kMessages + 1),
+            "append after a torn tail");
+    }
+
+    // Tear a segment in the middle: the journal ends before the gap.
+    Check(Tear(directory + "/" + files[files.size() / 2], 3),
+          "tear a middle segment");
+    {
+      Journal journal(options, metrics);
+      uint64_t end = journal.next_sequence();
+      Check(end < kMessages && ReplaysFrom(journal, 1, end),
+            "journal ends at the gap, at " + std::to_string(end));
+      std::size_t aside = Files(directory, ".gap").size();
+      Check(aside == files.size() - files.size() / 2 - 1,
+            "segments after the gap set aside");
+    }
+    RemoveAll(directory);
+
+    // Group commit: appends made while a sync runs share the next one.
+    Metrics group_metrics;
+    options.sync = kSyncGroup;
+    {
+      Journal journal(options, group_metrics);
+      for (uint64_t i = 1; i <= 1000; ++i)
+        journal.Append(Message(i));
+    }
+    ServerStats stats;
+    group_metrics.Aggregate(stats);
+    std::cout << "group commit: 1000 appends, "
+              << stats.journal_syncs.Value() << " syncs\n";
+    Check(stats.journal_syncs.Value() > 0 &&
+          stats.journal_syncs.Value() < 1000, "appends share syncs");
+    Check(stats.journal_errors.Value() == 0, "no sync errors");
+    RemoveAll(directory);
+
+    // Retention keeps the newest segments.
+    options.sync = kSyncNone;
+    options.max_segments = 2;
+    {
+      Journal journal(options, metrics);
+      for (uint64_t i = 1; i <= kMessages; ++i)
+        journal.Append(Message(i));
+      Check(Files(directory, ".journal").size() == 2,
+            "only max_segments kept");
+      Check(ReplaysFrom(journal, journal.first_sequence(), kMessages + 1),
+            "replay of what is kept");
+    }
+  }
+  catch (std::exception& e) {
+    std::cout << "FAILED  " << e.what() << "\n";
+    failed = true;
+  }
+  RemoveAll(directory);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,364 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "histogram.h"
+
+// Monotonic counter owned by a single thread. Increments are a relaxed
+// load/store pair, so the owning thread never issues a locked instruction
+// while other threads may still read a consistent value.
+class Counter {
+ public:
+  Counter() : value_(0) {}
+
+  void Add(int64_t n = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+
+  int64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_;
+};
+
+// Per-thread instances of Slot, each on its own cache lines, that can be
+// summed on demand. Local() returns the calling thread's slot, creating and
+// registering it on first use; ForEach() visits every registered slot.
+//
+// Each thread caches the last PerThread it used, per Slot type. A thread
+// that goes back and forth between instances finds its slot again under the
+// lock rather than registering another.
+template <typename Slot>
+class PerThread {
+ public:
+  PerThread() : id_(NextId()) {}
+
+  ~PerThread() {
+    for (Slot* slot : slots_) {
+      slot->~Slot();
+      free(slot);
+    }
+  }
+
+  Slot& Local() {
+    static thread_local Cache cache = { 0, 0 };
+    if (cache.owner != id_) {
+      cache.owner = id_;
+      cache.slot = Find();
+    }
+    return *cache.slot;
+  }
+
+  template <typename F>
+  void ForEach(F f) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const Slot* slot : slots_)
+      f(*slot);
+  }
+
+ private:
+  // Keyed by id rather than address so that a PerThread constructed where
+  // a destroyed one used to live never sees the old slot.
+  struct Cache {
+    uint64_t owner;
+    Slot* slot;
+  };
+
+  static uint64_t NextId() {
+    static std::atomic<uint64_t> next(1);
+    return next.fetch_add(1);
+  }
+
+  // Returns the calling thread's slot, registering one if it has none. A
+  // thread that reuses the id of one that has exited carries on with its
+  // slot, which the exited thread no longer touches.
+  //
+  // Slots are over-aligned, which plain operator new does not honour before
+  // C++17, so they are placed in cache-line aligned storage by hand.
+  Slot* Find() {
+    std::thread::id thread = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::size_t i = 0; i < threads_.size(); ++i)
+      if (threads_[i] == thread) return slots_[i];
+
+    void* p = 0;
+    if (posix_memalign(&p, 64, sizeof(Slot)) != 0)
+      throw std::bad_alloc();
+    Slot* slot = new (p) Slot;
+    slots_.push_back(slot);
+    threads_.push_back(thread);
+    return slot;
+  }
+
+  const uint64_t id_;
+  mutable std::mutex mutex_;
+  std::vector<Slot*> slots_;
+  std::vector<std::thread::id> threads_;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+inline uint64_t ElapsedNs(Clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now() - since).count();
+}
+
+// Counters and latency histograms maintained by the server, one instance per
+// I/O thread. Queue depth is a signed gauge: a message may be enqueued on one
+// thread and written on another, so only the sum over all threads is
+// meaningful.
+struct alignas(64) ServerStats {
+  Counter messages_published;
+  Counter deliveries;
+  Counter messages_written;
+  Counter bytes_written;
+  Counter heartbeat_replies;
+  Counter sessions_accepted;
+  Counter sessions_closed;
+  Counter sessions_handed_off;
+  Counter sessions_adopted;
+  Counter handoffs_failed;
+  Counter sessions_routed;
+  Counter cross_node_sessions;
+  Counter cross_node_deliveries;
+  Counter cross_node_bytes;
+  Counter session_allocs;
+  Counter deadline_disconnects;
+  Counter queued_messages;
+  Counter udp_send_calls;
+  Counter udp_datagrams_sent;
+  Counter udp_bytes_sent;
+  Counter udp_nacks_received;
+  Counter udp_retransmits;
+  Counter udp_replay_misses;
+  Counter udp_nacks_limited;
+  Counter rudp_sessions_opened;
+  Counter rudp_sessions_expired;
+  Counter rudp_frames_sent;
+  Counter rudp_retransmits;
+  Counter rudp_timeouts;
+  Counter session_throttles;
+  Counter slow_consumer_drops;
+  Counter slow_consumer_disconnects;
+  Counter topic_throttles;
+  Counter topic_drops;
+  Counter journal_appends;
+  Counter journal_bytes;
+  Counter journal_syncs;
+  Counter journal_errors;
+  Counter journal_segments_deleted;
+  Counter history_sends;
+  Counter history_bytes;
+  Counter history_messages;
+  Counter shm_messages;
+  Counter shm_bytes;
+  Counter shm_oversize;
+  Counter inproc_messages;
+  Counter inproc_drops;
+  Counter ingress_full;
+  Counter poll_sleeps;
+  Histogram queue_depth;
+  Histogram write_ns;
+  Histogram fanout_ns;
+  Histogram deliver_ns;
+  Histogram journal_sync_ns;
+  Histogram ingress_ns;
+
+  void Merge(const ServerStats& other) {
+    messages_published.Add(other.messages_published.Value());
+    deliveries.Add(other.deliveries.Value());
+    messages_written.Add(other.messages_written.Value());
+    bytes_written.Add(other.bytes_written.Value());
+    heartbeat_replies.Add(other.heartbeat_replies.Value());
+    sessions_accepted.Add(other.sessions_accepted.Value());
+    sessions_closed.Add(other.sessions_closed.Value());
+    sessions_handed_off.Add(other.sessions_handed_off.Value());
+    sessions_adopted.Add(other.sessions_adopted.Value());
+    handoffs_failed.Add(other.handoffs_failed.Value());
+    sessions_routed.Add(other.sessions_routed.Value());
+    cross_node_sessions.Add(other.cross_node_sessions.Value());
+    cross_node_deliveries.Add(other.cross_node_deliveries.Value());
+    cross_node_bytes.Add(other.cross_node_bytes.Value());
+    session_allocs.Add(other.session_allocs.Value());
+    deadline_disconnects.Add(other.deadline_disconnects.Value());
+    queued_messages.Add(other.queued_messages.Value());
+    udp_send_calls.Add(other.udp_send_calls.Value());
+    udp_datagrams_sent.Add(other.udp_datagrams_sent.Value());
+    udp_bytes_sent.Add(other.udp_bytes_sent.Value());
+    udp_nacks_received.Add(other.udp_nacks_received.Value());
+    udp_retransmits.Add(other.udp_retransmits.Value());
+    udp_replay_misses.Add(other.udp_replay_misses.Value());
+    udp_nacks_limited.Add(other.udp_nacks_limited.Value());
+    rudp_sessions_opened.Add(other.rudp_sessions_opened.Value());
+    rudp_sessions_expired.Add(other.rudp_sessions_expired.Value());
+    rudp_frames_sent.Add(other.rudp_frames_sent.Value());
+    rudp_retransmits.Add(other.rudp_retransmits.Value());
+    rudp_timeouts.Add(other.rudp_timeouts.Value());
+    session_throttles.Add(other.session_throttles.Value());
+    slow_consumer_drops.Add(other.slow_consumer_drops.Value());
+    slow_consumer_disconnects.Add(other.slow_consumer_disconnects.Value());
+    topic_throttles.Add(other.topic_throttles.Value());
+    topic_drops.Add(other.topic_drops.Value());
+    journal_appends.Add(other.journal_appends.Value());
+    journal_bytes.Add(other.journal_bytes.Value());
+    journal_syncs.Add(other.journal_syncs.Value());
+    journal_errors.Add(other.journal_errors.Value());
+    journal_segments_deleted.Add(other.journal_segments_deleted.Value());
+    history_sends.Add(other.history_sends.Value());
+    history_bytes.Add(other.history_bytes.Value());
+    history_messages.Add(other.history_messages.Value());
+    shm_messages.Add(other.shm_messages.Value());
+    shm_bytes.Add(other.shm_bytes.Value());
+    shm_oversize.Add(other.shm_oversize.Value());
+    inproc_messages.Add(other.inproc_messages.Value());
+    inproc_drops.Add(other.inproc_drops.Value());
+    ingress_full.Add(other.ingress_full.Value());
+    poll_sleeps.Add(other.poll_sleeps.Value());
+    queue_depth.Merge(other.queue_depth);
+    write_ns.Merge(other.write_ns);
+    fanout_ns.Merge(other.fanout_ns);
+    deliver_ns.Merge(other.deliver_ns);
+    journal_sync_ns.Merge(other.journal_sync_ns);
+    ingress_ns.Merge(other.ingress_ns);
+  }
+
+  void Print(std::ostream& os) const {
+    os << "messages_published " << messages_published.Value() << "\n"
+       << "deliveries " << deliveries.Value() << "\n"
+       << "messages_written " << messages_written.Value() << "\n"
+       << "bytes_written " << bytes_written.Value() << "\n"
+       << "heartbeat_replies " << heartbeat_replies.Value() << "\n"
+       << "sessions_accepted " << sessions_accepted.Value() << "\n"
+       << "sessions_closed " << sessions_closed.Value() << "\n"
+       << "sessions_handed_off " << sessions_handed_off.Value() << "\n"
+       << "sessions_adopted " << sessions_adopted.Value() << "\n"
+       << "handoffs_failed " << handoffs_failed.Value() << "\n"
+       << "sessions_routed " << sessions_routed.Value() << "\n"
+       << "cross_node_sessions " << cross_node_sessions.Value() << "\n"
+       << "cross_node_deliveries " << cross_node_deliveries.Value() << "\n"
+       << "cross_node_bytes " << cross_node_bytes.Value() << "\n"
+       << "session_allocs " << session_allocs.Value() << "\n"
+       << "deadline_disconnects " << deadline_disconnects.Value() << "\n"
+       << "queued_messages " << queued_messages.Value() << "\n"
+       << "udp_send_calls " << udp_send_calls.Value() << "\n"
+       << "udp_datagrams_sent " << udp_datagrams_sent.Value() << "\n"
+       << "udp_bytes_sent " << udp_bytes_sent.Value() << "\n"
+       << "udp_nacks_received " << udp_nacks_received.Value() << "\n"
+       << "udp_retransmits " << udp_retransmits.Value() << "\n"
+       << "udp_replay_misses " << udp_replay_misses.Value() << "\n"
+       << "udp_nacks_limited " << udp_nacks_limited.Value() << "\n"
+       << "rudp_sessions_opened " << rudp_sessions_opened.Value() << "\n"
+       << "rudp_sessions_expired " << rudp_sessions_expired.Value() << "\n"
+       << "rudp_frames_sent " << rudp_frames_sent.Value() << "\n"
+       << "rudp_retransmits " << rudp_retransmits.Value() << "\n"
+       << "rudp_timeouts " << rudp_timeouts.Value() << "\n"
+       << "session_throttles " << session_throttles.Value() << "\n"
+       << "slow_consumer_drops " << slow_consumer_drops.Value() << "\n"
+       << "slow_consumer_disconnects " << slow_consumer_disconnects.Value()
+       << "\n"
+       << "topic_throttles " << topic_throttles.Value() << "\n"
+       << "topic_drops " << topic_drops.Value() << "\n"
+       << "journal_appends " << journal_appends.Value() << "\n"
+       << "journal_bytes " << journal_bytes.Value() << "\n"
+       << "journal_syncs " << journal_syncs.Value() << "\n"
+       << "journal_errors " << journal_errors.Value() << "\n"
+       << "journal_segments_deleted " << journal_segments_deleted.Value()
+       << "\n"
+       << "history_sends " << history_sends.Value() << "\n"
+       << "history_bytes " << history_bytes.Value() << "\n"
+       << "history_messages " << history_messages.Value() << "\n"
+       << "shm_messages " << shm_messages.Value() << "\n"
+       << "shm_bytes " << shm_bytes.Value() << "\n"
+       << "shm_oversize " << shm_oversize.Value() << "\n"
+       << "inproc_messages " << inproc_messages.Value() << "\n"
+       << "inproc_drops " << inproc_drops.Value() << "\n"
+       << "ingress_full " << ingress_full.Value() << "\n"
+       << "poll_sleeps " << poll_sleeps.Value() << "\n"
+       << "queue_depth ";
+    queue_depth.Print(os);
+    os << "\nwrite_us ";
+    write_ns.Print(os, 1000.0);
+    os << "\nfanout_us ";
+    fanout_ns.Print(os, 1000.0);
+    os << "\ndeliver_us ";
+    deliver_ns.Print(os, 1000.0);
+    os << "\njournal_sync_us ";
+    journal_sync_ns.Print(os, 1000.0);
+    os << "\ningress_us ";
+    ingress_ns.Print(os, 1000.0);
+    os << "\n";
+  }
+};
+
+class Metrics {
+ public:
+  ServerStats& Local() { return stats_.Local(); }
+
+  void Aggregate(ServerStats& total) const {
+    stats_.ForEach([&](const ServerStats& s) { total.Merge(s); });
+  }
+
+  void Print(std::ostream& os) const {
+    ServerStats total;
+    Aggregate(total);
+    total.Print(os);
+  }
+
+ private:
+  PerThread<ServerStats> stats_;
+};
+
+// Counters and publish to receive latency kept by clients, one instance per
+// client I/O thread, so that many connections can be summarised together.
+struct alignas(64) ClientStats {
+  Counter connects;
+  Counter connect_failures;
+  Counter disconnects;
+  Counter messages_received;
+  Counter bytes_received;
+  Histogram latency_ns;
+
+  void Merge(const ClientStats& other) {
+    connects.Add(other.connects.Value());
+    connect_failures.Add(other.connect_failures.Value());
+    disconnects.Add(other.disconnects.Value());
+    messages_received.Add(other.messages_received.Value());
+    bytes_received.Add(other.bytes_received.Value());
+    latency_ns.Merge(other.latency_ns);
+  }
+
+  void Print(std::ostream& os) const {
+    os << "connects " << connects.Value() << "\n"
+       << "connect_failures " << connect_failures.Value() << "\n"
+       << "disconnects " << disconnects.Value() << "\n"
+       << "messages_received " << messages_received.Value() << "\n"
+       << "bytes_received " << bytes_received.Value() << "\n"
+       << "latency_us ";
+    latency_ns.Print(os, 1000.0);
+    os << "\n";
+  }
+};
+
+class ClientMetrics {
+ public:
+  ClientStats& Local() { return stats_.Local(); }
+
+  void Aggregate(ClientStats& total) const {
+    stats_.ForEach([&](const ClientStats& s) { total.Merge(s); });
+  }
+
+ private:
+  PerThread<ClientStats> stats_;
+};
+
+#endif  // METRICS_H_
@@ -3,18 +3,23 @@
 #include <stdio.h>
 #endif
 
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include <boost/thread.hpp>
-#include <boost/bind.hpp>
 #include <boost/asio.hpp>
-#include <boost/shared_ptr.hpp>
-#include <boost/enable_shared_from_this.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/smart_ptr/intrusive_ref_counter.hpp>
 
-using namespace boost::asio;
-io_service service;
+#include "../handler_alloc.h"
 
-#define MEM_FN(x)       boost::bind(&self_type::x, shared_from_this())
-#define MEM_FN1(x,y)    boost::bind(&self_type::x, shared_from_this(),y)
-#define MEM_FN2(x,y,z)  boost::bind(&self_type::x, shared_from_this(),y,z)
+using namespace boost::asio;
+io_context service;
 
 /** simple connection to server:
     - logs in just with username (no password)
@@ -25,18 +30,21 @@ io_service service;
     - gets a list of all connected clients
     - ping: the server answers either with "ping ok" or "ping client_list_changed"
 */
-class talk_to_svr : public boost::enable_shared_from_this<talk_to_svr>
+class talk_to_svr : public boost::intrusive_ref_counter<talk_to_svr>
                   , boost::noncopyable {
     typedef talk_to_svr self_type;
     talk_to_svr(const std::string & username)
       : sock_(service), started_(true), username_(username), timer_(service) {}
     void start(ip::tcp::endpoint ep) {
-        sock_.async_connect(ep, MEM_FN1(on_connect,_1));
+        ptr self(this);
+        sock_.async_connect(ep, [self](const error_code & err) {
+            self->on_connect(err);
+        });
     }
 
 public:
     typedef boost::system::error_code error_code;
-    typedef boost::shared_ptr<talk_to_svr> ptr;
+    typedef boost::intrusive_ptr<talk_to_svr> ptr;
 
     static ptr start(ip::tcp::endpoint ep, const std::string & username) {
         ptr new_(new talk_to_svr(username));
@@ -92,8 +100,10 @@ private:
         int millis = rand() % 7000;
         std::cout << username_ << " postponing ping " << millis
                   << " millis" << std::endl;
-        timer_.expires_from_now(boost::posix_time::millisec(millis));
-        timer_.async_wait( MEM_FN(do_ping));
+        timer_.expires_after(boost::asio::chrono::milliseconds(millis));
+        ptr self(this);
+        timer_.async_wait(MakeAllocHandler(timer_memory_,
+            [self](const error_code &) { self->do_ping(); }));
     }
     void do_ask_clients() {
         do_write("ask_clients\n");
@@ -103,14 +113,25 @@ private:
         do_read();
     }
     void do_read() {
+        ptr self(this);
         async_read(sock_, buffer(read_buffer_),
-                   MEM_FN2(read_complete,_1,_2), MEM_FN2(on_read,_1,_2));
+                   [this](const error_code & err, size_t bytes) {
+                       return read_complete(err, bytes);
+                   },
+                   MakeAllocHandler(read_memory_,
+                       [self](const error_code & err, size_t bytes) {
+                           self->on_read(err, bytes);
+                       }));
     }
     void do_write(const std::string & msg) {
         if ( !started() ) return;
         std::copy(msg.begin(), msg.end(), write_buffer_);
-        sock_.async_write_some( buffer(write_buffer_, msg.size()),
-                                MEM_FN2(on_write,_1,_2));
+        ptr self(this);
+        sock_.async_write_some(buffer(write_buffer_, msg.size()),
+            MakeAllocHandler(write_memory_,
+                [self](const error_code & err, size_t bytes) {
+                    self->on_write(err, bytes);
+                }));
     }
     size_t read_complete(const boost::system::error_code & err, size_t bytes) {
         if ( err) return 0;
@@ -126,14 +147,17 @@ private:
     char write_buffer_[max_msg];
     bool started_;
     std::string username_;
-    deadline_timer timer_;
+    steady_timer timer_;
+    HandlerMemory read_memory_;
+    HandlerMemory write_memory_;
+    HandlerMemory timer_memory_;
 };
 
 int main(int argc, char* argv[]) {
     // connect several clients
-    ip::tcp::endpoint ep( ip::address::from_string("127.0.0.1"), 8001);
-    char* names[] = { "John", "James", "Lucy", "Tracy", "Frank", "Abby", 0 };
-    for ( char ** name = names; *name; ++name) {
+    ip::tcp::endpoint ep( ip::make_address("127.0.0.1"), 8001);
+    const char* names[] = { "John", "James", "Lucy", "Tracy", "Frank", "Abby", 0 };
+    for ( const char ** name = names; *name; ++name) {
         talk_to_svr::start(ep, *name);
         boost::this_thread::sleep( boost::posix_time::millisec(100));
     }
@@ -3,24 +3,28 @@
 #include <stdio.h>
 #endif
 
-#include <boost/bind.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include <boost/asio.hpp>
-#include <boost/shared_ptr.hpp>
-#include <boost/enable_shared_from_this.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/smart_ptr/intrusive_ref_counter.hpp>
+
+#include "../handler_alloc.h"
 using namespace boost::asio;
 using namespace boost::posix_time;
-io_service service;
+io_context service;
 
 class talk_to_client;
-typedef boost::shared_ptr<talk_to_client> client_ptr;
+typedef boost::intrusive_ptr<talk_to_client> client_ptr;
 typedef std::vector<client_ptr> array;
 array clients;
 
-#define MEM_FN(x)       boost::bind(&self_type::x, shared_from_this())
-#define MEM_FN1(x,y)    boost::bind(&self_type::x, shared_from_this(),y)
-#define MEM_FN2(x,y,z)  boost::bind(&self_type::x, shared_from_this(),y,z)
-
-
 void update_clients_changed();
 
 /** simple connection to server:
@@ -32,7 +36,7 @@ void update_clients_changed();
     - gets a list of all connected clients
     - ping: the server answers either with "ping ok" or "ping client_list_changed"
 */
-class talk_to_client : public boost::enable_shared_from_this<talk_to_client>
+class talk_to_client : public boost::intrusive_ref_counter<talk_to_client>
                      , boost::noncopyable {
     typedef talk_to_client self_type;
     talk_to_client() : sock_(service), started_(false),
@@ -40,11 +44,11 @@ class talk_to_client : public boost::enable_shared_from_this<talk_to_client>
     }
 public:
     typedef boost::system::error_code error_code;
-    typedef boost::shared_ptr<talk_to_client> ptr;
+    typedef boost::intrusive_ptr<talk_to_client> ptr;
 
     void start() {
         started_ = true;
-        clients.push_back( shared_from_this());
+        clients.push_back( ptr(this));
         // first, we wait for client to login
         do_read();
     }
@@ -57,7 +61,7 @@ public:
         started_ = false;
         sock_.close();
 
-        ptr self = shared_from_this();
+        ptr self = ptr(this);
         array::iterator it = std::find(clients.begin(), clients.end(), self);
         clients.erase(it);
         update_clients_changed();
@@ -108,8 +112,10 @@ private:
 
     void post_check_ping() {
       std::cout << "pcp " << this << " " << username_ << " " << boost::posix_time::microsec_clock::local_time().time_of_day().total_milliseconds() << "\n";
-      timer_.expires_from_now(boost::posix_time::millisec(5000));
-      timer_.async_wait(MEM_FN1(on_check_ping, _1));
+      timer_.expires_after(boost::asio::chrono::milliseconds(5000));
+      ptr self(this);
+      timer_.async_wait(MakeAllocHandler(timer_memory_,
+          [self](const error_code & err) { self->on_check_ping(err); }));
     }
 
     void on_write(const error_code & err, size_t bytes) {
@@ -118,16 +124,27 @@ private:
 
     // start a read and set a check ping in 5s.
     void do_read() {
+        ptr self(this);
         async_read(sock_, buffer(read_buffer_),
-                   MEM_FN2(read_complete,_1,_2), MEM_FN2(on_read,_1,_2));
+                   [this](const error_code & err, size_t bytes) {
+                       return read_complete(err, bytes);
+                   },
+                   MakeAllocHandler(read_memory_,
+                       [self](const error_code & err, size_t bytes) {
+                           self->on_read(err, bytes);
+                       }));
         post_check_ping();
     }
 
     void do_write(const std::string & msg) {
         if ( !started() ) return;
         std::copy(msg.begin(), msg.end(), write_buffer_);
-        sock_.async_write_some( buffer(write_buffer_, msg.size()),
-                                MEM_FN2(on_write,_1,_2));
+        ptr self(this);
+        sock_.async_write_some(buffer(write_buffer_, msg.size()),
+            MakeAllocHandler(write_memory_,
+                [self](const error_code & err, size_t bytes) {
+                    self->on_write(err, bytes);
+                }));
     }
     size_t read_complete(const boost::system::error_code & err, size_t bytes) {
         if ( err) return 0;
@@ -143,7 +160,10 @@ private:
     char write_buffer_[max_msg];
     bool started_;
     std::string username_;
-    deadline_timer timer_;
+    steady_timer timer_;
+    HandlerMemory read_memory_;
+    HandlerMemory write_memory_;
+    HandlerMemory timer_memory_;
     bool clients_changed_;
 };
 
@@ -157,11 +177,11 @@ ip::tcp::acceptor acceptor(service, ip::tcp::endpoint(ip::tcp::v4(), 8001));
 void handle_accept(talk_to_client::ptr client, const boost::system::error_code & err) {
     client->start();
     talk_to_client::ptr new_client = talk_to_client::new_();
-    acceptor.async_accept(new_client->sock(), boost::bind(handle_accept,new_client,_1));
+    acceptor.async_accept(new_client->sock(), [new_client](const boost::system::error_code & err) { handle_accept(new_client, err); });
 }
 
 int main(int argc, char* argv[]) {
     talk_to_client::ptr client = talk_to_client::new_();
-    acceptor.async_accept(client->sock(), boost::bind(handle_accept,client,_1));
+    acceptor.async_accept(client->sock(), [client](const boost::system::error_code & err) { handle_accept(client, err); });
     service.run();
 }
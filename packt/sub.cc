@@ -3,31 +3,39 @@
 #include <stdio.h>
 #endif
 
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include <boost/thread.hpp>
-#include <boost/bind.hpp>
 #include <boost/asio.hpp>
-#include <boost/shared_ptr.hpp>
-#include <boost/enable_shared_from_this.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/smart_ptr/intrusive_ref_counter.hpp>
 
-using namespace boost::asio;
-io_service service;
+#include "../handler_alloc.h"
 
-#define MEM_FN(x)       boost::bind(&self_type::x, shared_from_this())
-#define MEM_FN1(x,y)    boost::bind(&self_type::x, shared_from_this(),y)
-#define MEM_FN2(x,y,z)  boost::bind(&self_type::x, shared_from_this(),y,z)
+using namespace boost::asio;
+io_context service;
 
-class talk_to_svr : public boost::enable_shared_from_this<talk_to_svr>
+class talk_to_svr : public boost::intrusive_ref_counter<talk_to_svr>
                   , boost::noncopyable {
     typedef talk_to_svr self_type;
     talk_to_svr(const std::string &topic)
       : sock_(service), started_(true), topic_(topic), timer_(service) {}
     void start(ip::tcp::endpoint ep) {
-        sock_.async_connect(ep, MEM_FN1(on_connect,_1));
+        ptr self(this);
+        sock_.async_connect(ep, [self](const error_code & err) {
+            self->on_connect(err);
+        });
     }
 
 public:
     typedef boost::system::error_code error_code;
-    typedef boost::shared_ptr<talk_to_svr> ptr;
+    typedef boost::intrusive_ptr<talk_to_svr> ptr;
 
     static ptr start(ip::tcp::endpoint ep, const std::string& topic) {
         std::cout << "start()\n";
@@ -98,8 +106,10 @@ private:
         //int millis = rand() % 7000;
         std::cout << this << " postponing ping " << millis
                   << " millis" << std::endl;
-        timer_.expires_from_now(boost::posix_time::millisec(millis));
-        timer_.async_wait(MEM_FN(do_ping));
+        timer_.expires_after(boost::asio::chrono::milliseconds(millis));
+        ptr self(this);
+        timer_.async_wait(MakeAllocHandler(timer_memory_,
+            [self](const error_code &) { self->do_ping(); }));
     }*/
 
     void on_write(const error_code & err, size_t bytes) {
@@ -109,16 +119,27 @@ private:
 
     void do_read() {
         std::cout << "do_read()\n";
+        ptr self(this);
         async_read(sock_, buffer(read_buffer_),
-                   MEM_FN2(read_complete,_1,_2), MEM_FN2(on_read,_1,_2));
+                   [this](const error_code & err, size_t bytes) {
+                       return read_complete(err, bytes);
+                   },
+                   MakeAllocHandler(read_memory_,
+                       [self](const error_code & err, size_t bytes) {
+                           self->on_read(err, bytes);
+                       }));
     }
 
     void do_write(const std::string & msg) {
         if (!started() ) return;
         std::cout << "do_write: " << msg << std::endl;
         std::copy(msg.begin(), msg.end(), write_buffer_);
-        sock_.async_write_some( buffer(write_buffer_, msg.size()),
-                                MEM_FN2(on_write,_1,_2));
+        ptr self(this);
+        sock_.async_write_some(buffer(write_buffer_, msg.size()),
+            MakeAllocHandler(write_memory_,
+                [self](const error_code & err, size_t bytes) {
+                    self->on_write(err, bytes);
+                }));
     }
 
     size_t read_complete(const boost::system::error_code & err, size_t bytes) {
@@ -136,15 +157,18 @@ private:
     char write_buffer_[max_msg];
     bool started_;
     std::string topic_;
-    deadline_timer timer_;
+    steady_timer timer_;
+    HandlerMemory read_memory_;
+    HandlerMemory write_memory_;
+    HandlerMemory timer_memory_;
 };
 
 int main(int argc, char* argv[]) {
     // connect several clients
-    ip::tcp::endpoint ep( ip::address::from_string("127.0.0.1"), 8001);
-    char* topics[] = { "data", "data", "data", 0 };
+    ip::tcp::endpoint ep( ip::make_address("127.0.0.1"), 8001);
+    const char* topics[] = { "data", "data", "data", 0 };
 
-    for ( char ** topic = topics; *topic; ++topic) {
+    for ( const char ** topic = topics; *topic; ++topic) {
         talk_to_svr::start(ep, *topic);
         boost::this_thread::sleep(boost::posix_time::millisec(100));
     }
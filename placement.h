@@ -0,0 +1,129 @@
+#ifndef PLACEMENT_H_
+#define PLACEMENT_H_
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#endif
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Where threads run and which NUMA node (memory and PCIe attachment) each
+// CPU belongs to, as the kernel reports them under /sys. Nothing here needs
+// libnuma: memory is placed by first touch, i.e. allocated and initialised
+// by a thread already running on the node that should hold it.
+
+typedef std::vector<int> CpuSet;
+
+// Parses CPU numbers and ranges separated by separator, e.g. "0-3,8" or,
+// with '+', "0-3+8". Appends to cpus.
+inline bool ParseCpuList(const std::string& list, char separator,
+                         CpuSet& cpus) {
+  std::size_t begin = 0;
+  for (;;) {
+    std::size_t end = list.find(separator, begin);
+    std::string range(list, begin, end == list.npos ? end : end - begin);
+    std::size_t dash = range.find('-');
+    std::string first(range, 0, dash);
+    std::string last(dash == range.npos ? first : range.substr(dash + 1));
+    if (first.empty() || last.empty() ||
+        first.find_first_not_of("0123456789") != first.npos ||
+        last.find_first_not_of("0123456789") != last.npos)
+      return false;
+    for (int cpu = atoi(first.c_str()); cpu <= atoi(last.c_str()); ++cpu)
+      cpus.push_back(cpu);
+    if (end == list.npos) return true;
+    begin = end + 1;
+  }
+}
+
+// Pins the calling thread to cpus. Returns false if it cannot be pinned,
+// including where pinning is not supported.
+inline bool PinThread(const CpuSet& cpus) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (std::size_t i = 0; i < cpus.size(); ++i) {
+    if (cpus[i] >= CPU_SETSIZE) return false;
+    CPU_SET(cpus[i], &set);
+  }
+  return !cpus.empty() &&
+         pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+// The node of each CPU, indexed by CPU number, with -1 for CPUs no node
+// claims. Empty if the topology is unknown.
+inline std::vector<int> CpuNodes() {
+  std::vector<int> nodes;
+#if defined(__linux__)
+  DIR* dir = ::opendir("/sys/devices/system/node");
+  if (!dir) return nodes;
+  while (dirent* entry = ::readdir(dir)) {
+    std::string name(entry->d_name);
+    if (name.compare(0, 4, "node") != 0 ||
+        name.find_first_not_of("0123456789", 4) != name.npos)
+      continue;
+
+    std::ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+    std::string list;
+    CpuSet cpus;
+    if (!std::getline(file, list) || list.empty() ||
+        !ParseCpuList(list, ',', cpus))
+      continue;
+    for (std::size_t i = 0; i < cpus.size(); ++i) {
+      if (std::size_t(cpus[i]) >= nodes.size()) nodes.resize(cpus[i] + 1, -1);
+      nodes[cpus[i]] = atoi(name.c_str() + 4);
+    }
+  }
+  ::closedir(dir);
+#endif
+  return nodes;
+}
+
+// The node a network interface's device is attached to, or -1 if unknown
+// (as for virtual devices, or single-node machines).
+inline int NicNode(const std::string& interface) {
+  std::ifstream file("/sys/class/net/" + interface + "/device/numa_node");
+  int node = -1;
+  if (!(file >> node)) return -1;
+  return node;
+}
+
+// The CPU that last handled a connected socket's incoming packets, or -1 if
+// unknown.
+inline int IncomingCpu(int fd) {
+#if defined(SO_INCOMING_CPU)
+  int cpu = -1;
+  socklen_t length = sizeof(cpu);
+  if (::getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) != 0)
+    return -1;
+  return cpu;
+#else
+  (void)fd;
+  return -1;
+#endif
+}
+
+// Asks the kernel to prefer, among listening sockets sharing a port with
+// SO_REUSEPORT, this one for connections whose packets are handled on cpu.
+inline bool SetIncomingCpu(int fd, int cpu) {
+#if defined(SO_INCOMING_CPU)
+  return ::setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                      sizeof(cpu)) == 0;
+#else
+  (void)fd;
+  (void)cpu;
+  return false;
+#endif
+}
+
+#endif  // PLACEMENT_H_
@@ -0,0 +1,122 @@
+#ifndef RATE_LIMIT_H_
+#define RATE_LIMIT_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+
+// Token bucket refilled continuously at rate tokens per second up to burst.
+// A take is allowed whenever the bucket is not in deficit and may drive it
+// negative, so a single message larger than the burst still goes out, after
+// which the sender waits for the deficit to be repaid. A rate of zero means
+// unlimited.
+class TokenBucket {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  TokenBucket() : rate_(0), burst_(0), tokens_(0) {}
+
+  TokenBucket(double rate, double burst)
+    : rate_(rate),
+      burst_(burst),
+      tokens_(burst),
+      last_(Clock::now()) {}
+
+  bool limited() const {
+    return rate_ > 0;
+  }
+
+  // Returns how long until a take is allowed; zero if it is allowed now.
+  Clock::duration Wait(Clock::time_point now) {
+    if (!limited()) return Clock::duration(0);
+
+    tokens_ = std::min(burst_, tokens_ + rate_ *
+        std::chrono::duration<double>(now - last_).count());
+    last_ = now;
+    if (tokens_ >= 0) return Clock::duration(0);
+
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(-tokens_ / rate_));
+  }
+
+  void Take(double tokens) {
+    if (limited()) tokens_ -= tokens;
+  }
+
+ private:
+  double rate_;
+  double burst_;
+  double tokens_;
+  Clock::time_point last_;
+};
+
+// Rates are paced with a burst of kBurstMs worth of tokens, so a limited
+// sender never emits much more than its rate in any short interval.
+const int kBurstMs = 50;
+
+// A message and byte bucket pair, waiting on whichever is further behind.
+class RateLimiter {
+ public:
+  typedef TokenBucket::Clock Clock;
+
+  RateLimiter() {}
+
+  RateLimiter(double msgs_per_sec, double bytes_per_sec)
+    : msgs_(msgs_per_sec, std::max(1.0, msgs_per_sec * kBurstMs / 1000)),
+      bytes_(bytes_per_sec, bytes_per_sec * kBurstMs / 1000) {}
+
+  bool limited() const {
+    return msgs_.limited() || bytes_.limited();
+  }
+
+  Clock::duration Wait(Clock::time_point now) {
+    return std::max(msgs_.Wait(now), bytes_.Wait(now));
+  }
+
+  void Take(std::size_t bytes) {
+    msgs_.Take(1);
+    bytes_.Take(bytes);
+  }
+
+  // Charges bytes that are not counted as messages, e.g. a bulk replay.
+  void TakeBytes(std::size_t bytes) {
+    bytes_.Take(bytes);
+  }
+
+ private:
+  TokenBucket msgs_;
+  TokenBucket bytes_;
+};
+
+// What a session does when its output queue reaches max_queue messages:
+// discard the oldest queued message (conflate), or disconnect the
+// subscriber as too slow.
+enum SlowConsumerPolicy {
+  kDropOldest,
+  kDisconnect
+};
+
+// Limits applied to each subscriber session. Zero means unlimited.
+struct SessionLimits {
+  SessionLimits()
+    : msgs_per_sec(0), bytes_per_sec(0), max_queue(0),
+      policy(kDropOldest) {}
+
+  double msgs_per_sec;
+  double bytes_per_sec;
+  std::size_t max_queue;
+  SlowConsumerPolicy policy;
+};
+
+// Limits applied to everything delivered on a channel (topic). Messages over
+// the rate wait in a backlog of up to max_backlog messages; beyond that the
+// oldest are dropped. Zero means unlimited.
+struct TopicLimits {
+  TopicLimits() : msgs_per_sec(0), bytes_per_sec(0), max_backlog(10000) {}
+
+  double msgs_per_sec;
+  double bytes_per_sec;
+  std::size_t max_backlog;
+};
+
+#endif  // RATE_LIMIT_H_
@@ -0,0 +1,271 @@
+// Subscriber for the server's reliable UDP sessions (--rudp). Says hello,
+// with the cookie the server answers the first hello with, until data
+// arrives, then delivers frames in order, acking every datagram with the
+// next frame it expects plus selective ack blocks for the frames it is holding
+// out of order. A once a second ack doubles as a heartbeat so that the
+// server does not expire the session while the channel is quiet.
+//
+// Once no data has arrived for kSilenceSecs the client also says hello
+// without a cookie each second. An open session just takes that as a
+// keep-alive; a server that has lost the session (it expired it after the
+// acks went missing, or restarted) answers with a cookie, and the client
+// starts over with a new session, which replays the history from the start.
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+
+#include "metrics.h"
+#include "timestamp.h"
+#include "udp_protocol.h"
+
+using boost::asio::ip::udp;
+using boost::asio::steady_timer;
+using boost::bind;
+using boost::system::error_code;
+
+namespace asio = boost::asio;
+
+class RudpClient {
+ public:
+  RudpClient(asio::io_context& io_context, const udp::endpoint& server,
+             ClientMetrics& metrics, double loss, bool verbose)
+    : server_(server),
+      metrics_(metrics),
+      loss_(loss),
+      verbose_(verbose),
+      socket_(io_context, udp::endpoint(udp::v4(), 0)),
+      heartbeat_timer_(io_context),
+      report_timer_(io_context),
+      expected_(1),
+      cookie_(0),
+      connected_(false),
+      probing_(false) {
+  }
+
+  void Start() {
+    SendHeader(kHelloFrame, 0, 0);
+    StartReceive();
+    StartHeartbeat();
+    if (verbose_) StartReport();
+  }
+
+ private:
+  void StartReceive() {
+    socket_.async_receive_from(asio::buffer(buffer_), sender_,
+        bind(&RudpClient::HandleReceive, this, _1, _2));
+  }
+
+  void HandleReceive(const error_code& ec, std::size_t length) {
+    if (ec == asio::error::operation_aborted) return;
+
+    FrameHeader header;
+    if (!ec && sender_ == server_ &&
+        DecodeFrameHeader(buffer_, length, header)) {
+      if (header.type == kHelloFrame && (!connected_ || probing_)) {
+        // The server's cookie: say hello again with it, starting over if
+        // this answers a probe, as the server has no session for us.
+        if (connected_) Reset();
+        cookie_ = header.sequence;
+        SendHeader(kHelloFrame, 0, cookie_);
+      } else if (header.type == kDataFrame &&
+                 // Simulated loss, to exercise recovery over loopback.
+                 (loss_ <= 0 || std::rand() >= loss_ * RAND_MAX)) {
+        if (!connected_) {
+          connected_ = true;
+          metrics_.Local().connects.Add(1);
+        }
+        last_data_ = Clock::now();
+        probing_ = false;
+        if (header.sequence >= expected_)
+          held_[header.sequence].assign(buffer_ + kFrameHeaderSize,
+                                        length - kFrameHeaderSize);
+        DeliverInOrder();
+        SendAck();
+      }
+    }
+
+    StartReceive();
+  }
+
+  void Reset() {
+    connected_ = false;
+    probing_ = false;
+    held_.clear();
+    expected_ = 1;
+  }
+
+  void DeliverInOrder() {
+    std::map<uint64_t, std::string>::iterator i;
+    while ((i = held_.begin()) != held_.end() && i->first == expected_) {
+      const std::string& payload = i->second;
+      std::size_t start = 0, end;
+      while ((end = payload.find('\n', start)) != std::string::npos) {
+        HandleMessage(payload.substr(start, end - start));
+        start = end + 1;
+      }
+      held_.erase(i);
+      ++expected_;
+    }
+  }
+
+  void HandleMessage(const std::string& line) {
+    ClientStats& stats = metrics_.Local();
+    stats.messages_received.Add(1);
+    stats.bytes_received.Add(line.size() + 1);
+
+    int64_t stamp_ns = 0;
+    std::size_t payload = 0;
+    if (Unstamp(line, stamp_ns, payload)) {
+      int64_t latency_ns = WallClockNs() - stamp_ns;
+      stats.latency_ns.Record(latency_ns > 0 ? latency_ns : 0);
+    }
+
+    if (verbose_)
+      std::cout << "Received: " << line.substr(payload) << "\n";
+  }
+
+  // Acks everything below expected_ and describes up to kMaxAckBlocks runs
+  // of the frames held above it.
+  void SendAck() {
+    char ack[kFrameHeaderSize + kMaxAckBlocks * kAckBlockSize];
+    uint16_t blocks = 0;
+
+    std::map<uint64_t, std::string>::const_iterator i = held_.begin();
+    while (i != held_.end() && blocks < kMaxAckBlocks) {
+      uint64_t start = i->first, end = start + 1;
+      while (++i != held_.end() && i->first == end)
+        ++end;
+
+      char* block = ack + kFrameHeaderSize + blocks++ * kAckBlockSize;
+      EncodeU64(start, block);
+      EncodeU64(end, block + 8);
+    }
+
+    FrameHeader header = { kAckFrame, blocks, expected_ };
+    EncodeFrameHeader(header, ack);
+
+    error_code ignored_ec;
+    socket_.send_to(asio::buffer(ack, kFrameHeaderSize +
+                                 blocks * kAckBlockSize),
+                    server_, 0, ignored_ec);
+  }
+
+  void SendHeader(FrameType type, uint16_t count, uint64_t sequence) {
+    char frame[kFrameHeaderSize];
+    FrameHeader header = { uint8_t(type), count, sequence };
+    EncodeFrameHeader(header, frame);
+
+    error_code ignored_ec;
+    socket_.send_to(asio::buffer(frame), server_, 0, ignored_ec);
+  }
+
+  void StartHeartbeat() {
+    heartbeat_timer_.expires_after(std::chrono::seconds(1));
+    heartbeat_timer_.async_wait(
+        bind(&RudpClient::HandleHeartbeat, this, _1));
+  }
+
+  // Keeps saying hello until the first data frame arrives, then acks, and
+  // probes with a cookieless hello while data has stopped arriving.
+  void HandleHeartbeat(const error_code& ec) {
+    if (ec) return;
+
+    if (!connected_) {
+      SendHeader(kHelloFrame, 0, cookie_);
+    } else {
+      SendAck();
+      if (Clock::now() - last_data_ >= std::chrono::seconds(kSilenceSecs)) {
+        probing_ = true;
+        SendHeader(kHelloFrame, 0, 0);
+      }
+    }
+
+    StartHeartbeat();
+  }
+
+  void StartReport() {
+    report_timer_.expires_after(std::chrono::seconds(10));
+    report_timer_.async_wait(bind(&RudpClient::HandleReport, this, _1));
+  }
+
+  void HandleReport(const error_code& ec) {
+    if (ec) return;
+
+    ClientStats stats;
+    metrics_.Aggregate(stats);
+    if (stats.latency_ns.Count()) {
+      std::cout << "Latency us ";
+      stats.latency_ns.Print(std::cout, 1000.0);
+      std::cout << "\n";
+    }
+    std::cout << "Expecting frame " << expected_ << ", holding "
+              << held_.size() << " out of order\n";
+
+    StartReport();
+  }
+
+  enum { kSilenceSecs = 5 };
+
+  udp::endpoint server_;
+  ClientMetrics& metrics_;
+  double loss_;
+  bool verbose_;
+  udp::socket socket_;
+  steady_timer heartbeat_timer_;
+  steady_timer report_timer_;
+  char buffer_[65536];
+  udp::endpoint sender_;
+  std::map<uint64_t, std::string> held_;
+  uint64_t expected_;
+  uint64_t cookie_;
+  bool connected_;
+  // Whether a cookieless hello is outstanding since the last data frame.
+  bool probing_;
+  Clock::time_point last_data_;
+};
+
+int main(int argc, char* argv[]) {
+  try {
+    double loss = 0.0;
+    bool verbose = true;
+    bool usage = argc < 3;
+    for (int i = 3; i < argc && !usage; ++i) {
+      std::string arg(argv[i]);
+      if (arg == "--loss" && i + 1 < argc)
+        loss = atof(argv[++i]);
+      else if (arg == "--quiet")
+        verbose = false;
+      else
+        usage = true;
+    }
+
+    if (usage) {
+      std::cerr << "Usage: rudp_client <host> <port> [--loss <fraction>]"
+                   " [--quiet]\n";
+      return 1;
+    }
+
+    asio::io_context io_context;
+    udp::resolver resolver(io_context);
+    udp::endpoint server =
+        *resolver.resolve(udp::v4(), argv[1], argv[2]).begin();
+
+    ClientMetrics metrics;
+    RudpClient client(io_context, server, metrics, loss, verbose);
+    client.Start();
+    io_context.run();
+  }
+  catch (std::exception& e) {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
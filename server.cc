@@ -1,248 +1,385 @@
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
-#include <deque>
 #include <iostream>
-#include <set>
+#include <memory>
+#include <string>
 #include <thread>
-
-#include <boost/asio.hpp>
-#include <boost/bind.hpp>
-#include <boost/enable_shared_from_this.hpp>
-#include <boost/shared_ptr.hpp>
-
-using boost::asio::deadline_timer;
-using boost::asio::ip::tcp;
-using boost::bind;
-using boost::shared_ptr;
-using boost::system::error_code;
-
-namespace asio = boost::asio;
-namespace posix_time = boost::posix_time;
-
-class Subscriber {
- public:
-  virtual ~Subscriber() {}
-  virtual void Deliver(const std::string& msg) = 0;
+#include <vector>
+
+#include "busy_poll.h"
+#include "server.h"
+#include "udp_session.h"
+
+struct Options {
+  Options()
+    : listen_port(0), admin_port(0), stats_interval(0), timestamps(false),
+      udp_port(0), rudp_port(0), rudp_loss(0.0), io_threads(0),
+      snapshot_interval(60), shm_size(16 << 20), busy_poll(false),
+      poll_tuned(false) {}
+
+  int listen_port;
+  int admin_port;
+  int stats_interval;
+  bool timestamps;
+  std::string udp_address;
+  int udp_port;
+  int rudp_port;
+  double rudp_loss;
+  SessionLimits session_limits;
+  TopicLimits topic_limits;
+  ListenOptions listen;
+  JournalOptions journal;  // Used if journal.directory is set.
+  int io_threads;  // Extra accepting threads, each with its own acceptor.
+  std::string snapshot_path;
+  int snapshot_interval;
+  std::string handoff_path;  // Where a successor may connect to take over.
+  std::string takeover_path;  // A running predecessor's handoff_path.
+  std::string shm_path;  // Shared memory ring for same-host readers.
+  std::size_t shm_size;
+  std::string unix_path;  // Unix domain socket for same-host subscribers.
+  bool busy_poll;  // I/O threads poll rather than block (see busy_poll.h).
+  BusyPollOptions poll;
+  bool poll_tuned;  // Whether poll was given, rather than chosen per thread.
+  std::vector<CpuSet> cpus;  // CPUs per I/O thread, the main one first.
 };
 
-typedef shared_ptr<Subscriber> SubscriberPtr;
-
-class TcpSession;
-typedef shared_ptr<TcpSession> TcpSessionPtr;
-
-class Channel {
- public:
-  void Join(SubscriberPtr subscriber) {
-    subscribers_.insert(subscriber);
-  }
-
-  void Leave(SubscriberPtr subscriber) {
-    subscribers_.erase(subscriber);
-  }
-
-  void Deliver(const std::string& msg) {
-    std::for_each(subscribers_.begin(), subscribers_.end(),
-        bind(&Subscriber::Deliver, _1, boost::ref(msg)));
-  }
-
- private:
-  std::set<SubscriberPtr> subscribers_;
-};
-
-class TcpSession
-  : public Subscriber,
-    public boost::enable_shared_from_this<TcpSession> {
- public:
-  TcpSession(asio::io_service& io_service, Channel& ch)
-    : channel_(ch),
-      socket_(io_service),
-      input_deadline_(io_service),
-      non_empty_output_queue_(io_service),
-      output_deadline_(io_service) {
-    input_deadline_.expires_at(posix_time::pos_infin);
-    output_deadline_.expires_at(posix_time::pos_infin);
-    non_empty_output_queue_.expires_at(posix_time::pos_infin);
-  }
-
-  void Start() {
-    channel_.Join(shared_from_this());
-
-    StartRead();
-    input_deadline_.async_wait(bind(&TcpSession::CheckDeadline,
-                                    shared_from_this(),
-                                    &input_deadline_));
-    AwaitOutput();
-    output_deadline_.async_wait(bind(&TcpSession::CheckDeadline,
-                                     shared_from_this(),
-                                     &output_deadline_));
+// Whether the index'th I/O thread is pinned to a CPU that no other I/O
+// thread is given.
+bool OwnsCpu(const Options& options, std::size_t index) {
+  if (index >= options.cpus.size() || options.cpus[index].size() != 1)
+    return false;
+  int cpu = options.cpus[index][0];
+  for (std::size_t i = 0; i < options.cpus.size(); ++i) {
+    const CpuSet& cpus = options.cpus[i];
+    if (i != index && std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+      return false;
   }
+  return true;
+}
 
-  tcp::socket& socket() {
-    return socket_;
+// Parses a comma separated list of CPU sets, one per I/O thread, each a CPU
+// or range of CPUs or several joined with '+', e.g. "0,1" or "0-3,4-7+12".
+bool ParseCpus(const std::string& list, std::vector<CpuSet>& cpus) {
+  std::size_t begin = 0;
+  for (;;) {
+    std::size_t end = list.find(',', begin);
+    cpus.push_back(CpuSet());
+    if (!ParseCpuList(list.substr(begin, end == list.npos ? end
+                                                          : end - begin),
+                      '+', cpus.back()))
+      return false;
+    if (end == list.npos) return true;
+    begin = end + 1;
   }
+}
 
-  void Deliver(const std::string& msg) {
-    output_queue_.push_back(msg + "\n");
-    non_empty_output_queue_.expires_at(posix_time::neg_infin);
+bool ParseOptions(int argc, char* argv[], Options& options) {
+  if (argc < 2) return false;
+  options.listen_port = atoi(argv[1]);
+
+  for (int i = 2; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--admin-port" && i + 1 < argc) {
+      options.admin_port = atoi(argv[++i]);
+    } else if (arg == "--stats-interval" && i + 1 < argc) {
+      options.stats_interval = atoi(argv[++i]);
+    } else if (arg == "--timestamps") {
+      options.timestamps = true;
+    } else if (arg == "--udp" && i + 2 < argc) {
+      options.udp_address = argv[++i];
+      options.udp_port = atoi(argv[++i]);
+    } else if (arg == "--rudp" && i + 1 < argc) {
+      options.rudp_port = atoi(argv[++i]);
+    } else if (arg == "--rudp-loss" && i + 1 < argc) {
+      options.rudp_loss = atof(argv[++i]);
+    } else if (arg == "--session-rate" && i + 1 < argc) {
+      options.session_limits.msgs_per_sec = atof(argv[++i]);
+    } else if (arg == "--session-bytes" && i + 1 < argc) {
+      options.session_limits.bytes_per_sec = atof(argv[++i]);
+    } else if (arg == "--max-queue" && i + 1 < argc) {
+      options.session_limits.max_queue = atoi(argv[++i]);
+    } else if (arg == "--slow-consumer" && i + 1 < argc) {
+      std::string policy(argv[++i]);
+      if (policy == "drop")
+        options.session_limits.policy = kDropOldest;
+      else if (policy == "disconnect")
+        options.session_limits.policy = kDisconnect;
+      else
+        return false;
+    } else if (arg == "--topic-rate" && i + 1 < argc) {
+      options.topic_limits.msgs_per_sec = atof(argv[++i]);
+    } else if (arg == "--topic-bytes" && i + 1 < argc) {
+      options.topic_limits.bytes_per_sec = atof(argv[++i]);
+    } else if (arg == "--topic-backlog" && i + 1 < argc) {
+      options.topic_limits.max_backlog = atoi(argv[++i]);
+    } else if (arg == "--io-threads" && i + 1 < argc) {
+      options.io_threads = atoi(argv[++i]);
+      options.listen.reuse_port = true;
+    } else if (arg == "--reuse-port") {
+      options.listen.reuse_port = true;
+    } else if (arg == "--backlog" && i + 1 < argc) {
+      options.listen.backlog = atoi(argv[++i]);
+    } else if (arg == "--accepts" && i + 1 < argc) {
+      options.listen.accepts = atoi(argv[++i]);
+    } else if (arg == "--session-pool" && i + 1 < argc) {
+      options.listen.pool_size = atoi(argv[++i]);
+    } else if (arg == "--journal" && i + 1 < argc) {
+      options.journal.directory = argv[++i];
+    } else if (arg == "--journal-segment-mb" && i + 1 < argc) {
+      options.journal.segment_size = std::size_t(atoi(argv[++i])) << 20;
+    } else if (arg == "--journal-segments" && i + 1 < argc) {
+      options.journal.max_segments = atoi(argv[++i]);
+    } else if (arg == "--snapshot" && i + 1 < argc) {
+      options.snapshot_path = argv[++i];
+    } else if (arg == "--snapshot-interval" && i + 1 < argc) {
+      options.snapshot_interval = atoi(argv[++i]);
+    } else if (arg == "--shm" && i + 1 < argc) {
+      options.shm_path = argv[++i];
+    } else if (arg == "--shm-mb" && i + 1 < argc) {
+      options.shm_size = std::size_t(atoi(argv[++i])) << 20;
+    } else if (arg == "--unix" && i + 1 < argc) {
+      options.unix_path = argv[++i];
+    } else if (arg == "--busy-poll") {
+      options.busy_poll = true;
+    } else if (arg == "--poll-spins" && i + 1 < argc) {
+      options.poll.spins = atoi(argv[++i]);
+      options.poll_tuned = true;
+    } else if (arg == "--poll-yields" && i + 1 < argc) {
+      options.poll.yields = atoi(argv[++i]);
+      options.poll_tuned = true;
+    } else if (arg == "--poll-sleep-us" && i + 1 < argc) {
+      options.poll.sleep_us = atoi(argv[++i]);
+      options.poll_tuned = true;
+    } else if (arg == "--cpus" && i + 1 < argc) {
+      if (!ParseCpus(argv[++i], options.cpus)) return false;
+    } else if (arg == "--start-requests") {
+      options.listen.start_requests = true;
+    } else if (arg == "--route-to-node") {
+      options.listen.route_to_node = true;
+    } else if (arg == "--nic" && i + 1 < argc) {
+      options.listen.nic_node = NicNode(argv[++i]);
+    } else if (arg == "--handoff" && i + 1 < argc) {
+      options.handoff_path = argv[++i];
+    } else if (arg == "--takeover" && i + 1 < argc) {
+      options.takeover_path = argv[++i];
+    } else if (arg == "--journal-sync" && i + 1 < argc) {
+      std::string sync(argv[++i]);
+      if (sync == "none") {
+        options.journal.sync = kSyncNone;
+      } else if (sync == "group") {
+        options.journal.sync = kSyncGroup;
+      } else {
+        options.journal.sync = kSyncInterval;
+        options.journal.sync_ms = atoi(sync.c_str());
+      }
+    } else {
+      return false;
+    }
   }
 
- private:
-  void Stop() {
-    channel_.Leave(shared_from_this());
+  return options.io_threads >= 0 && options.listen.backlog > 0 &&
+         options.listen.accepts > 0 && options.listen.pool_size >= 0 &&
+         options.journal.segment_size > 0 && options.journal.sync_ms > 0 &&
+         options.snapshot_interval > 0 && options.shm_size > 0;
+}
 
-    error_code ignored_ec;
-    socket_.close(ignored_ec);
-    input_deadline_.cancel();
-    non_empty_output_queue_.cancel();
-    output_deadline_.cancel();
+// Runs the index'th I/O thread's io_context, pinned to its CPUs if they were
+// given. In busy-poll mode the thread polls, draining ingress if given; one
+// with a CPU of its own spins throughout unless the --poll options say
+// otherwise.
+void RunIoThread(asio::io_context& io_context, const Options& options,
+                 std::size_t index, Metrics& metrics,
+                 PublishIngress* ingress) {
+  bool pinned = index < options.cpus.size();
+  if (pinned && !PinThread(options.cpus[index])) {
+    std::cerr << "Could not pin I/O thread " << index << "\n";
+    pinned = false;
   }
-
-  bool Stopped() const {
-    return !socket_.is_open();
+  if (!options.busy_poll) {
+    io_context.run();
+    return;
   }
+  BusyPoller poller(io_context, metrics,
+                    pinned && OwnsCpu(options, index) && !options.poll_tuned
+                        ? BusyPollOptions::Dedicated() : options.poll);
+  if (ingress) poller.AddIngress(ingress);
+  poller.Run();
+}
 
-  void StartRead() {
-    input_deadline_.expires_from_now(posix_time::seconds(30));
-    asio::async_read_until(socket_, input_buffer_, '\n',
-                           bind(&TcpSession::HandleRead,
-                                shared_from_this(), _1));
-  }
+int main(int argc, char* argv[]) {
+  try {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+      std::cerr << "Usage: server <listen_port> [--admin-port <port>]"
+                   " [--stats-interval <secs>] [--timestamps]"
+                   " [--udp <group_addr> <port>]"
+                   " [--rudp <port> [--rudp-loss <fraction>]]"
+                   " [--session-rate <msgs/sec>] [--session-bytes <bytes/sec>]"
+                   " [--max-queue <msgs>] [--slow-consumer drop|disconnect]"
+                   " [--topic-rate <msgs/sec>] [--topic-bytes <bytes/sec>]"
+                   " [--topic-backlog <msgs>] [--io-threads <n>]"
+                   " [--reuse-port] [--backlog <n>] [--accepts <n>]"
+                   " [--session-pool <n>] [--journal <dir>"
+                   " [--journal-segment-mb <n>] [--journal-segments <n>]"
+                   " [--journal-sync none|group|<ms>]]"
+                   " [--snapshot <path> [--snapshot-interval <secs>]]"
+                   " [--handoff <unix_path>] [--takeover <unix_path>]"
+                   " [--shm <path> [--shm-mb <n>]] [--unix <path>]"
+                   " [--busy-poll [--poll-spins <n>] [--poll-yields <n>]"
+                   " [--poll-sleep-us <us>]] [--cpus <cpus>[,<cpus>...]]"
+                   " [--route-to-node] [--nic <interface>]"
+                   " [--start-requests]\n";
+      return 1;
+    }
 
-  void HandleRead(const error_code& ec) {
-    if (Stopped()) return;
+    asio::io_context io_context;
+    std::vector<std::unique_ptr<asio::io_context> > io_contexts;
+    tcp::endpoint listen_endpoint(tcp::v4(), options.listen_port);
 
-    if (ec) {
-      Stop();
-    } else {
-      std::string msg;
-      std::istream is(&input_buffer_);
-      std::getline(is, msg);
+    // Taking over from a running server comes before loading anything, as
+    // the predecessor finishes its journal and snapshot before handing over.
+    HandoffState inherited;
+    if (!options.takeover_path.empty()) {
+      TakeOver(options.takeover_path, inherited);
+      options.listen.inherited = inherited.listeners;
+    }
 
-      if (!msg.empty()) {
-        channel_.Deliver(msg);
+    // A snapshot from an earlier run is mapped first; one that cannot be
+    // read just means a cold start.
+    shared_ptr<const Snapshot> snapshot;
+    if (!options.snapshot_path.empty() &&
+        access(options.snapshot_path.c_str(), F_OK) == 0) {
+      try {
+        snapshot.reset(new Snapshot(options.snapshot_path));
       }
-      else {
-        if (output_queue_.empty()) {
-          output_queue_.push_back("\n");  // Return heartbeat if idle.
-          non_empty_output_queue_.expires_at(posix_time::neg_infin);
-        }
+      catch (std::exception& e) {
+        std::cerr << "Ignoring snapshot: " << e.what() << "\n";
       }
-
-      StartRead();
     }
-  }
-
-  void AwaitOutput() {
-    if (Stopped()) return;
 
-    if (output_queue_.empty()) {
-      non_empty_output_queue_.expires_at(posix_time::pos_infin);
-      non_empty_output_queue_.async_wait(bind(&TcpSession::AwaitOutput,
-                                              shared_from_this()));
-    } else {
-      StartWrite();
+    std::unique_ptr<Journal> journal;
+    std::unique_ptr<ShmRing> shm_ring;
+    Server server(io_context, listen_endpoint, options.listen);
+    if (!options.journal.directory.empty()) {
+      journal.reset(snapshot ? new Journal(options.journal, server.metrics(),
+                                           snapshot->segments())
+                             : new Journal(options.journal, server.metrics()));
+      server.set_journal(journal.get());
     }
-  }
-
-  void StartWrite() {
-    output_deadline_.expires_from_now(posix_time::seconds(30));
-    asio::async_write(socket_, asio::buffer(output_queue_.front()),
-                      bind(&TcpSession::HandleWrite, shared_from_this(), _1));
-  }
-
-  void HandleWrite(const error_code& ec) {
-    if (Stopped()) return;
-
-    if (!ec) {
-      output_queue_.pop_front();
-      AwaitOutput();
-    } else {
-      Stop();
+    if (snapshot) server.Restore(snapshot);
+    if (!options.shm_path.empty()) {
+      shm_ring.reset(new ShmRing(options.shm_path, options.shm_size));
+      server.set_shm_ring(shm_ring.get());
     }
-  }
-
-  void CheckDeadline(deadline_timer* deadline) {
-    if (Stopped()) return;
-
-    if (deadline->expires_at() <= deadline_timer::traits_type::now())
-      Stop();
-    else
-      deadline->async_wait(bind(&TcpSession::CheckDeadline,
-                                shared_from_this(), deadline));
-  }
-
-  Channel& channel_;
-  tcp::socket socket_;
-  asio::streambuf input_buffer_;
-  deadline_timer input_deadline_;
-  std::deque<std::string> output_queue_;
-  deadline_timer non_empty_output_queue_;
-  deadline_timer output_deadline_;
-};
-
-class Server {
- public:
-  Server(asio::io_service& io_service,
-         const tcp::endpoint& listen_endpoint)
-    : io_service_(io_service),
-      acceptor_(io_service, listen_endpoint) {
-    StartAccept();
-  }
-
-  void StartAccept() {
-    TcpSessionPtr new_session(new TcpSession(io_service_, channel_));
-
-    acceptor_.async_accept(new_session->socket(),
-        bind(&Server::HandleAccept, this, new_session, _1));
-  }
-
-  void HandleAccept(TcpSessionPtr session, const error_code& ec) {
-    if (!ec) {
-      for (const auto& msg : cache_) { // TODO(ds) use container adapter
-        session->Deliver(msg.second);
-      }
-      session->Start();
+    if (!options.cpus.empty()) server.Place(io_context, options.cpus[0]);
+    server.set_timestamps(options.timestamps);
+    server.set_session_limits(options.session_limits);
+    server.set_topic_limits(options.topic_limits);
+
+    if (!options.udp_address.empty()) {
+      udp::endpoint group_endpoint(
+          asio::ip::make_address(options.udp_address),
+          options.udp_port);
+      server.Join(SubscriberPtr(new UdpBroadcaster(io_context.get_executor(),
+                                                   group_endpoint,
+                                                   server.metrics())));
     }
 
-    StartAccept();
-  }
+    std::unique_ptr<UdpListener> rudp;
+    if (options.rudp_port) {
+      udp::endpoint rudp_endpoint(udp::v4(), options.rudp_port);
+      rudp.reset(new UdpListener(io_context.get_executor(), rudp_endpoint,
+                                 server, server.metrics(),
+                                 options.rudp_loss));
+    }
 
-  void PublishMessage(const std::string& msg) {
-    cache_[cache_.size() + 1] = msg;
-    channel_.Deliver(msg);
-  }
+    if (!options.unix_path.empty())
+      server.ListenLocal(io_context, options.unix_path);
 
- private:
-  asio::io_service& io_service_;
-  tcp::acceptor acceptor_;
-  Channel channel_;
+    std::unique_ptr<AdminServer> admin;
+    if (options.admin_port) {
+      tcp::endpoint admin_endpoint(asio::ip::address_v4::loopback(),
+                                   options.admin_port);
+      admin.reset(new AdminServer(io_context, admin_endpoint,
+                                  server.metrics()));
+    }
 
-  std::map<long, std::string> cache_;
-};
+    std::unique_ptr<Snapshotter> snapshotter;
+    if (!options.snapshot_path.empty()) {
+      snapshotter.reset(new Snapshotter(io_context, server,
+                                        options.snapshot_path,
+                                        options.snapshot_interval));
+    }
 
-int main(int argc, char* argv[]) {
-  try {
-    using namespace std;
+    std::atomic<bool> handed_off(false);
+    std::unique_ptr<HandoffListener> handoff;
+    if (!options.handoff_path.empty()) {
+      handoff.reset(new HandoffListener(
+          io_context, server, options.handoff_path, options.snapshot_path,
+          [&handed_off]() { handed_off = true; }));
+    }
 
-    if (argc != 2) {
-      std::cerr << "Usage: server <listen_port>\n";
-      return 1;
+    std::unique_ptr<MetricsDumper> dumper;
+    if (options.stats_interval) {
+      dumper.reset(new MetricsDumper(io_context, server.metrics(),
+                                     options.stats_interval));
     }
 
-    asio::io_service io_service;
-    tcp::endpoint listen_endpoint(tcp::v4(), atoi(argv[1]));
+    // Each extra I/O thread accepts and runs its own share of the sessions.
+    typedef asio::executor_work_guard<asio::io_context::executor_type> Work;
+    std::vector<Work> work;
+    for (int i = 0; i < options.io_threads; ++i) {
+      io_contexts.emplace_back(new asio::io_context);
+      asio::io_context& thread_io = *io_contexts.back();
+      work.push_back(asio::make_work_guard(thread_io));
+      if (std::size_t(i + 1) < options.cpus.size())
+        server.Place(thread_io, options.cpus[i + 1]);
+      server.Listen(thread_io);
+    }
 
-    Server server(io_service, listen_endpoint);
-    io_service.post(bind(&Server::PublishMessage, &server, "000"));
+    // Listening sockets left over from a predecessor with more I/O threads
+    // are served by the main io_context.
+    server.AdoptListeners(io_context);
+    for (const HandoffSession& session : inherited.sessions)
+      server.AdoptSession(session.fd, session.position, session.input);
+
+    // The threads start once every acceptor is open, as sessions may be
+    // routed between them.
+    std::vector<std::thread> io_threads;
+    for (std::size_t i = 0; i < io_contexts.size(); ++i) {
+      io_threads.emplace_back(RunIoThread, std::ref(*io_contexts[i]),
+                              std::cref(options), i + 1,
+                              std::ref(server.metrics()), nullptr);
+    }
 
-    std::thread t([&](){ io_service.run(); });
+    // Busy polling, messages are handed to the channel thread through a
+    // queue that it polls instead of being posted, which would wake it.
+    std::unique_ptr<PublishIngress> ingress;
+    if (options.busy_poll) ingress.reset(new PublishIngress(server));
+    auto publish = [&](const std::string& msg) {
+      if (ingress)
+        ingress->Publish(msg);
+      else
+        asio::post(io_context, bind(&Server::PublishMessage, &server, msg));
+    };
+
+    publish("000");
+    std::thread t(RunIoThread, std::ref(io_context), std::cref(options), 0,
+                  std::ref(server.metrics()), ingress.get());
     std::string abc("abc");
-    for (;;) {
-      io_service.post(bind(&Server::PublishMessage, &server, abc));
+    while (!handed_off) {
+      publish(abc);
       sleep(1);
     }
 
+    // Handed over: the successor owns the sockets and the history.
+    io_context.stop();
     t.join();
+    for (std::size_t i = 0; i < io_contexts.size(); ++i) {
+      io_contexts[i]->stop();
+      io_threads[i].join();
+    }
   }
   catch (std::exception& e) {
     std::cerr << "Exception: " << e.what() << "\n";
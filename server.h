@@ -0,0 +1,2668 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#endif
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/circular_buffer.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "handler_alloc.h"
+#include "handoff.h"
+#include "history.h"
+#include "journal.h"
+#include "metrics.h"
+#include "placement.h"
+#include "rate_limit.h"
+#include "shm_ring.h"
+#include "snapshot.h"
+#include "spsc_queue.h"
+#include "timestamp.h"
+#include "udp_protocol.h"
+
+#if defined(SESSION_IO_URING)
+#include "uring.h"
+#endif
+
+#if defined(SESSION_COROUTINES) && !defined(BOOST_ASIO_HAS_CO_AWAIT)
+#error "SESSION_COROUTINES needs C++20 coroutines (-std=c++20)"
+#endif
+
+#if defined(SESSION_IO_URING) && \
+    (defined(SESSION_COROUTINES) || !defined(__linux__))
+#error "SESSION_IO_URING needs Linux and callback sessions"
+#endif
+
+using boost::asio::steady_timer;
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+using boost::asio::local::stream_protocol;
+using boost::bind;
+using boost::shared_ptr;
+using boost::system::error_code;
+
+namespace asio = boost::asio;
+
+class Handoff;
+
+// The address family of a connected or listening socket inherited as a
+// descriptor, and the Protocol to adopt it as.
+// A Unix domain socket's path is stored in path, if given.
+inline int SocketFamily(int fd, std::string* path = 0) {
+  sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  if (::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+    throw HandoffError("getsockname");
+
+  if (path && address.ss_family == AF_UNIX) {
+    const sockaddr_un& local = reinterpret_cast<const sockaddr_un&>(address);
+    std::size_t offset = offsetof(sockaddr_un, sun_path);
+    path->assign(local.sun_path,
+                 strnlen(local.sun_path, length > offset ? length - offset
+                                                         : 0));
+  }
+  return address.ss_family;
+}
+
+template <typename Protocol> Protocol ProtocolOf(int fd);
+
+template <> inline tcp ProtocolOf<tcp>(int fd) {
+  return SocketFamily(fd) == AF_INET6 ? tcp::v6() : tcp::v4();
+}
+
+template <> inline stream_protocol ProtocolOf<stream_protocol>(int) {
+  return stream_protocol();
+}
+
+// Subscribers carry an intrusive, thread safe reference count. When the last
+// reference goes the subscriber is recycled, which by default deletes it but
+// lets pooled sessions return to their freelist instead.
+class Subscriber {
+ public:
+  Subscriber() : refs_(0) {}
+  virtual ~Subscriber() {}
+  virtual void Deliver(const std::string& msg) = 0;
+
+  // The io_context the subscriber runs on, or null for the channel's own.
+  // The channel delivers to it on that thread (see Channel).
+  virtual asio::io_context* context() {
+    return 0;
+  }
+
+  // Asked on the channel thread when the server is handed to a successor
+  // process (see Handoff). A subscriber that can be handed over reports to
+  // handoff once it has drained and returns true; the channel then drops it.
+  virtual bool HandOff(const shared_ptr<Handoff>&, uint64_t) {
+    return false;
+  }
+
+ protected:
+  virtual void Recycle() {
+    delete this;
+  }
+
+ private:
+  friend void intrusive_ptr_add_ref(Subscriber* subscriber) {
+    subscriber->refs_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  friend void intrusive_ptr_release(Subscriber* subscriber) {
+    if (subscriber->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      subscriber->Recycle();
+  }
+
+  std::atomic<int> refs_;
+};
+
+typedef boost::intrusive_ptr<Subscriber> SubscriberPtr;
+
+template <typename Protocol> class StreamSession;
+
+// Gathers what the server hands to a successor process (see handoff.h): its
+// listening sockets, then each session's socket once the session has drained
+// its output. Sessions drain on their own threads and report here; when all
+// have, or the drain times out, done is called on the channel thread with
+// what was gathered. Sessions that report after that are closed instead.
+class Handoff : public boost::enable_shared_from_this<Handoff> {
+ public:
+  typedef std::function<void(HandoffState&)> Callback;
+
+  Handoff(const asio::io_context::executor_type& executor,
+          const Callback& done)
+    : executor_(executor),
+      timer_(executor),
+      done_(done),
+      pending_(1),
+      finished_(false) {}
+
+  void AddListener(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    state_.listeners.push_back(fd);
+  }
+
+  // Counts a session that has been asked to drain.
+  void Expect() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++pending_;
+  }
+
+  // Takes a drained session's socket. Returns false if the handoff has
+  // already finished, in which case the caller still owns fd.
+  bool AddSession(int fd, uint64_t position, const std::string& input) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (finished_) return false;
+      HandoffSession session = { fd, position, input };
+      state_.sessions.push_back(session);
+    }
+    Report();
+    return true;
+  }
+
+  // An expected session closed instead of draining.
+  void Abandon() {
+    Report();
+  }
+
+  // Call once every subscriber has been asked to drain.
+  void Start(Clock::duration timeout) {
+    timer_.expires_after(timeout);
+    timer_.async_wait(bind(&Handoff::Finish, shared_from_this()));
+    Report();
+  }
+
+ private:
+  void Report() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--pending_ == 0)
+      asio::post(executor_, bind(&Handoff::Finish, shared_from_this()));
+  }
+
+  void Finish() {
+    HandoffState state;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (finished_) return;
+      finished_ = true;
+      std::swap(state, state_);
+    }
+    timer_.cancel();
+    done_(state);
+  }
+
+  asio::io_context::executor_type executor_;
+  steady_timer timer_;
+  Callback done_;
+  std::mutex mutex_;
+  HandoffState state_;
+  int pending_;
+  bool finished_;
+};
+
+template <typename Protocol> class SessionPool;
+
+// A topic. When the topic is rate limited, messages over the limit wait in a
+// bounded backlog that is drained by a timer as tokens become available.
+//
+// The channel belongs to one io_context thread. Join, Leave and Deliver may
+// be called from sessions on other threads and are then posted across.
+// Subscribers running on another io_context are reached through a Relay for
+// that thread, which takes each message once for all of them.
+class Channel {
+ public:
+  Channel(const asio::io_context::executor_type& executor, Metrics& metrics)
+    : executor_(executor),
+      metrics_(metrics),
+      timestamps_(false),
+      node_(-1),
+      drain_timer_(executor),
+      drain_armed_(false) {}
+
+  // A relay's flush still queued on a stopped io_context is destroyed with
+  // that context, which may be after the channel, so its relay is left to it.
+  ~Channel() {
+    for (auto& relay : relays_)
+      if (relay.second->posted()) relay.second.release();
+  }
+
+  void Join(SubscriberPtr subscriber) {
+    if (!OnChannelThread()) {
+      asio::post(executor_, bind(&Channel::Join, this, subscriber));
+      return;
+    }
+    if (!subscribers_.insert(subscriber).second) return;
+
+    Relay* relay = RelayFor(*subscriber);
+    if (relay)
+      relay->Join(subscriber);
+    else
+      local_.insert(subscriber);
+  }
+
+  void Leave(SubscriberPtr subscriber) {
+    if (!OnChannelThread()) {
+      asio::post(executor_, bind(&Channel::Leave, this, subscriber));
+      return;
+    }
+    if (subscribers_.erase(subscriber)) Remove(subscriber);
+  }
+
+  void Deliver(const std::string& msg) {
+    if (!OnChannelThread()) {
+      asio::post(executor_, bind(&Channel::Deliver, this, msg));
+      return;
+    }
+
+    if (backlog_.empty() && limiter_.Wait(Clock::now()) == Clock::duration(0)) {
+      limiter_.Take(msg.size() + 1);
+      Fanout(msg);
+      return;
+    }
+
+    ServerStats& stats = metrics_.Local();
+    stats.topic_throttles.Add(1);
+    backlog_.push_back(msg);
+    if (backlog_.size() > topic_limits_.max_backlog) {
+      backlog_.pop_front();
+      stats.topic_drops.Add(1);
+    }
+    ArmDrain();
+  }
+
+  // Asks each subscriber to hand itself off, dropping those that will.
+  // Messages still in the backlog have not been delivered, so the successor
+  // starts them from position less the backlog.
+  void HandOff(const shared_ptr<Handoff>& handoff, uint64_t position) {
+    position -= backlog_.size();
+    std::set<SubscriberPtr>::iterator i = subscribers_.begin();
+    while (i != subscribers_.end()) {
+      if ((*i)->HandOff(handoff, position)) {
+        Remove(*i);
+        subscribers_.erase(i++);
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  const asio::io_context::executor_type& executor() const {
+    return executor_;
+  }
+
+  bool OnChannelThread() const {
+    return executor_.running_in_this_thread();
+  }
+
+  Metrics& metrics() {
+    return metrics_;
+  }
+
+  // When set, subscribers time each message from enqueue to write completion.
+  bool timestamps() const {
+    return timestamps_;
+  }
+
+  void set_timestamps(bool timestamps) {
+    timestamps_ = timestamps;
+  }
+
+  // The NUMA node the channel thread runs on, -1 if unknown.
+  int node() const {
+    return node_;
+  }
+
+  void set_node(int node) {
+    node_ = node;
+  }
+
+  const SessionLimits& session_limits() const {
+    return session_limits_;
+  }
+
+  // Applies to sessions started after the call.
+  void set_session_limits(const SessionLimits& limits) {
+    session_limits_ = limits;
+  }
+
+  void set_topic_limits(const TopicLimits& limits) {
+    topic_limits_ = limits;
+    limiter_ = RateLimiter(limits.msgs_per_sec, limits.bytes_per_sec);
+  }
+
+ private:
+  // Delivers to the subscribers on one other io_context thread. The channel
+  // queues each message once, along with subscribers joining and leaving,
+  // and a single posted Flush() delivers everything queued since the last
+  // on the relay's thread. So a message costs one copy per thread rather
+  // than a copy and a post per subscriber, and as queue entries keep their
+  // strings' capacity and the flush reuses one block of handler memory, a
+  // steady stream allocates nothing.
+  //
+  // A joining subscriber has just had its history posted to it. Messages
+  // after the join may already be in a flush posted before that, so the
+  // flush re-posts itself after a join to go behind the history.
+  class Relay {
+   public:
+    explicit Relay(asio::io_context& context)
+      : executor_(context.get_executor()),
+        members_(0),
+        queued_(0),
+        posted_(false),
+        flushing_count_(0),
+        flushed_(0) {}
+
+    // On the channel thread. Messages are queued only while the relay has
+    // subscribers.
+    void Join(const SubscriberPtr& subscriber) {
+      ++members_;
+      Queue(kJoin, 0, subscriber);
+    }
+
+    void Leave(const SubscriberPtr& subscriber) {
+      --members_;
+      Queue(kLeave, 0, subscriber);
+    }
+
+    void Deliver(const std::string& msg) {
+      if (members_) Queue(kMessage, &msg, SubscriberPtr());
+    }
+
+    bool posted() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return posted_;
+    }
+
+   private:
+    enum Op { kMessage, kJoin, kLeave };
+
+    struct Entry {
+      Op op;
+      std::string msg;
+      SubscriberPtr subscriber;
+    };
+
+    Relay(const Relay&);
+    Relay& operator=(const Relay&);
+
+    void Queue(Op op, const std::string* msg,
+               const SubscriberPtr& subscriber) {
+      bool post;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queued_ == queue_.size()) queue_.push_back(Entry());
+        Entry& entry = queue_[queued_++];
+        entry.op = op;
+        if (msg) entry.msg.assign(*msg);
+        entry.subscriber = subscriber;
+        post = !posted_;
+        posted_ = true;
+      }
+      if (post) Post();
+    }
+
+    // The flush's handler memory is freed before the flush runs, and only
+    // used again once posted_ has been cleared under the lock, or by the
+    // flush itself.
+    void Post() {
+      asio::post(executor_, MakeAllocHandler(flush_memory_,
+                                             bind(&Relay::Flush, this)));
+    }
+
+    // On the relay's thread.
+    void Flush() {
+      if (flushed_ == flushing_count_) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.swap(flushing_);
+        flushing_count_ = queued_;
+        queued_ = 0;
+        flushed_ = 0;
+      }
+
+      while (flushed_ < flushing_count_) {
+        Entry& entry = flushing_[flushed_++];
+        if (entry.op == kMessage) {
+          for (const SubscriberPtr& subscriber : subscribers_)
+            subscriber->Deliver(entry.msg);
+          continue;
+        }
+
+        if (entry.op == kJoin)
+          subscribers_.insert(entry.subscriber);
+        else
+          subscribers_.erase(entry.subscriber);
+        entry.subscriber.reset();
+        if (entry.op == kJoin && flushed_ < flushing_count_) {
+          Post();
+          return;
+        }
+      }
+
+      bool more;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        more = queued_ != 0;
+        posted_ = more;
+      }
+      if (more) Post();
+    }
+
+    asio::io_context::executor_type executor_;
+    std::size_t members_;  // Subscribers, as the channel counts them.
+
+    std::mutex mutex_;
+    std::vector<Entry> queue_;  // Entries from queued_ on are spare.
+    std::size_t queued_;
+    bool posted_;  // Whether a flush is pending or running.
+
+    // The relay thread's own.
+    std::vector<Entry> flushing_;
+    std::size_t flushing_count_;
+    std::size_t flushed_;
+    std::set<SubscriberPtr> subscribers_;
+    HandlerMemory flush_memory_;
+  };
+
+  // The relay for a subscriber on another io_context, null if it runs on
+  // the channel's.
+  Relay* RelayFor(Subscriber& subscriber) {
+    asio::io_context* context = subscriber.context();
+    if (!context || context->get_executor() == executor_) return 0;
+
+    std::unique_ptr<Relay>& relay = relays_[context];
+    if (!relay) relay.reset(new Relay(*context));
+    return relay.get();
+  }
+
+  void Remove(const SubscriberPtr& subscriber) {
+    Relay* relay = RelayFor(*subscriber);
+    if (relay)
+      relay->Leave(subscriber);
+    else
+      local_.erase(subscriber);
+  }
+
+  void Fanout(const std::string& msg) {
+    metrics_.Local().deliveries.Add(subscribers_.size());
+    std::for_each(local_.begin(), local_.end(),
+        bind(&Subscriber::Deliver, _1, boost::ref(msg)));
+    for (auto& relay : relays_)
+      relay.second->Deliver(msg);
+  }
+
+  void ArmDrain() {
+    if (drain_armed_) return;
+    drain_armed_ = true;
+    drain_timer_.expires_after(limiter_.Wait(Clock::now()));
+    drain_timer_.async_wait(bind(&Channel::Drain, this, _1));
+  }
+
+  void Drain(const error_code& ec) {
+    drain_armed_ = false;
+    if (ec) return;
+
+    while (!backlog_.empty() &&
+           limiter_.Wait(Clock::now()) == Clock::duration(0)) {
+      limiter_.Take(backlog_.front().size() + 1);
+      Fanout(backlog_.front());
+      backlog_.pop_front();
+    }
+
+    if (!backlog_.empty()) ArmDrain();
+  }
+
+  asio::io_context::executor_type executor_;
+  Metrics& metrics_;
+  bool timestamps_;
+  int node_;
+  std::set<SubscriberPtr> subscribers_;
+  std::set<SubscriberPtr> local_;  // Those on the channel's thread.
+  std::map<asio::io_context*, std::unique_ptr<Relay> > relays_;
+  SessionLimits session_limits_;
+  TopicLimits topic_limits_;
+  RateLimiter limiter_;
+  std::deque<std::string> backlog_;
+  steady_timer drain_timer_;
+  bool drain_armed_;
+};
+
+// A subscriber connection over a stream socket of any Protocol: TCP, or a
+// Unix domain socket for subscribers on the same host. Writes are paced by
+// the channel's session limits; while a write waits for tokens, new messages
+// queue behind it, and once the queue reaches max_queue the slow-consumer
+// policy decides whether to drop the oldest message or disconnect.
+//
+// A session runs on the executor that accepted it, which need not be the
+// channel's; deliveries from the channel thread are posted across. Sessions
+// are recycled through a SessionPool rather than destroyed, so everything
+// here must be put back to its constructed state by Reset().
+template <typename Protocol>
+class StreamSession : public Subscriber {
+ public:
+  typedef typename Protocol::socket Socket;
+  typedef boost::intrusive_ptr<StreamSession> Ptr;
+  typedef std::function<void(const Ptr&, uint64_t)> SubscribeFunction;
+
+  enum { kInitialQueue = 16, kRequestWaitMs = 250 };
+
+  // A queued message and, in timestamping mode, when it was enqueued.
+  struct Output {
+    std::string data;
+    Clock::time_point enqueued;
+  };
+
+  StreamSession(const asio::io_context::executor_type& executor,
+                Channel& ch)
+    : executor_(executor),
+      channel_(ch),
+      metrics_(ch.metrics()),
+      socket_(executor),
+      input_deadline_(executor),
+      output_queue_(kInitialQueue),
+      non_empty_output_queue_(executor),
+      output_deadline_(executor),
+      pacing_timer_(executor),
+      request_timer_(executor),
+      first_line_(false),
+      writing_(0),
+      disconnecting_(false),
+      handoff_position_(0),
+      node_(-1)
+#if defined(SESSION_IO_URING)
+      , uring_(asio::use_service<Uring>(
+            asio::query(executor, asio::execution::context))),
+      read_op_(this),
+      write_op_(this),
+      write_slot_(-1),
+      write_data_(0),
+      write_left_(0),
+      release_on_read_end_(false)
+#endif
+      {
+    spare_.reserve(kInitialQueue);
+    Reset();
+  }
+
+  // Starts reading and writing. The owner joins the session to the channel.
+  void Start() {
+    limits_ = channel_.session_limits();
+    limiter_ = RateLimiter(limits_.msgs_per_sec, limits_.bytes_per_sec);
+
+#if defined(SESSION_COROUTINES)
+    Ptr self(this);
+    asio::co_spawn(executor_, Reader(self), asio::detached);
+    asio::co_spawn(executor_, Writer(self), asio::detached);
+    asio::co_spawn(executor_, Watchdog(self, input_deadline_), asio::detached);
+    asio::co_spawn(executor_, Watchdog(self, output_deadline_),
+                   asio::detached);
+#else
+    StartRead();
+    AwaitDeadline(input_deadline_, input_deadline_memory_);
+    AwaitOutput();
+    AwaitDeadline(output_deadline_, output_deadline_memory_);
+#endif
+  }
+
+  Socket& socket() {
+    return socket_;
+  }
+
+  // Lets a new subscriber say where it wants the history from before it is
+  // subscribed: subscribe(session, from) is called with the sequence of a
+  // first line "from <sequence>", or with 1 as soon as any other line
+  // arrives, or none has after kRequestWaitMs. The request line is not
+  // published. Call before Start().
+  void AwaitRequest(const SubscribeFunction& subscribe) {
+    subscribe_ = subscribe;
+    first_line_ = true;
+    request_timer_.expires_after(
+        std::chrono::milliseconds(kRequestWaitMs));
+    request_timer_.async_wait(
+        bind(&StreamSession::HandleRequestWait, Ptr(this), _1));
+  }
+
+  // Takes over a connected socket handed off by a predecessor, with the
+  // input it had read but not handled. Call before Start().
+  void Adopt(int fd, const std::string& input) {
+    socket_.assign(ProtocolOf<Protocol>(fd), fd);
+    input_buffer_.commit(asio::buffer_copy(
+        input_buffer_.prepare(input.size()), asio::buffer(input)));
+  }
+
+  asio::io_context* context() {
+    return &asio::query(executor_, asio::execution::context);
+  }
+
+  // Called on the session's thread by the channel's relay, or else posted
+  // there (as for a catch-up from the cache).
+  void Deliver(const std::string& msg) {
+    if (!executor_.running_in_this_thread()) {
+      asio::post(executor_,
+                 bind(&StreamSession::Deliver, Ptr(this), msg));
+      return;
+    }
+
+    if (node_ >= 0 && channel_.node() >= 0 && node_ != channel_.node()) {
+      ServerStats& stats = metrics_.Local();
+      stats.cross_node_deliveries.Add(1);
+      stats.cross_node_bytes.Add(msg.size());
+    }
+    if (disconnecting_) return;
+
+    if (limits_.max_queue && output_queue_.size() >= limits_.max_queue) {
+      ServerStats& stats = metrics_.Local();
+      if (limits_.policy == kDisconnect) {
+        // Deliver is called while the channel iterates its subscribers, so
+        // leave the channel from a fresh handler.
+        disconnecting_ = true;
+        stats.slow_consumer_disconnects.Add(1);
+        asio::post(executor_,
+                   bind(&StreamSession::Disconnect, Ptr(this)));
+        return;
+      }
+
+      // The front writing_ messages may be in a write in progress.
+      std::size_t oldest = writing_;
+      if (oldest < output_queue_.size()) {
+        SpareBuffer(output_queue_[oldest]);
+        output_queue_.erase(output_queue_.begin() + oldest);
+        stats.slow_consumer_drops.Add(1);
+        stats.queued_messages.Add(-1);
+      }
+    }
+
+    Output& output = Enqueue();
+    output.data.append(msg).push_back('\n');
+    if (channel_.timestamps())
+      output.enqueued = Clock::now();
+
+    ServerStats& stats = metrics_.Local();
+    stats.queued_messages.Add(1);
+    stats.queue_depth.Record(output_queue_.size());
+
+    non_empty_output_queue_.expires_at(steady_timer::time_point::min());
+  }
+
+  // Catches the session up from journal ranges. They are sent straight from
+  // the segment files, ahead of anything in the output queue, so that live
+  // messages delivered meanwhile follow the history without a gap.
+  void CatchUp(const std::vector<JournalRange>& ranges) {
+    if (!executor_.running_in_this_thread()) {
+      asio::post(executor_,
+                 bind(&StreamSession::CatchUp, Ptr(this), ranges));
+      return;
+    }
+
+    if (disconnecting_ || ranges.empty()) return;
+
+    history_.insert(history_.end(), ranges.begin(), ranges.end());
+    non_empty_output_queue_.expires_at(steady_timer::time_point::min());
+  }
+
+  bool HandOff(const shared_ptr<Handoff>& handoff, uint64_t position) {
+    handoff->Expect();
+    asio::post(executor_, bind(&StreamSession::BeginHandOff, Ptr(this),
+                               handoff, position));
+    return true;
+  }
+
+ private:
+  friend class SessionPool<Protocol>;
+
+  void Recycle();
+
+  // Called once the last reference is gone, so no handlers are pending.
+  void Reset() {
+    input_buffer_.consume(input_buffer_.size());
+    history_.clear();
+    while (!output_queue_.empty()) {
+      SpareBuffer(output_queue_.front());
+      output_queue_.pop_front();
+    }
+    input_deadline_.expires_at(steady_timer::time_point::max());
+    output_deadline_.expires_at(steady_timer::time_point::max());
+    non_empty_output_queue_.expires_at(steady_timer::time_point::max());
+    writing_ = 0;
+    write_buffer_.clear();
+    disconnecting_ = false;
+    handoff_.reset();
+    request_timer_.expires_at(steady_timer::time_point::max());
+    subscribe_ = SubscribeFunction();
+    first_line_ = false;
+#if defined(SESSION_IO_URING)
+    release_on_read_end_ = false;
+#endif
+  }
+
+  void Stop() {
+    channel_.Leave(Ptr(this));
+    if (handoff_) {
+      handoff_->Abandon();
+      handoff_.reset();
+    }
+
+    ServerStats& stats = metrics_.Local();
+    stats.sessions_closed.Add(1);
+    stats.queued_messages.Add(-int64_t(output_queue_.size()));
+
+    error_code ignored_ec;
+    socket_.close(ignored_ec);
+    input_deadline_.cancel();
+    non_empty_output_queue_.cancel();
+    output_deadline_.cancel();
+    pacing_timer_.cancel();
+    request_timer_.cancel();
+    subscribe_ = SubscribeFunction();
+#if defined(SESSION_IO_URING)
+    if (read_self_) uring_.Cancel(&read_op_);
+    if (write_self_) uring_.Cancel(&write_op_);
+#endif
+  }
+
+  void Disconnect() {
+    if (!Stopped()) Stop();
+  }
+
+  bool Stopped() const {
+    return !socket_.is_open();
+  }
+
+  // Appends an empty output, reusing a spare buffer and growing the ring
+  // only when it is full.
+  Output& Enqueue() {
+    if (output_queue_.full()) {
+      output_queue_.set_capacity(2 * output_queue_.capacity());
+      spare_.reserve(output_queue_.capacity());
+    }
+
+    output_queue_.push_back(Output());
+    Output& output = output_queue_.back();
+    if (!spare_.empty()) {
+      output.data.swap(spare_.back());
+      spare_.pop_back();
+    }
+    return output;
+  }
+
+  // Keeps a written or dropped message's buffer for reuse.
+  void SpareBuffer(Output& output) {
+    if (spare_.size() < spare_.capacity()) {
+      output.data.clear();
+      spare_.push_back(std::string());
+      spare_.back().swap(output.data);
+    }
+  }
+
+  // Handles a line read from the subscriber: a message to publish, or an
+  // empty heartbeat that is echoed back if nothing else is queued. The
+  // first line may instead be a request (see AwaitRequest()).
+  void HandleLine() {
+    std::istream is(&input_buffer_);
+    std::getline(is, read_line_);
+
+    if (first_line_) {
+      first_line_ = false;
+      uint64_t from = 0;
+      if (ParseRequest(read_line_, from)) {
+        Subscribe(from);
+        return;
+      }
+    }
+    Subscribe(1);
+
+    if (!read_line_.empty()) {
+      channel_.Deliver(read_line_);
+    }
+    else {
+      if (output_queue_.empty()) {
+        Enqueue().data.push_back('\n');  // Return heartbeat if idle.
+        ServerStats& stats = metrics_.Local();
+        stats.heartbeat_replies.Add(1);
+        stats.queued_messages.Add(1);
+        non_empty_output_queue_.expires_at(steady_timer::time_point::min());
+      }
+    }
+  }
+
+  // "from <sequence>", with a sequence of at least 1.
+  static bool ParseRequest(const std::string& line, uint64_t& from) {
+    if (line.compare(0, 5, "from ") != 0 || line.size() == 5 ||
+        line.find_first_not_of("0123456789", 5) != std::string::npos)
+      return false;
+    from = std::strtoull(line.c_str() + 5, 0, 10);
+    return from > 0;
+  }
+
+  // Subscribes the session, if it is still waiting to be.
+  void Subscribe(uint64_t from) {
+    if (!subscribe_) return;
+    SubscribeFunction subscribe;
+    subscribe.swap(subscribe_);
+    request_timer_.cancel();
+    subscribe(Ptr(this), from);
+  }
+
+  void HandleRequestWait(const error_code& ec) {
+    if (!ec && !Stopped()) Subscribe(1);
+  }
+
+  // Bookkeeping either side of writing the front of the output queue. The
+  // front message's bytes are written from write_buffer_, as growing the
+  // queue meanwhile may move the queued strings (and short ones hold their
+  // bytes inline); EndWrite() puts them back.
+  void BeginWrite() {
+    output_deadline_.expires_after(std::chrono::seconds(30));
+    write_start_ = Clock::now();
+    writing_ = 1;
+    write_buffer_.swap(output_queue_.front().data);
+    limiter_.Take(write_buffer_.size());
+  }
+
+  void EndWrite() {
+    // Messages end in '\n', so only a message being written is non-empty.
+    if (!write_buffer_.empty())
+      write_buffer_.swap(output_queue_.front().data);
+
+    ServerStats& stats = metrics_.Local();
+    stats.messages_written.Add(1);
+    stats.bytes_written.Add(output_queue_.front().data.size());
+    stats.queued_messages.Add(-1);
+    stats.write_ns.Record(ElapsedNs(write_start_));
+    if (output_queue_.front().enqueued != Clock::time_point())
+      stats.deliver_ns.Record(ElapsedNs(output_queue_.front().enqueued));
+
+    SpareBuffer(output_queue_.front());
+    output_queue_.pop_front();
+  }
+
+  // Wakes the writer, which completes the handoff once the session's output
+  // has drained: the socket then goes to the Handoff, with any input read
+  // but not handled. The reader stops at its next line.
+  void BeginHandOff(const shared_ptr<Handoff>& handoff, uint64_t position) {
+    if (Stopped() || disconnecting_) {
+      handoff->Abandon();
+      return;
+    }
+
+    handoff_ = handoff;
+    handoff_position_ = position;
+    non_empty_output_queue_.expires_at(steady_timer::time_point::min());
+  }
+
+  // Releases the drained session's socket to the handoff. Releasing cancels
+  // a pending read; whatever it had read so far stays in input_buffer_.
+  void CompleteHandOff() {
+#if defined(SESSION_IO_URING)
+    // The receive must end before the socket goes, so that input_buffer_
+    // holds everything taken off it. HandleReceive calls back once it has.
+    if (read_self_) {
+      if (!release_on_read_end_) uring_.Cancel(&read_op_);
+      release_on_read_end_ = true;
+      return;
+    }
+    release_on_read_end_ = false;
+#endif
+    shared_ptr<Handoff> handoff;
+    handoff.swap(handoff_);
+    std::string input(asio::buffers_begin(input_buffer_.data()),
+                      asio::buffers_end(input_buffer_.data()));
+
+    error_code ec;
+    int fd = socket_.release(ec);
+    input_deadline_.cancel();
+    non_empty_output_queue_.cancel();
+    output_deadline_.cancel();
+    pacing_timer_.cancel();
+
+    ServerStats& stats = metrics_.Local();
+    if (!ec && handoff->AddSession(fd, handoff_position_, input)) {
+      stats.sessions_handed_off.Add(1);
+    } else {
+      if (!ec) ::close(fd);
+      handoff->Abandon();
+      stats.sessions_closed.Add(1);
+    }
+  }
+
+  bool HasOutput() const {
+    return !history_.empty() || !output_queue_.empty();
+  }
+
+  // Sends as much of the front history range as the socket will take
+  // without blocking, with sendfile() so that the bytes go from the page
+  // cache to the socket without passing through user space. Returns false
+  // if the connection failed.
+  bool SendHistory() {
+    if (!socket_.non_blocking()) {
+      error_code ec;
+      socket_.non_blocking(true, ec);
+      if (ec) return false;
+    }
+
+    JournalRange& range = history_.front();
+#if defined(__linux__)
+    off_t offset = range.offset;
+    ssize_t sent = ::sendfile(socket_.native_handle(), range.segment->fd(),
+                              &offset, range.length);
+#else
+    ssize_t sent = ::send(socket_.native_handle(),
+                          range.segment->data() + range.offset,
+                          range.length, 0);
+#endif
+    if (sent < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    ServerStats& stats = metrics_.Local();
+    stats.history_sends.Add(1);
+    stats.history_bytes.Add(sent);
+    limiter_.TakeBytes(sent);
+
+    range.offset += sent;
+    range.length -= sent;
+    if (range.length == 0) {
+      stats.history_messages.Add(range.messages);
+      history_.pop_front();
+    }
+    return true;
+  }
+
+  // Returns how long the writer must wait for the session's rate limit.
+  Clock::duration Pace() {
+    Clock::duration wait = limiter_.Wait(Clock::now());
+    if (wait > Clock::duration(0)) {
+      // Waiting on our own rate limit is not the subscriber's fault.
+      metrics_.Local().session_throttles.Add(1);
+      output_deadline_.expires_at(steady_timer::time_point::max());
+      pacing_timer_.expires_after(wait);
+    }
+    return wait;
+  }
+
+  bool Expired(const steady_timer& deadline) {
+    if (deadline.expiry() > steady_timer::clock_type::now()) return false;
+
+    metrics_.Local().deadline_disconnects.Add(1);
+    return true;
+  }
+
+  // The reader, writer and deadline actors are chains of callbacks by
+  // default. Built with SESSION_COROUTINES each actor is instead a coroutine
+  // whose state lives in its frame, holding a reference to the session until
+  // it returns. Asio recycles coroutine frames and operation memory through
+  // a per-thread cache, in place of the HandlerMemory slots.
+#if defined(SESSION_COROUTINES)
+  asio::awaitable<void> Reader(Ptr self) {
+    error_code ec;
+    for (;;) {
+      input_deadline_.expires_after(std::chrono::seconds(30));
+      co_await asio::async_read_until(socket_, input_buffer_, '\n',
+          asio::redirect_error(asio::use_awaitable, ec));
+      if (Stopped()) co_return;
+      if (ec) {
+        Stop();
+        co_return;
+      }
+      if (handoff_) co_return;
+      HandleLine();
+    }
+  }
+
+  // Sleeps on non_empty_output_queue_ while there is nothing to write, and
+  // on pacing_timer_ while the rate limit holds the next write back.
+  asio::awaitable<void> Writer(Ptr self) {
+    error_code ec;
+    while (!Stopped()) {
+      if (!HasOutput() && handoff_) {
+        CompleteHandOff();
+      } else if (!HasOutput()) {
+        non_empty_output_queue_.expires_at(steady_timer::time_point::max());
+        co_await non_empty_output_queue_.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+      } else if (Pace() > Clock::duration(0)) {
+        co_await pacing_timer_.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+      } else if (!history_.empty()) {
+        output_deadline_.expires_after(std::chrono::seconds(30));
+        co_await socket_.async_wait(Socket::wait_write,
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (Stopped()) co_return;
+        if (ec || !SendHistory()) {
+          Stop();
+          co_return;
+        }
+      } else {
+        BeginWrite();
+        co_await asio::async_write(socket_, asio::buffer(write_buffer_),
+            asio::redirect_error(asio::use_awaitable, ec));
+        writing_ = 0;
+        if (Stopped()) co_return;
+        if (ec) {
+          Stop();
+          co_return;
+        }
+        EndWrite();
+      }
+    }
+  }
+
+  // Deadlines are pushed back on every read and write, which cancels the
+  // pending wait; the watchdog then simply waits again.
+  asio::awaitable<void> Watchdog(Ptr self, steady_timer& deadline) {
+    error_code ec;
+    while (!Stopped()) {
+      if (Expired(deadline)) {
+        Stop();
+        co_return;
+      }
+      co_await deadline.async_wait(
+          asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+#else
+  // Built with SESSION_IO_URING the callback reader and writer go through
+  // the thread's Uring engine instead of the reactor: one multishot receive
+  // per session, and writes that gather queued messages into registered
+  // buffers. History catch-up and the timers are unchanged.
+#if defined(SESSION_IO_URING)
+  // Forwards the engine's completions for one of the session's operations.
+  template <void (StreamSession::*Handler)(int, uint32_t)>
+  class Completion : public UringOp {
+   public:
+    explicit Completion(StreamSession* session) : session_(session) {}
+
+    void Complete(int result, uint32_t flags) {
+      (session_->*Handler)(result, flags);
+    }
+
+   private:
+    StreamSession* session_;
+  };
+
+  // The receive holds a reference to the session until its last completion.
+  void StartRead() {
+    input_deadline_.expires_after(std::chrono::seconds(30));
+    read_self_ = Ptr(this);
+    uring_.Receive(socket_.native_handle(), &read_op_);
+    HandleLines();
+  }
+
+  // Handles the complete lines in input_buffer_, which holds nothing that
+  // has been handled, unless a handoff has begun.
+  void HandleLines() {
+    const char* data = asio::buffer_cast<const char*>(input_buffer_.data());
+    std::size_t lines = std::count(data, data + input_buffer_.size(), '\n');
+    while (lines-- && !handoff_ && !Stopped())
+      HandleLine();
+  }
+
+  void HandleReceive(int result, uint32_t flags) {
+    if (result > 0 && (flags & IORING_CQE_F_BUFFER)) {
+      const char* data = uring_.RecvBuffer(flags);
+      input_buffer_.commit(asio::buffer_copy(input_buffer_.prepare(result),
+                                             asio::buffer(data, result)));
+    }
+    if (flags & IORING_CQE_F_BUFFER) uring_.ReleaseRecvBuffer(flags);
+
+    Ptr self;
+    bool more = flags & IORING_CQE_F_MORE;
+    if (!more) self.swap(read_self_);
+    if (Stopped()) return;
+
+    if (result > 0) {
+      input_deadline_.expires_after(std::chrono::seconds(30));
+      HandleLines();
+    }
+
+    if (more || Stopped()) return;
+    if (release_on_read_end_) {
+      CompleteHandOff();
+    } else if (result > 0 || result == -ENOBUFS) {
+      // The receive ends when it runs out of provided buffers, or now and
+      // then for the kernel's own reasons; it ends for good at EOF or on an
+      // error.
+      StartRead();
+    } else {
+      Stop();
+    }
+  }
+#else
+  void StartRead() {
+    Ptr self(this);
+    input_deadline_.expires_after(std::chrono::seconds(30));
+    asio::async_read_until(socket_, input_buffer_, '\n',
+        MakeAllocHandler(read_memory_,
+            [this, self](const error_code& ec, std::size_t) {
+              HandleRead(ec);
+            }));
+  }
+
+  void HandleRead(const error_code& ec) {
+    if (Stopped()) return;
+
+    if (ec) {
+      Stop();
+    } else if (!handoff_) {
+      HandleLine();
+      StartRead();
+    }
+  }
+#endif
+
+  void AwaitOutput() {
+    if (Stopped()) return;
+
+    Ptr self(this);
+    if (!HasOutput() && handoff_) {
+      CompleteHandOff();
+      return;
+    }
+
+    if (!HasOutput()) {
+      non_empty_output_queue_.expires_at(steady_timer::time_point::max());
+      non_empty_output_queue_.async_wait(MakeAllocHandler(output_wait_memory_,
+          [this, self](const error_code&) { AwaitOutput(); }));
+      return;
+    }
+
+    if (Pace() > Clock::duration(0)) {
+      pacing_timer_.async_wait(MakeAllocHandler(output_wait_memory_,
+          [this, self](const error_code&) { AwaitOutput(); }));
+    } else if (!history_.empty()) {
+      StartHistory();
+    } else {
+      StartWrite();
+    }
+  }
+
+  void StartHistory() {
+    output_deadline_.expires_after(std::chrono::seconds(30));
+
+    Ptr self(this);
+    socket_.async_wait(Socket::wait_write,
+        MakeAllocHandler(write_memory_,
+            [this, self](const error_code& ec) { HandleHistory(ec); }));
+  }
+
+  void HandleHistory(const error_code& ec) {
+    if (Stopped()) return;
+
+    if (ec || !SendHistory())
+      Stop();
+    else
+      AwaitOutput();
+  }
+
+#if defined(SESSION_IO_URING)
+  // Copies the front of the output queue into a registered slot, as many
+  // messages as fit and the rate limit allows, and sends them together.
+  // Without a free slot the front message is sent from the queue.
+  void StartWrite() {
+    BeginWrite();
+
+    write_slot_ = write_buffer_.size() <= Uring::kWriteSlotSize
+        ? uring_.AcquireSlot() : -1;
+    write_data_ = write_buffer_.data();
+    write_left_ = write_buffer_.size();
+    if (write_slot_ >= 0) {
+      char* slot = uring_.Slot(write_slot_);
+      std::memcpy(slot, write_data_, write_left_);
+      write_data_ = slot;
+      while (writing_ < output_queue_.size()) {
+        const std::string& data = output_queue_[writing_].data;
+        if (write_left_ + data.size() > Uring::kWriteSlotSize ||
+            limiter_.Wait(Clock::now()) > Clock::duration(0))
+          break;
+        limiter_.Take(data.size());
+        std::memcpy(slot + write_left_, data.data(), data.size());
+        write_left_ += data.size();
+        ++writing_;
+      }
+    }
+    StartSend();
+  }
+
+  // The send holds a reference to the session until it completes.
+  void StartSend() {
+    write_self_ = Ptr(this);
+    uring_.Send(socket_.native_handle(), write_data_, write_left_,
+                write_slot_, &write_op_);
+  }
+
+  void HandleSend(int result, uint32_t) {
+    Ptr self;
+    self.swap(write_self_);
+    if (result > 0) {
+      write_data_ += result;
+      write_left_ -= result;
+    }
+
+    if (!Stopped() && write_left_ &&
+        (result > 0 || result == -EAGAIN || result == -EINTR)) {
+      output_deadline_.expires_after(std::chrono::seconds(30));
+      StartSend();
+      return;
+    }
+
+    if (write_slot_ >= 0) uring_.ReleaseSlot(write_slot_);
+    write_slot_ = -1;
+    std::size_t written = writing_;
+    writing_ = 0;
+    if (Stopped()) return;
+
+    // Sending nothing means the peer has gone, as async_write reports.
+    if (result <= 0) {
+      Stop();
+      return;
+    }
+    while (written--)
+      EndWrite();
+    AwaitOutput();
+  }
+#else
+  void StartWrite() {
+    BeginWrite();
+
+    Ptr self(this);
+    asio::async_write(socket_, asio::buffer(write_buffer_),
+        MakeAllocHandler(write_memory_,
+            [this, self](const error_code& ec, std::size_t) {
+              HandleWrite(ec);
+            }));
+  }
+
+  void HandleWrite(const error_code& ec) {
+    writing_ = 0;
+    if (Stopped()) return;
+
+    if (!ec) {
+      EndWrite();
+      AwaitOutput();
+    } else {
+      Stop();
+    }
+  }
+#endif
+
+  void AwaitDeadline(steady_timer& deadline, HandlerMemory& memory) {
+    Ptr self(this);
+    deadline.async_wait(MakeAllocHandler(memory,
+        [this, self, &deadline, &memory](const error_code&) {
+          CheckDeadline(deadline, memory);
+        }));
+  }
+
+  // Deadlines are pushed back on every read and write, which cancels the
+  // pending wait; CheckDeadline then simply waits again.
+  void CheckDeadline(steady_timer& deadline, HandlerMemory& memory) {
+    if (Stopped()) return;
+
+    if (Expired(deadline))
+      Stop();
+    else
+      AwaitDeadline(deadline, memory);
+  }
+#endif
+
+  asio::io_context::executor_type executor_;
+  Channel& channel_;
+  Metrics& metrics_;
+  SessionLimits limits_;
+  RateLimiter limiter_;
+  Socket socket_;
+  asio::streambuf input_buffer_;
+  std::string read_line_;
+  steady_timer input_deadline_;
+  std::deque<JournalRange> history_;
+  boost::circular_buffer<Output> output_queue_;
+  std::vector<std::string> spare_;
+  steady_timer non_empty_output_queue_;
+  steady_timer output_deadline_;
+  steady_timer pacing_timer_;
+  steady_timer request_timer_;
+  SubscribeFunction subscribe_;  // Set while waiting for a request.
+  bool first_line_;  // Whether the next line read may be a request.
+  // In the steady state a delivery allocates nothing: each kind of
+  // outstanding operation has its own HandlerMemory, the output queue is a
+  // ring that only grows, and message buffers are recycled through spare_,
+  // which keeps as many as the queue has ever held.
+#if !defined(SESSION_COROUTINES)
+  HandlerMemory read_memory_;
+  HandlerMemory write_memory_;
+  HandlerMemory input_deadline_memory_;
+  HandlerMemory output_deadline_memory_;
+  HandlerMemory output_wait_memory_;
+#endif
+  Clock::time_point write_start_;
+  std::size_t writing_;  // Messages at the front of the queue being written.
+  std::string write_buffer_;  // The front message while it is written.
+  bool disconnecting_;
+  shared_ptr<Handoff> handoff_;  // Set while draining for a handoff.
+  uint64_t handoff_position_;
+  shared_ptr<SessionPool<Protocol> > pool_;  // Set while checked out.
+  int node_;  // The NUMA node of the session's thread, -1 if unknown.
+#if defined(SESSION_IO_URING)
+  Uring& uring_;
+  Completion<&StreamSession::HandleReceive> read_op_;
+  Completion<&StreamSession::HandleSend> write_op_;
+  Ptr read_self_;   // Set while the receive is outstanding.
+  Ptr write_self_;  // Set while a send is outstanding.
+  int write_slot_;
+  const char* write_data_;
+  std::size_t write_left_;
+  bool release_on_read_end_;  // Set when a handoff waits on the receive.
+#endif
+};
+
+// A freelist of sessions for one acceptor, so that accepting a connection
+// reuses a session (its socket, buffers and timers) rather than allocating
+// one. Sessions may be released from any thread.
+//
+// Sessions are constructed on the acceptor's thread, by Preallocate() or
+// Acquire(), so that their memory is first touched on that thread's node.
+//
+// A checked out session holds a reference to its pool, keeping the pool
+// alive until every session has come back even if the server has gone.
+template <typename Protocol>
+class SessionPool
+    : public boost::enable_shared_from_this<SessionPool<Protocol> > {
+ public:
+  typedef StreamSession<Protocol> Session;
+
+  SessionPool(const asio::io_context::executor_type& executor,
+              Channel& channel)
+    : executor_(executor),
+      channel_(channel),
+      node_(-1) {}
+
+  ~SessionPool() {
+    for (std::size_t i = 0; i < free_.size(); ++i)
+      delete free_[i];
+  }
+
+  // Adds n sessions to the freelist.
+  void Preallocate(std::size_t n) {
+    std::vector<Session*> sessions;
+    sessions.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+      sessions.push_back(new Session(executor_, channel_));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.insert(free_.end(), sessions.begin(), sessions.end());
+  }
+
+  // The NUMA node of the acceptor's thread, given to sessions as they are
+  // checked out. Set before the acceptor runs.
+  void set_node(int node) {
+    node_ = node;
+  }
+
+  typename Session::Ptr Acquire() {
+    Session* session = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_.empty()) {
+        session = free_.back();
+        free_.pop_back();
+      }
+    }
+
+    if (!session) {
+      session = new Session(executor_, channel_);
+      channel_.metrics().Local().session_allocs.Add(1);
+    }
+
+    session->pool_ = this->shared_from_this();
+    session->node_ = node_;
+    return typename Session::Ptr(session);
+  }
+
+  void Release(Session* session) {
+    session->Reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(session);
+  }
+
+ private:
+  asio::io_context::executor_type executor_;
+  Channel& channel_;
+  int node_;
+  std::mutex mutex_;
+  std::vector<Session*> free_;
+};
+
+template <typename Protocol>
+void StreamSession<Protocol>::Recycle() {
+  // Dropping the pool reference may destroy the pool, and this session with
+  // its freelist, so hold it until the session is back in the list.
+  shared_ptr<SessionPool<Protocol> > pool;
+  pool.swap(pool_);
+  if (pool)
+    pool->Release(this);
+  else
+    delete this;
+}
+
+typedef StreamSession<tcp> TcpSession;
+typedef TcpSession::Ptr TcpSessionPtr;
+typedef StreamSession<stream_protocol> UnixSession;
+
+// Fans messages out to a multicast group (or broadcast address) so that one
+// send serves every UDP listener. Messages delivered during one turn of the
+// io_context are packed into MTU-sized, sequence-numbered frames (see
+// udp_protocol.h) and the frames are sent together with sendmmsg() from a
+// posted flush.
+//
+// The most recent frames are kept in a bounded replay cache. Receivers that
+// detect a sequence gap send a NACK frame back to the broadcaster's socket,
+// and the missing frames still in the cache are retransmitted to that
+// receiver alone over unicast. A NACK's sender address can be forged, so
+// each one is answered with at most kMaxNackFrames frames and each sender's
+// retransmissions are rate limited, keeping the broadcaster from being used
+// to amplify traffic at a victim. A receiver only sees a gap once a later
+// frame arrives, so after kHeartbeatMs with nothing to send the broadcaster
+// sends a heartbeat frame carrying the next sequence, letting receivers NACK
+// the tail of a burst while it is still cached.
+class UdpBroadcaster : public Subscriber {
+ public:
+  UdpBroadcaster(const asio::io_context::executor_type& executor,
+                 const udp::endpoint& group_endpoint,
+                 Metrics& metrics,
+                 std::size_t max_datagram = 1472,
+                 std::size_t replay_frames = 4096)
+    : executor_(executor),
+      socket_(executor, udp::endpoint(group_endpoint.protocol(), 0)),
+      group_endpoint_(group_endpoint),
+      metrics_(metrics),
+      max_datagram_(max_datagram),
+      replay_frames_(replay_frames),
+      next_sequence_(1),
+      flush_pending_(false),
+      heartbeat_timer_(executor),
+      sent_since_heartbeat_(false) {
+    if (group_endpoint.address().is_multicast()) {
+      socket_.set_option(asio::ip::multicast::hops(1));
+      socket_.set_option(asio::ip::multicast::enable_loopback(true));
+    } else {
+      socket_.set_option(asio::socket_base::broadcast(true));
+    }
+
+    StartReceive();
+    StartHeartbeat();
+  }
+
+  void Deliver(const std::string& msg) {
+    if (!frames_.empty() &&
+        frames_.back().size() + msg.size() + 1 <= max_datagram_ &&
+        counts_.back() < 0xffff) {
+      frames_.back().append(msg).push_back('\n');
+      ++counts_.back();
+    } else {
+      StartFrame();
+      frames_.back().append(msg).push_back('\n');
+      counts_.back() = 1;
+    }
+
+    if (!flush_pending_) {
+      flush_pending_ = true;
+      asio::post(executor_, bind(&UdpBroadcaster::Flush, this));
+    }
+  }
+
+ private:
+  enum { kMaxBatch = 64, kHeartbeatMs = 200 };
+
+  // Retransmission limits, in frames: per NACK, and per sender per second
+  // with a burst of kNackBurst. At most kMaxNackSenders senders are tracked;
+  // beyond that the buckets start afresh.
+  enum {
+    kMaxNackFrames = 64,
+    kNackFramesPerSec = 2000,
+    kNackBurst = 256,
+    kMaxNackSenders = 4096
+  };
+
+  void StartFrame() {
+    frames_.push_back(std::string(kFrameHeaderSize, '\0'));
+    counts_.push_back(0);
+  }
+
+  void Flush() {
+    flush_pending_ = false;
+
+    std::vector<const std::string*> frames(frames_.size());
+    for (std::size_t i = 0; i < frames_.size(); ++i) {
+      FrameHeader header = { kDataFrame, counts_[i], next_sequence_++ };
+      EncodeFrameHeader(header, &frames_[i][0]);
+      frames[i] = &frames_[i];
+    }
+    SendAll(frames, group_endpoint_);
+    sent_since_heartbeat_ = true;
+
+    // Keep the frames for retransmission, dropping the oldest.
+    for (std::size_t i = 0; i < frames_.size(); ++i) {
+      replay_.push_back(std::string());
+      replay_.back().swap(frames_[i]);
+    }
+    while (replay_.size() > replay_frames_)
+      replay_.pop_front();
+
+    frames_.clear();
+    counts_.clear();
+  }
+
+  void StartHeartbeat() {
+    heartbeat_timer_.expires_after(std::chrono::milliseconds(kHeartbeatMs));
+    heartbeat_timer_.async_wait(
+        bind(&UdpBroadcaster::HandleHeartbeat, this, _1));
+  }
+
+  void HandleHeartbeat(const error_code& ec) {
+    if (ec) return;
+
+    if (!sent_since_heartbeat_) {
+      std::string frame(kFrameHeaderSize, '\0');
+      FrameHeader header = { kHeartbeatFrame, 0, next_sequence_ };
+      EncodeFrameHeader(header, &frame[0]);
+      std::vector<const std::string*> frames(1, &frame);
+      SendAll(frames, group_endpoint_);
+    }
+    sent_since_heartbeat_ = false;
+    StartHeartbeat();
+  }
+
+  void StartReceive() {
+    socket_.async_receive_from(asio::buffer(nack_buffer_), nack_sender_,
+        bind(&UdpBroadcaster::HandleReceive, this, _1, _2));
+  }
+
+  void HandleReceive(const error_code& ec, std::size_t length) {
+    if (ec == asio::error::operation_aborted) return;
+
+    // Errors here are typically ICMP unreachables for earlier unicast
+    // retransmissions and do not affect the socket.
+    FrameHeader header;
+    if (!ec && DecodeFrameHeader(nack_buffer_, length, header) &&
+        header.type == kNackFrame) {
+      Retransmit(header.sequence, header.count, nack_sender_);
+    }
+
+    StartReceive();
+  }
+
+  void Retransmit(uint64_t first, std::size_t count,
+                  const udp::endpoint& receiver) {
+    ServerStats& stats = metrics_.Local();
+    stats.udp_nacks_received.Add(1);
+
+    // Only the part of [first, first + count) still in the cache is resent;
+    // frames never sent are ignored and those already evicted are misses.
+    uint64_t first_cached = next_sequence_ - replay_.size();
+    uint64_t begin = std::max(first, first_cached);
+    uint64_t end = first < next_sequence_
+        ? first + std::min<uint64_t>(count, next_sequence_ - first) : first;
+    std::size_t cached = begin < end ? end - begin : 0;
+    if (first < first_cached)
+      stats.udp_replay_misses.Add(std::min(end, first_cached) - first);
+    std::size_t n = std::min<std::size_t>(cached, kMaxNackFrames);
+    if (!n) return;
+
+    Clock::time_point now = Clock::now();
+    TokenBucket& bucket = NackBucket(receiver);
+    if (bucket.Wait(now) != Clock::duration(0)) {
+      stats.udp_nacks_limited.Add(1);
+      return;
+    }
+    bucket.Take(n);
+
+    std::vector<const std::string*> frames;
+    for (uint64_t seq = begin; seq < begin + n; ++seq)
+      frames.push_back(&replay_[seq - first_cached]);
+    stats.udp_retransmits.Add(SendAll(frames, receiver));
+  }
+
+  TokenBucket& NackBucket(const udp::endpoint& sender) {
+    auto i = nack_buckets_.find(sender);
+    if (i != nack_buckets_.end()) return i->second;
+
+    if (nack_buckets_.size() >= kMaxNackSenders) nack_buckets_.clear();
+    return nack_buckets_.insert(std::make_pair(
+        sender, TokenBucket(kNackFramesPerSec, kNackBurst))).first->second;
+  }
+
+  // Sends the frames to the endpoint in sendmmsg() sized batches, returning
+  // how many were sent.
+  std::size_t SendAll(const std::vector<const std::string*>& frames,
+                      const udp::endpoint& endpoint) {
+    ServerStats& stats = metrics_.Local();
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < frames.size(); i += kMaxBatch) {
+      std::size_t n = std::min<std::size_t>(kMaxBatch, frames.size() - i);
+      std::size_t sent = Send(&frames[i], n, endpoint);
+      stats.udp_send_calls.Add(1);
+      stats.udp_datagrams_sent.Add(sent);
+      for (std::size_t j = 0; j < sent; ++j)
+        stats.udp_bytes_sent.Add(frames[i + j]->size());
+      total += sent;
+    }
+    return total;
+  }
+
+  // Sends n frames to the endpoint, returning how many were sent. Frames that
+  // cannot be sent are dropped, as with any other lost datagram.
+  std::size_t Send(const std::string* const* frames, std::size_t n,
+                   const udp::endpoint& endpoint) {
+#if defined(__linux__)
+    mmsghdr headers[kMaxBatch];
+    iovec iovecs[kMaxBatch];
+    std::memset(headers, 0, sizeof(headers));
+    for (std::size_t i = 0; i < n; ++i) {
+      iovecs[i].iov_base = const_cast<char*>(frames[i]->data());
+      iovecs[i].iov_len = frames[i]->size();
+      headers[i].msg_hdr.msg_name = const_cast<void*>(
+          static_cast<const void*>(endpoint.data()));
+      headers[i].msg_hdr.msg_namelen = endpoint.size();
+      headers[i].msg_hdr.msg_iov = &iovecs[i];
+      headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = ::sendmmsg(socket_.native_handle(), headers, n, 0);
+    return sent < 0 ? 0 : std::size_t(sent);
+#else
+    std::size_t sent = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      error_code ec;
+      socket_.send_to(asio::buffer(*frames[i]), endpoint, 0, ec);
+      if (!ec) ++sent;
+    }
+    return sent;
+#endif
+  }
+
+  asio::io_context::executor_type executor_;
+  udp::socket socket_;
+  udp::endpoint group_endpoint_;
+  Metrics& metrics_;
+  std::size_t max_datagram_;
+  std::size_t replay_frames_;
+  uint64_t next_sequence_;
+  bool flush_pending_;
+  steady_timer heartbeat_timer_;
+  bool sent_since_heartbeat_;  // Whether data went out since the last tick.
+  std::vector<std::string> frames_;
+  std::vector<uint16_t> counts_;
+  std::deque<std::string> replay_;
+  char nack_buffer_[kFrameHeaderSize];
+  udp::endpoint nack_sender_;
+  std::map<udp::endpoint, TokenBucket> nack_buckets_;
+};
+
+// A subscriber in the same process, for applications that embed the server.
+// The channel copies each message straight into a slot of a lock-free queue
+// (see spsc_queue.h) that one consumer thread polls: no framing, sockets or
+// system calls on either side, and no allocation once the slots have grown.
+// Join it with Server::Join() to receive live messages from then on.
+//
+// The channel never waits for the consumer, so one that falls a whole queue
+// behind loses the newest messages until it catches up.
+class InProcessSubscriber : public Subscriber {
+ public:
+  InProcessSubscriber(Metrics& metrics, std::size_t capacity = 4096)
+    : metrics_(metrics),
+      queue_(capacity),
+      drops_(0) {}
+
+  void Deliver(const std::string& msg) {
+    std::string* slot = queue_.Back();
+    if (!slot) {
+      drops_.fetch_add(1, std::memory_order_relaxed);
+      metrics_.Local().inproc_drops.Add(1);
+      return;
+    }
+
+    slot->assign(msg);
+    queue_.Push();
+    metrics_.Local().inproc_messages.Add(1);
+  }
+
+  // Consumer: swaps the next message into msg, returning false if there is
+  // none yet. msg's old buffer goes back into the queue for reuse.
+  bool Poll(std::string& msg) {
+    std::string* slot = queue_.Front();
+    if (!slot) return false;
+    msg.swap(*slot);
+    queue_.Pop();
+    return true;
+  }
+
+  // Messages lost to a full queue.
+  uint64_t drops() const {
+    return drops_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  Metrics& metrics_;
+  SpscQueue<std::string> queue_;
+  std::atomic<uint64_t> drops_;
+};
+
+// How the server listens. With reuse_port each io_context thread may open its
+// own acceptor on the same port and the kernel spreads incoming connections
+// across them. Each acceptor keeps accepts operations outstanding so that a
+// burst of connections is not accepted strictly one at a time, and draws its
+// sessions from a pool holding pool_size pre-constructed sessions to start.
+// Listening sockets inherited from a predecessor are adopted in place of
+// opening new ones.
+//
+// With route_to_node, a TCP connection accepted by a thread on one NUMA
+// node whose packets are handled on another (by SO_INCOMING_CPU, or else on
+// nic_node) is handed to an acceptor placed on that node, if there is one
+// (see Server::Place). Open every acceptor before running the io_contexts.
+//
+// A new session is subscribed from the start of the history as soon as it
+// is accepted. With start_requests, it may instead ask where to start with a
+// first line "from <sequence>" (see StreamSession::AwaitRequest), which is
+// then not published; sessions that send nothing wait up to kRequestWaitMs
+// before they are subscribed.
+struct ListenOptions {
+  ListenOptions()
+    : backlog(asio::socket_base::max_listen_connections),
+      accepts(1),
+      reuse_port(false),
+      pool_size(0),
+      route_to_node(false),
+      nic_node(-1),
+      start_requests(false) {}
+
+  int backlog;
+  int accepts;
+  bool reuse_port;
+  int pool_size;
+  std::vector<int> inherited;
+  bool route_to_node;
+  int nic_node;  // The node of the subscribers' NIC, -1 if unknown.
+  bool start_requests;
+};
+
+#if defined(SO_REUSEPORT)
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>
+    ReusePort;
+#endif
+
+// The channel, cache and publishing run on the io_context the server is
+// constructed with; sessions run on the executor of the acceptor that
+// accepted them, or of the one they were routed to.
+class Server {
+ public:
+  Server(asio::io_context& io_context,
+         const tcp::endpoint& listen_endpoint,
+         const ListenOptions& options = ListenOptions())
+    : executor_(io_context.get_executor()),
+      listen_endpoint_(listen_endpoint),
+      options_(options),
+      channel_(executor_, metrics_),
+      next_sequence_(1),
+      journal_(0),
+      shm_ring_(0),
+      handing_off_(false),
+      adopted_(0),
+      cpu_nodes_(CpuNodes()),
+      routed_(0),
+      snapshot_busy_(false) {
+    Listen(io_context);
+  }
+
+  ~Server() {
+    if (snapshot_thread_.joinable()) snapshot_thread_.join();
+  }
+
+  // Opens another acceptor on the listening port, or adopts an inherited
+  // one, run by io_context. Needs reuse_port unless inherited.
+  void Listen(asio::io_context& io_context) {
+    listeners_.emplace_back(new TcpListener(io_context.get_executor(),
+                                            channel_));
+    tcp::acceptor& acceptor = listeners_.back()->acceptor;
+
+    int fd = TakeInherited(AF_INET, std::string());
+    if (fd >= 0) {
+      acceptor.assign(ProtocolOf<tcp>(fd), fd);
+    } else {
+      acceptor.open(listen_endpoint_.protocol());
+      acceptor.set_option(tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+      if (options_.reuse_port)
+        acceptor.set_option(ReusePort(true));
+#endif
+      acceptor.bind(listen_endpoint_);
+      acceptor.listen(options_.backlog);
+    }
+
+    // Later acceptors share whichever port the first was given.
+    listen_endpoint_ = acceptor.local_endpoint();
+
+    Place(*listeners_.back());
+    asio::post(acceptor.get_executor(), bind(&Server::StartListener<tcp>,
+                                             this,
+                                             boost::ref(*listeners_.back())));
+  }
+
+  // Also accepts subscribers on a Unix domain socket at path, run by
+  // io_context, into the same channel. Any file at path is replaced, unless
+  // a predecessor handed over a listener bound there.
+  void ListenLocal(asio::io_context& io_context, const std::string& path) {
+    local_listeners_.emplace_back(new UnixListener(
+        io_context.get_executor(), channel_));
+    stream_protocol::acceptor& acceptor = local_listeners_.back()->acceptor;
+
+    int fd = TakeInherited(AF_UNIX, path);
+    if (fd >= 0) {
+      acceptor.assign(stream_protocol(), fd);
+    } else {
+      ::unlink(path.c_str());
+      stream_protocol::endpoint endpoint(path);
+      acceptor.open(endpoint.protocol());
+      acceptor.bind(endpoint);
+      acceptor.listen(options_.backlog);
+    }
+
+    Place(*local_listeners_.back());
+    asio::post(acceptor.get_executor(),
+               bind(&Server::StartListener<stream_protocol>, this,
+                    boost::ref(*local_listeners_.back())));
+  }
+
+  // Records that io_context is run by a thread pinned to cpus. Its sessions
+  // count as on the first CPU's node, and with reuse_port its TCP acceptor
+  // asks the kernel for the connections whose packets that CPU handles.
+  // Call before running io_context, and before Listen() for it unless it is
+  // the server's own.
+  void Place(asio::io_context& io_context, const CpuSet& cpus) {
+    if (cpus.empty()) return;
+    Placement& placement = placements_[&io_context];
+    placement.cpu = cpus.front();
+    placement.node = NodeOf(placement.cpu);
+    if (&executor_.context() == &io_context)
+      channel_.set_node(placement.node);
+
+    for (const auto& listener : listeners_)
+      Place(*listener);
+    for (const auto& listener : local_listeners_)
+      Place(*listener);
+  }
+
+  // Adopts the inherited listening sockets that Listen() and ListenLocal()
+  // have not, e.g. from a predecessor with more I/O threads, run by
+  // io_context.
+  void AdoptListeners(asio::io_context& io_context) {
+    while (!options_.inherited.empty()) {
+      std::string path;
+      if (SocketFamily(options_.inherited.front(), &path) == AF_UNIX)
+        ListenLocal(io_context, path);
+      else
+        Listen(io_context);
+    }
+  }
+
+  // In timestamping mode live deliveries carry the publish time, but the
+  // history keeps the bare message so catch-up replays are not mistaken for
+  // slow deliveries.
+  //
+  // Nothing is published once a handoff has begun; the successor carries on.
+  // A message the journal cannot store is not published either (the journal
+  // counts the error): it would have no sequence of its own, so the next
+  // message would reuse it and replays would never include it.
+  void PublishMessage(const std::string& msg) {
+    if (handoff_) return;
+
+    Clock::time_point start = Clock::now();
+    uint64_t sequence = NextSequence();
+    if (journal_) {
+      if (!journal_->Append(msg)) return;
+    } else {
+      cache_.Append(msg);
+      ++next_sequence_;
+    }
+    if (channel_.timestamps()) {
+      Stamp(msg, stamped_);
+      Fanout(sequence, stamped_);
+    } else {
+      Fanout(sequence, msg);
+    }
+
+    ServerStats& stats = metrics_.Local();
+    stats.messages_published.Add(1);
+    stats.fanout_ns.Record(ElapsedNs(start));
+  }
+
+  // Publishes msg, handed over from another thread at queued, timing the
+  // handover.
+  void PublishQueued(const std::string& msg, Clock::time_point queued) {
+    metrics_.Local().ingress_ns.Record(ElapsedNs(queued));
+    PublishMessage(msg);
+  }
+
+  Metrics& metrics() {
+    return metrics_;
+  }
+
+  const Metrics& metrics() const {
+    return metrics_;
+  }
+
+  // Adds a subscriber that is not a session, e.g. a UdpBroadcaster or an
+  // InProcessSubscriber.
+  void Join(SubscriberPtr subscriber) {
+    channel_.Join(subscriber);
+  }
+
+  void Leave(SubscriberPtr subscriber) {
+    channel_.Leave(subscriber);
+  }
+
+  // Replays the history to a newly connected subscriber, from sequence from.
+  void CatchUp(Subscriber& subscriber, uint64_t from = 1) {
+    if (journal_) {
+      journal_->Replay(from, [&](const char* data, std::size_t length) {
+        replay_line_.assign(data, length);
+        subscriber.Deliver(replay_line_);
+      });
+      return;
+    }
+
+    if (snapshot_) {
+      // The snapshot's history ends just before its next sequence.
+      uint64_t sequence =
+          snapshot_->next_sequence() - snapshot_->history_count();
+      snapshot_->Replay([&](const char* data, std::size_t length) {
+        if (sequence++ < from) return;
+        replay_line_.assign(data, length);
+        subscriber.Deliver(replay_line_);
+      });
+    }
+    uint64_t first = next_sequence_ - cache_.count();
+    cache_.Replay(from > first ? from - first : 0,
+                  [&](const char* data, std::size_t length) {
+      replay_line_.assign(data, length);
+      subscriber.Deliver(replay_line_);
+    });
+  }
+
+  // Also publishes each message, with its sequence, to a shared memory ring
+  // for readers on this host. The ring must outlive the server.
+  void set_shm_ring(ShmRing* ring) {
+    shm_ring_ = ring;
+  }
+
+  // Keeps the history in an on-disk journal, which must outlive the server,
+  // instead of in memory. Set before running the io_context.
+  void set_journal(Journal* journal) {
+    journal_ = journal;
+  }
+
+  // Carries on from a snapshot of an earlier run: its history (if there is
+  // no journal) comes before anything published now. Call before running
+  // the io_context, so that no session catches up without it.
+  void Restore(const shared_ptr<const Snapshot>& snapshot) {
+    snapshot_ = snapshot;
+    next_sequence_ = snapshot->next_sequence();
+  }
+
+  // Writes the journal's segment states, or else the whole history, to a
+  // snapshot at path, after any snapshot still being written in the
+  // background. Runs on the channel thread.
+  void WriteSnapshot(const std::string& path) {
+    if (snapshot_thread_.joinable()) snapshot_thread_.join();
+    SnapshotState state;
+    GetSnapshotState(state);
+    WriteSnapshot(path, state);
+  }
+
+  // As WriteSnapshot(), but the file is written and synced on a background
+  // thread while publishing carries on; only gathering the state runs here,
+  // on the channel thread. Returns false, writing nothing, if the last
+  // snapshot has not been written yet.
+  bool StartSnapshot(const std::string& path) {
+    if (snapshot_busy_) return false;
+    if (snapshot_thread_.joinable()) snapshot_thread_.join();
+
+    shared_ptr<SnapshotState> state(new SnapshotState);
+    GetSnapshotState(*state);
+    snapshot_busy_ = true;
+    snapshot_thread_ = std::thread([this, path, state]() {
+      try {
+        WriteSnapshot(path, *state);
+      }
+      catch (std::exception& e) {
+        std::cerr << "Snapshot: " << e.what() << "\n";
+      }
+      snapshot_busy_ = false;
+    });
+    return true;
+  }
+
+  // Hands the listening sockets and every TCP session to a successor
+  // process: stops accepting and publishing, lets each session drain its
+  // output, then calls done on this thread with what the successor needs.
+  // Sessions still draining after timeout are closed. Runs on the channel
+  // thread.
+  void HandOff(const Handoff::Callback& done, Clock::duration timeout) {
+    handing_off_ = true;
+    handoff_.reset(new Handoff(executor_, done));
+    HandOffListeners(listeners_);
+    HandOffListeners(local_listeners_);
+
+    channel_.HandOff(handoff_, NextSequence());
+    handoff_->Start(timeout);
+  }
+
+  // Takes back what a handoff gathered when it could not be sent to the
+  // successor: adopts the drained sessions again, each caught up from where
+  // it stopped, and resumes accepting and publishing. Runs on the channel
+  // thread.
+  void ResumeAfterHandOff(const HandoffState& state) {
+    metrics_.Local().handoffs_failed.Add(1);
+    handoff_.reset();
+    handing_off_ = false;
+    for (const HandoffSession& session : state.sessions)
+      AdoptSession(session.fd, session.position, session.input);
+    ResumeListeners(listeners_);
+    ResumeListeners(local_listeners_);
+  }
+
+  // Takes over a session handed off by a predecessor: fd is its socket,
+  // position the sequence of the first message it has not been sent and
+  // input what it had read but not handled. Call after AdoptListeners(),
+  // before running the io_contexts.
+  void AdoptSession(int fd, uint64_t position, const std::string& input) {
+    if (SocketFamily(fd) == AF_UNIX)
+      AdoptSession(local_listeners_, fd, position, input);
+    else
+      AdoptSession(listeners_, fd, position, input);
+  }
+
+  tcp::endpoint local_endpoint() const {
+    return listen_endpoint_;
+  }
+
+  void set_timestamps(bool timestamps) {
+    channel_.set_timestamps(timestamps);
+  }
+
+  const SessionLimits& session_limits() const {
+    return channel_.session_limits();
+  }
+
+  void set_session_limits(const SessionLimits& limits) {
+    channel_.set_session_limits(limits);
+  }
+
+  void set_topic_limits(const TopicLimits& limits) {
+    channel_.set_topic_limits(limits);
+  }
+
+ private:
+  template <typename Protocol>
+  struct Listener {
+    Listener(const asio::io_context::executor_type& executor,
+             Channel& channel)
+      : context(&executor.context()),
+        acceptor(executor),
+        pool(new SessionPool<Protocol>(executor, channel)),
+        node(-1) {}
+
+    const asio::io_context* context;
+    typename Protocol::acceptor acceptor;
+    shared_ptr<SessionPool<Protocol> > pool;
+    int node;  // The NUMA node of the acceptor's thread, -1 if unknown.
+  };
+
+  struct Placement {
+    int cpu;
+    int node;
+  };
+
+  typedef Listener<tcp> TcpListener;
+  typedef Listener<stream_protocol> UnixListener;
+
+  // Fills the listener's pool and starts accepting, on the listener's own
+  // thread so that its sessions are allocated on that thread's node.
+  template <typename Protocol>
+  void StartListener(Listener<Protocol>& listener) {
+    listener.pool->Preallocate(options_.pool_size);
+    for (int i = 0; i < options_.accepts; ++i)
+      StartAccept(listener);
+  }
+
+  template <typename Protocol>
+  void Place(Listener<Protocol>& listener) {
+    std::map<const asio::io_context*, Placement>::const_iterator i =
+        placements_.find(listener.context);
+    if (i == placements_.end()) return;
+    listener.node = i->second.node;
+    listener.pool->set_node(i->second.node);
+    if (options_.reuse_port)
+      SetIncomingCpu(listener.acceptor.native_handle(), i->second.cpu);
+  }
+
+  template <typename Protocol>
+  void StartAccept(Listener<Protocol>& listener) {
+    typename StreamSession<Protocol>::Ptr new_session(
+        listener.pool->Acquire());
+
+    listener.acceptor.async_accept(new_session->socket(),
+        bind(&Server::HandleAccept<Protocol>, this, boost::ref(listener),
+             new_session, _1));
+  }
+
+  template <typename Protocol>
+  void HandleAccept(Listener<Protocol>& listener,
+                    typename StreamSession<Protocol>::Ptr session,
+                    const error_code& ec) {
+    if (!ec) {
+      metrics_.Local().sessions_accepted.Add(1);
+      if (!Route(listener, session))
+        StartSession<Protocol>(session);
+    }
+
+    if (!handing_off_) StartAccept(listener);
+  }
+
+  // Hands a TCP session accepted on one node, whose packets are handled on
+  // another, to an acceptor on that node (see ListenOptions), returning
+  // true. Sessions that stay on the wrong node are counted.
+  bool Route(TcpListener& listener, const TcpSessionPtr& session) {
+    if (listener.node < 0) return false;
+    int node = NodeOf(IncomingCpu(session->socket().native_handle()));
+    if (node < 0) node = options_.nic_node;
+    if (node < 0 || node == listener.node) return false;
+
+    TcpListener* target = 0;
+    if (options_.route_to_node) {
+      std::size_t n = listeners_.size();
+      std::size_t first = routed_.fetch_add(1, std::memory_order_relaxed);
+      for (std::size_t i = 0; i < n && !target; ++i) {
+        if (listeners_[(first + i) % n]->node == node)
+          target = listeners_[(first + i) % n].get();
+      }
+    }
+
+    error_code ec;
+    int fd = target ? session->socket().release(ec) : -1;
+    if (fd < 0) {
+      metrics_.Local().cross_node_sessions.Add(1);
+      return false;
+    }
+    metrics_.Local().sessions_routed.Add(1);
+    asio::post(target->acceptor.get_executor(),
+               bind(&Server::AdoptRouted, this, boost::ref(*target), fd));
+    return true;
+  }
+
+  // Unix domain sockets have no NIC to be near.
+  template <typename Protocol>
+  bool Route(Listener<Protocol>&,
+             const typename StreamSession<Protocol>::Ptr&) {
+    return false;
+  }
+
+  // Runs a session routed from another node's acceptor, on the thread of
+  // the listener it was routed to.
+  void AdoptRouted(TcpListener& listener, int fd) {
+    TcpSessionPtr session(listener.pool->Acquire());
+    session->Adopt(fd, std::string());
+    StartSession<tcp>(session);
+  }
+
+  int NodeOf(int cpu) const {
+    return cpu >= 0 && std::size_t(cpu) < cpu_nodes_.size()
+        ? cpu_nodes_[cpu] : -1;
+  }
+
+  // Removes and returns an inherited listening socket of the family (AF_UNIX
+  // bound to path, or else any TCP one), or -1 if there is none.
+  int TakeInherited(int family, const std::string& path) {
+    std::vector<int>& inherited = options_.inherited;
+    for (std::size_t i = 0; i < inherited.size(); ++i) {
+      std::string bound;
+      int fd_family = SocketFamily(inherited[i], &bound);
+      if (family == AF_UNIX ? fd_family == AF_UNIX && bound == path
+                            : fd_family != AF_UNIX) {
+        int fd = inherited[i];
+        inherited.erase(inherited.begin() + i);
+        return fd;
+      }
+    }
+    return -1;
+  }
+
+  // Gives the listeners' sockets to the handoff and stops them accepting.
+  template <typename Protocol>
+  void HandOffListeners(
+      std::vector<std::unique_ptr<Listener<Protocol> > >& listeners) {
+    for (const auto& listener : listeners) {
+      Listener<Protocol>* l = listener.get();
+      handoff_->AddListener(l->acceptor.native_handle());
+      asio::post(l->acceptor.get_executor(), [l]() {
+        error_code ignored_ec;
+        l->acceptor.cancel(ignored_ec);
+      });
+    }
+  }
+
+  // Has the listeners accept again after a handoff failed, with as many
+  // accepts outstanding as StartListener() arms.
+  template <typename Protocol>
+  void ResumeListeners(
+      std::vector<std::unique_ptr<Listener<Protocol> > >& listeners) {
+    for (const auto& listener : listeners) {
+      Listener<Protocol>* l = listener.get();
+      asio::post(l->acceptor.get_executor(), [this, l]() {
+        for (int i = 0; i < options_.accepts; ++i)
+          StartAccept(*l);
+      });
+    }
+  }
+
+  // The session starts on its listener's thread, like an accepted one.
+  template <typename Protocol>
+  void AdoptSession(
+      std::vector<std::unique_ptr<Listener<Protocol> > >& listeners,
+      int fd, uint64_t position, const std::string& input) {
+    // A successor without a listener for the protocol has nowhere to run
+    // the session.
+    if (listeners.empty()) {
+      ::close(fd);
+      metrics_.Local().sessions_closed.Add(1);
+      return;
+    }
+
+    Listener<Protocol>* l = listeners[adopted_++ % listeners.size()].get();
+    asio::post(l->acceptor.get_executor(),
+               [this, l, fd, position, input]() {
+      typename StreamSession<Protocol>::Ptr session(l->pool->Acquire());
+      session->Adopt(fd, input);
+      metrics_.Local().sessions_adopted.Add(1);
+      session->Start();
+      asio::dispatch(executor_, bind(&Server::Subscribe<Protocol>, this,
+                                     session, position));
+    });
+  }
+
+  // Starts a new session and subscribes it from the start, or with
+  // start_requests from where it asks to start.
+  template <typename Protocol>
+  void StartSession(const typename StreamSession<Protocol>::Ptr& session) {
+    if (!options_.start_requests) {
+      session->Start();
+      asio::dispatch(executor_, bind(&Server::Subscribe<Protocol>, this,
+                                     session, uint64_t(1)));
+      return;
+    }
+
+    session->AwaitRequest(
+        [this](const typename StreamSession<Protocol>::Ptr& session,
+               uint64_t from) {
+      asio::dispatch(executor_, bind(&Server::Subscribe<Protocol>, this,
+                                     session, from));
+    });
+    session->Start();
+  }
+
+  // Catches a session up from sequence from and joins it to the channel, on
+  // the channel thread so that no message is missed or repeated in between.
+  // During a handoff it goes straight to the successor, which catches it up.
+  template <typename Protocol>
+  void Subscribe(typename StreamSession<Protocol>::Ptr session,
+                 uint64_t from) {
+    if (handoff_) {
+      session->HandOff(handoff_, from);
+      return;
+    }
+
+    if (journal_) {
+      history_ranges_.clear();
+      journal_->Ranges(from, history_ranges_);
+      session->CatchUp(history_ranges_);
+    } else {
+      CatchUp(*session, from);
+    }
+    channel_.Join(session);
+  }
+
+  // Writes a live message to the shared memory ring, if there is one, and
+  // delivers it to the channel. Ring readers are not subject to the topic's
+  // rate limit: they cost the server nothing per reader.
+  void Fanout(uint64_t sequence, const std::string& msg) {
+    if (shm_ring_) {
+      ServerStats& stats = metrics_.Local();
+      if (shm_ring_->Publish(sequence, msg)) {
+        stats.shm_messages.Add(1);
+        stats.shm_bytes.Add(msg.size());
+      } else {
+        stats.shm_oversize.Add(1);
+      }
+    }
+    channel_.Deliver(msg);
+  }
+
+  uint64_t NextSequence() const {
+    return journal_ ? journal_->next_sequence() : next_sequence_;
+  }
+
+  // What a snapshot records. The history is referred to rather than
+  // copied: runs point into the restored snapshot's mapping, held here, and
+  // into the cache, whose messages never move or change once appended.
+  struct SnapshotRun {
+    const char* data;
+    std::size_t length;
+    uint64_t count;
+  };
+
+  struct SnapshotState {
+    uint64_t next_sequence;
+    std::vector<JournalSegmentState> segments;
+    shared_ptr<const Snapshot> restored;
+    std::vector<SnapshotRun> history;
+  };
+
+  void GetSnapshotState(SnapshotState& state) const {
+    state.next_sequence = NextSequence();
+    if (journal_) {
+      journal_->GetStates(state.segments);
+      return;
+    }
+
+    state.restored = snapshot_;
+    if (snapshot_) {
+      SnapshotRun run = { snapshot_->history(), snapshot_->history_bytes(),
+                          snapshot_->history_count() };
+      state.history.push_back(run);
+    }
+    cache_.ForEachRun([&](const char* data, std::size_t length,
+                          uint64_t count) {
+      SnapshotRun run = { data, length, count };
+      state.history.push_back(run);
+    });
+  }
+
+  static void WriteSnapshot(const std::string& path,
+                            const SnapshotState& state) {
+    SnapshotWriter writer(path);
+    for (const JournalSegmentState& segment : state.segments)
+      writer.AddSegment(segment);
+    for (const SnapshotRun& run : state.history)
+      writer.AddHistory(run.data, run.length, run.count);
+    writer.Commit(state.next_sequence);
+  }
+
+  asio::io_context::executor_type executor_;
+  tcp::endpoint listen_endpoint_;
+  ListenOptions options_;
+  std::vector<std::unique_ptr<TcpListener> > listeners_;
+  std::vector<std::unique_ptr<UnixListener> > local_listeners_;
+  Metrics metrics_;
+  Channel channel_;
+
+  History cache_;
+  uint64_t next_sequence_;
+  shared_ptr<const Snapshot> snapshot_;
+  Journal* journal_;
+  ShmRing* shm_ring_;
+  std::string replay_line_;
+  std::string stamped_;
+  std::vector<JournalRange> history_ranges_;
+  shared_ptr<Handoff> handoff_;
+  std::atomic<bool> handing_off_;  // Read by the acceptors' threads.
+  std::size_t adopted_;
+  std::vector<int> cpu_nodes_;  // The node of each CPU.
+  std::map<const asio::io_context*, Placement> placements_;
+  std::atomic<std::size_t> routed_;  // Spreads routed sessions.
+  std::thread snapshot_thread_;
+  std::atomic<bool> snapshot_busy_;  // Cleared by snapshot_thread_.
+};
+
+// Serves a plain text dump of the aggregated metrics to each connection made
+// to the admin port, then closes it.
+class AdminServer {
+ public:
+  AdminServer(asio::io_context& io_context,
+              const tcp::endpoint& listen_endpoint,
+              const Metrics& metrics)
+    : acceptor_(io_context, listen_endpoint),
+      metrics_(metrics) {
+    StartAccept();
+  }
+
+ private:
+  typedef shared_ptr<tcp::socket> SocketPtr;
+  typedef shared_ptr<std::string> ReportPtr;
+
+  void StartAccept() {
+    SocketPtr socket(new tcp::socket(acceptor_.get_executor()));
+    acceptor_.async_accept(*socket,
+        bind(&AdminServer::HandleAccept, this, socket, _1));
+  }
+
+  void HandleAccept(SocketPtr socket, const error_code& ec) {
+    if (!ec) {
+      std::ostringstream os;
+      metrics_.Print(os);
+      ReportPtr report(new std::string(os.str()));
+      asio::async_write(*socket, asio::buffer(*report),
+                        bind(&AdminServer::HandleWrite, socket, report));
+    }
+
+    StartAccept();
+  }
+
+  static void HandleWrite(SocketPtr, ReportPtr) {}
+
+  tcp::acceptor acceptor_;
+  const Metrics& metrics_;
+};
+
+// Periodically writes the aggregated metrics to stdout.
+class MetricsDumper {
+ public:
+  MetricsDumper(asio::io_context& io_context, const Metrics& metrics,
+                int interval_secs)
+    : timer_(io_context),
+      metrics_(metrics),
+      interval_(interval_secs) {
+    StartWait();
+  }
+
+ private:
+  void StartWait() {
+    timer_.expires_after(interval_);
+    timer_.async_wait(bind(&MetricsDumper::HandleWait, this, _1));
+  }
+
+  void HandleWait(const error_code& ec) {
+    if (ec) return;
+
+    std::ostringstream os;
+    metrics_.Print(os);
+    std::cout << os.str() << std::flush;
+    StartWait();
+  }
+
+  steady_timer timer_;
+  const Metrics& metrics_;
+  std::chrono::seconds interval_;
+};
+
+// Snapshots the server every interval, gathering the state on the server's
+// io_context and writing it on a background thread.
+class Snapshotter {
+ public:
+  Snapshotter(asio::io_context& io_context, Server& server,
+              const std::string& path, int interval_secs)
+    : timer_(io_context),
+      server_(server),
+      path_(path),
+      interval_(interval_secs) {
+    StartWait();
+  }
+
+ private:
+  void StartWait() {
+    timer_.expires_after(interval_);
+    timer_.async_wait(bind(&Snapshotter::HandleWait, this, _1));
+  }
+
+  void HandleWait(const error_code& ec) {
+    if (ec) return;
+
+    // A snapshot that has not finished by the next interval is left to
+    // finish rather than queued behind.
+    server_.StartSnapshot(path_);
+    StartWait();
+  }
+
+  steady_timer timer_;
+  Server& server_;
+  std::string path_;
+  std::chrono::seconds interval_;
+};
+
+// Waits on a Unix domain socket for a successor process to connect, then
+// hands the server over to it (see handoff.h) and calls done. The snapshot,
+// if there is one, is written just before the sockets are sent so that a
+// successor without a journal has the whole history. If the successor goes
+// away before it has everything, the server takes its sessions back and
+// waits for another.
+//
+// Whoever connects is given the server's sockets, so the socket is only
+// accessible to its owner and a peer running as another user is refused.
+class HandoffListener {
+ public:
+  HandoffListener(asio::io_context& io_context, Server& server,
+                  const std::string& path, const std::string& snapshot_path,
+                  const std::function<void()>& done)
+    : acceptor_(io_context),
+      socket_(io_context),
+      server_(server),
+      path_(path),
+      snapshot_path_(snapshot_path),
+      done_(done) {
+    error_code ec;
+    Listen(ec);
+    if (ec) throw boost::system::system_error(ec, "handoff listen");
+  }
+
+  ~HandoffListener() {
+    ::unlink(path_.c_str());
+  }
+
+ private:
+  // Seconds that sessions have to drain their output.
+  enum { kDrainSecs = 5 };
+
+  void Listen(error_code& ec) {
+    ::unlink(path_.c_str());
+    asio::local::stream_protocol::endpoint endpoint(path_);
+    acceptor_.open(endpoint.protocol(), ec);
+    if (!ec) acceptor_.bind(endpoint, ec);
+    // Nothing can connect before listen(), so there is no window in which
+    // the socket is open to others.
+    if (!ec && ::chmod(path_.c_str(), S_IRUSR | S_IWUSR) != 0)
+      ec = error_code(errno, boost::system::system_category());
+    if (!ec) acceptor_.listen(asio::socket_base::max_listen_connections, ec);
+    if (!ec) StartAccept();
+  }
+
+  void StartAccept() {
+    acceptor_.async_accept(socket_,
+        bind(&HandoffListener::HandleAccept, this, _1));
+  }
+
+  void HandleAccept(const error_code& ec) {
+    if (ec == asio::error::operation_aborted) return;
+    if (ec) {
+      StartAccept();
+      return;
+    }
+
+    error_code ignored_ec;
+    if (!SameUser(socket_.native_handle())) {
+      std::cerr << "Handoff: refused a peer running as another user\n";
+      socket_.close(ignored_ec);
+      StartAccept();
+      return;
+    }
+
+    acceptor_.close(ignored_ec);
+    server_.HandOff(bind(&HandoffListener::Send, this, _1),
+                    std::chrono::seconds(kDrainSecs));
+  }
+
+  static bool SameUser(int fd) {
+#if defined(SO_PEERCRED)
+    ucred peer;
+    socklen_t length = sizeof(peer);
+    return ::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 &&
+           peer.uid == ::geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return ::getpeereid(fd, &uid, &gid) == 0 && uid == ::geteuid();
+#endif
+  }
+
+  void Send(HandoffState& state) {
+    try {
+      if (!snapshot_path_.empty()) server_.WriteSnapshot(snapshot_path_);
+      SendHandoff(socket_.native_handle(), state);
+    }
+    catch (std::exception& e) {
+      std::cerr << "Handoff: " << e.what() << "\n";
+      error_code ec;
+      socket_.close(ec);
+      server_.ResumeAfterHandOff(state);
+      Listen(ec);
+      if (ec) std::cerr << "Handoff: " << ec.message() << "\n";
+      return;
+    }
+
+    // The successor has its own copies of the sessions' descriptors now.
+    for (const HandoffSession& session : state.sessions)
+      ::close(session.fd);
+
+    error_code ignored_ec;
+    socket_.close(ignored_ec);
+    done_();
+  }
+
+  asio::local::stream_protocol::acceptor acceptor_;
+  asio::local::stream_protocol::socket socket_;
+  Server& server_;
+  std::string path_;
+  std::string snapshot_path_;
+  std::function<void()> done_;
+};
+
+#endif  // SERVER_H_
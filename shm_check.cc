@@ -0,0 +1,80 @@
+// Exercises the shared memory ring (shm_ring.h): a writer thread publishes
+// messages whose contents follow from their sequence into a small ring while
+// a reader polls it. Every message the reader receives must be intact and
+// follow on from the one before; when the writer laps it the reader must see
+// an overrun, and it then starts again with a new reader. Prints what it saw
+// and exits non-zero if anything received was wrong.
+
+#include <unistd.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "shm_ring.h"
+
+namespace {
+
+// The message published as sequence: its sequence, then a run of letters
+// whose length and contents vary with it.
+std::string Payload(uint64_t sequence) {
+  std::string msg = std::to_string(sequence) + ":";
+  for (uint64_t i = 0; i < sequence * 7 % 300; ++i)
+    msg += char('a' + (sequence + i) % 26);
+  return msg;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string path = argc > 1
+      ? argv[1] : "/dev/shm/shm_check." + std::to_string(::getpid());
+  const uint64_t kMessages = 2000000;
+  const std::size_t kCapacity = 64 * 1024;
+
+  std::unique_ptr<ShmRing> ring(new ShmRing(path, kCapacity));
+  std::unique_ptr<ShmRingReader> reader(new ShmRingReader(path));
+
+  // Yields now and then so that, even on one CPU, the reader runs while the
+  // writer is part way round the ring: often enough in the first half for
+  // the reader to keep up, and too seldom in the second.
+  std::thread writer([&ring, kMessages] {
+    for (uint64_t sequence = 1; sequence <= kMessages; ++sequence) {
+      ring->Publish(sequence, Payload(sequence));
+      uint64_t every = sequence <= kMessages / 2 ? 100 : 5000;
+      if (sequence % every == 0) std::this_thread::yield();
+    }
+    ring.reset();
+  });
+
+  uint64_t received = 0, overruns = 0, corrupt = 0, gaps = 0, last = 0;
+  std::string msg;
+  uint64_t sequence;
+  for (;;) {
+    ShmPoll result = reader->Poll(msg, sequence);
+    if (result == kShmClosed) break;
+    if (result == kShmEmpty) {
+      std::this_thread::yield();
+    } else if (result == kShmOverrun) {
+      ++overruns;
+      last = 0;
+      reader.reset(new ShmRingReader(path));
+    } else {
+      ++received;
+      if (msg != Payload(sequence)) ++corrupt;
+      if (last && sequence != last + 1) ++gaps;
+      last = sequence;
+    }
+  }
+  writer.join();
+  ::unlink(path.c_str());
+
+  std::cout << "published " << kMessages << ", received " << received
+            << ", overruns " << overruns << ", corrupt " << corrupt
+            << ", gaps " << gaps << ", last " << last << "\n";
+  bool ok = received >= kMessages / 4 && overruns > 0 && corrupt == 0 &&
+            gaps == 0;
+  std::cout << (ok ? "ok" : "FAILED") << "\n";
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+// Subscriber for the server's shared memory ring (--shm), for clients on the
+// same host as the server. Polls the ring without system calls while messages
+// are flowing and sleeps briefly between polls only once it has gone idle. If
+// the ring overruns the client, skips a sequence or is closed, the client
+// falls back to an ordinary TCP subscription and carries on from there, which
+// needs the server to be run with --start-requests.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "client.h"
+#include "shm_ring.h"
+
+class ShmClient {
+ public:
+  ShmClient(const std::string& path, ClientMetrics& metrics, bool verbose)
+    : reader_(path),
+      metrics_(metrics),
+      verbose_(verbose),
+      last_sequence_(0) {
+    metrics_.Local().connects.Add(1);
+  }
+
+  // Reads until the ring can no longer be followed. Returns the sequence of
+  // the last message received, 0 if none.
+  uint64_t Run() {
+    Clock::time_point next_report = Clock::now() + std::chrono::seconds(10);
+    uint64_t idle = 0;
+    uint64_t received = 0;
+    for (;;) {
+      uint64_t sequence = 0;
+      ShmPoll poll = reader_.Poll(line_, sequence);
+      if (poll == kShmReceived) {
+        if (last_sequence_ && sequence != last_sequence_ + 1) {
+          std::cerr << "Ring skipped from " << last_sequence_ << " to "
+                    << sequence << "\n";
+          return last_sequence_;
+        }
+        last_sequence_ = sequence;
+        HandleMessage(line_);
+        idle = 0;
+        if (++received % kReportCheck) continue;
+      } else if (poll == kShmOverrun) {
+        std::cerr << "Ring overrun after " << last_sequence_ << "\n";
+        return last_sequence_;
+      } else if (poll == kShmClosed) {
+        std::cerr << "Ring closed after " << last_sequence_ << "\n";
+        return last_sequence_;
+      } else if (++idle > kSpins) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        if (idle % kLivenessCheck == 0 && !reader_.WriterAlive()) {
+          std::cerr << "Ring writer gone after " << last_sequence_ << "\n";
+          return last_sequence_;
+        }
+      }
+
+      if (verbose_ && Clock::now() >= next_report) {
+        Report();
+        next_report += std::chrono::seconds(10);
+      }
+    }
+  }
+
+ private:
+  // Empty polls before sleeping, messages between report checks, and empty
+  // polls (roughly a second's worth once sleeping) between checks that the
+  // writer is still running.
+  enum { kSpins = 10000, kReportCheck = 4096, kLivenessCheck = 20000 };
+
+  void HandleMessage(const std::string& line) {
+    ClientStats& stats = metrics_.Local();
+    stats.messages_received.Add(1);
+    stats.bytes_received.Add(line.size() + 1);
+
+    int64_t stamp_ns = 0;
+    std::size_t payload = 0;
+    if (Unstamp(line, stamp_ns, payload)) {
+      int64_t latency_ns = WallClockNs() - stamp_ns;
+      stats.latency_ns.Record(latency_ns > 0 ? latency_ns : 0);
+    }
+
+    if (verbose_)
+      std::cout << "Received: " << line.substr(payload) << "\n";
+  }
+
+  void Report() {
+    ClientStats stats;
+    metrics_.Aggregate(stats);
+    if (stats.latency_ns.Count()) {
+      std::cout << "Publish to receive latency (us): ";
+      stats.latency_ns.Print(std::cout, 1000.0);
+      std::cout << "\n";
+    }
+  }
+
+  ShmRingReader reader_;
+  ClientMetrics& metrics_;
+  bool verbose_;
+  uint64_t last_sequence_;
+  std::string line_;
+};
+
+int main(int argc, char* argv[]) {
+  try {
+    bool verbose = true;
+    bool usage = argc < 4;
+    for (int i = 4; i < argc && !usage; ++i) {
+      std::string arg(argv[i]);
+      if (arg == "--quiet")
+        verbose = false;
+      else
+        usage = true;
+    }
+
+    if (usage) {
+      std::cerr << "Usage: shm_client <ring_path> <host> <port> [--quiet]\n";
+      return 1;
+    }
+
+    ClientMetrics metrics;
+    uint64_t last_sequence;
+    {
+      ShmClient client(argv[1], metrics, verbose);
+      last_sequence = client.Run();
+    }
+
+    // The TCP subscription carries on from the message after the last one
+    // the ring delivered.
+    std::cerr << "Catching up over TCP\n";
+    asio::io_context io_context;
+    tcp::resolver resolver(io_context);
+    Client client(io_context, metrics, verbose);
+    client.set_from(last_sequence + 1);
+    client.Start(resolver.resolve(argv[2], argv[3]));
+    io_context.run();
+  }
+  catch (std::exception& e) {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,252 @@
+#ifndef SHM_RING_H_
+#define SHM_RING_H_
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include "journal.h"
+
+// A single-producer, multi-consumer broadcast ring in a shared memory file
+// (e.g. under /dev/shm), through which the server passes each published
+// message once to every reader on the same host. Neither side makes a system
+// call per message, and readers never hold the writer up: a reader that
+// falls more than a ring behind is overrun, notices, and must catch up some
+// other way.
+//
+// The file is a header page followed by capacity bytes of records:
+//
+//   length:u32  type:u32  sequence:u64  payload  padding to 16 bytes
+//
+// Records never wrap; the writer pads out the end of the ring instead. Before
+// writing a record the writer advances tail_intent past it, and afterwards
+// tail. A reader copies a record out below tail and then checks tail_intent:
+// if the writer may have reached the reader's position while it copied, the
+// copy is discarded as an overrun.
+enum {
+  kShmRecordHeader = 16,
+  kShmHeaderSize = 4096
+};
+
+enum ShmRecordType {
+  kShmMessage = 1,
+  kShmPadding = 2
+};
+
+struct ShmRingHeader {
+  char magic[8];  // "PSRING01"
+  uint64_t capacity;
+  int32_t writer_pid;
+  std::atomic<uint32_t> closed;  // Set when the writer goes away.
+  alignas(64) std::atomic<uint64_t> tail_intent;
+  alignas(64) std::atomic<uint64_t> tail;
+};
+
+inline std::size_t ShmRecordSize(std::size_t length) {
+  return (kShmRecordHeader + length + 15) & ~std::size_t(15);
+}
+
+// The writer, in the server. Creates (or replaces) the ring file at path;
+// capacity is rounded up to a power of two.
+class ShmRing {
+ public:
+  ShmRing(const std::string& path, std::size_t capacity)
+    : path_(path),
+      capacity_(RoundUp(capacity)),
+      mask_(capacity_ - 1),
+      tail_(0) {
+    // Unlinking first leaves readers of a previous ring on the old file,
+    // where they see it closed, rather than on a ring that restarts at zero.
+    ::unlink(path_.c_str());
+    int fd = ::open(path_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) throw JournalError("open " + path_);
+    if (::ftruncate(fd, kShmHeaderSize + capacity_) != 0) {
+      ::close(fd);
+      throw JournalError("truncate " + path_);
+    }
+    void* data = ::mmap(0, kShmHeaderSize + capacity_,
+                        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) throw JournalError("mmap " + path_);
+
+    header_ = new (data) ShmRingHeader;
+    header_->capacity = capacity_;
+    header_->writer_pid = ::getpid();
+    header_->closed.store(0, std::memory_order_relaxed);
+    header_->tail_intent.store(0, std::memory_order_relaxed);
+    header_->tail.store(0, std::memory_order_relaxed);
+    records_ = static_cast<char*>(data) + kShmHeaderSize;
+
+    // Readers check the magic before anything else, so it goes in last.
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header_->magic, "PSRING01", 8);
+  }
+
+  ~ShmRing() {
+    header_->closed.store(1, std::memory_order_release);
+    ::munmap(header_, kShmHeaderSize + capacity_);
+  }
+
+  const std::string& path() const { return path_; }
+
+  // The largest message that fits; larger ones are not published.
+  std::size_t max_message() const { return capacity_ / 8; }
+
+  // Publishes msg as sequence. Returns false if it is too large.
+  bool Publish(uint64_t sequence, const std::string& msg) {
+    if (msg.size() > max_message()) return false;
+
+    std::size_t record = ShmRecordSize(msg.size());
+    std::size_t index = tail_ & mask_;
+    std::size_t to_end = capacity_ - index;
+    std::size_t padding = record > to_end ? to_end : 0;
+
+    header_->tail_intent.store(tail_ + padding + record,
+                               std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (padding) {
+      WriteHeader(index, uint32_t(to_end - kShmRecordHeader), kShmPadding, 0);
+      index = 0;
+    }
+    WriteHeader(index, uint32_t(msg.size()), kShmMessage, sequence);
+    std::memcpy(records_ + index + kShmRecordHeader, msg.data(), msg.size());
+
+    tail_ += padding + record;
+    header_->tail.store(tail_, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  ShmRing(const ShmRing&);
+  ShmRing& operator=(const ShmRing&);
+
+  static std::size_t RoundUp(std::size_t capacity) {
+    std::size_t n = 4096;
+    while (n < capacity) n <<= 1;
+    return n;
+  }
+
+  void WriteHeader(std::size_t index, uint32_t length, uint32_t type,
+                   uint64_t sequence) {
+    char* p = records_ + index;
+    std::memcpy(p, &length, 4);
+    std::memcpy(p + 4, &type, 4);
+    std::memcpy(p + 8, &sequence, 8);
+  }
+
+  std::string path_;
+  std::size_t capacity_;
+  std::size_t mask_;
+  uint64_t tail_;
+  ShmRingHeader* header_;
+  char* records_;
+};
+
+enum ShmPoll {
+  kShmEmpty,    // Nothing new yet.
+  kShmReceived,
+  kShmOverrun,  // The writer lapped the reader; messages were lost.
+  kShmClosed    // The writer has gone.
+};
+
+// A reader, mapping the ring read only. Starts at the ring's current tail,
+// so it sees messages published from then on.
+class ShmRingReader {
+ public:
+  explicit ShmRingReader(const std::string& path)
+    : header_(0), size_(0), records_(0), capacity_(0), cursor_(0) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw JournalError("open " + path);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw JournalError("stat " + path);
+    }
+    size_ = st.st_size;
+    void* data = size_ > kShmHeaderSize
+        ? ::mmap(0, size_, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (data == MAP_FAILED) throw JournalError("mmap " + path);
+
+    header_ = static_cast<const ShmRingHeader*>(data);
+    bool magic = std::memcmp(header_->magic, "PSRING01", 8) == 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!magic || header_->capacity != size_ - kShmHeaderSize) {
+      ::munmap(data, size_);
+      throw std::runtime_error("not a ring: " + path);
+    }
+
+    capacity_ = header_->capacity;
+    records_ = static_cast<const char*>(data) + kShmHeaderSize;
+    cursor_ = header_->tail.load(std::memory_order_acquire);
+  }
+
+  ~ShmRingReader() {
+    ::munmap(const_cast<ShmRingHeader*>(header_), size_);
+  }
+
+  // Whether the writer's process is still running, in case it died without
+  // closing the ring. A system call, so best asked only when idle.
+  bool WriterAlive() const {
+    return ::kill(header_->writer_pid, 0) == 0 || errno == EPERM;
+  }
+
+  // Copies the next message into msg, with its sequence.
+  ShmPoll Poll(std::string& msg, uint64_t& sequence) {
+    for (;;) {
+      uint64_t tail = header_->tail.load(std::memory_order_acquire);
+      if (cursor_ == tail) {
+        return header_->closed.load(std::memory_order_acquire)
+            ? kShmClosed : kShmEmpty;
+      }
+      if (tail - cursor_ > capacity_) return kShmOverrun;
+
+      std::size_t index = cursor_ & (capacity_ - 1);
+      uint32_t length, type;
+      std::memcpy(&length, records_ + index, 4);
+      std::memcpy(&type, records_ + index + 4, 4);
+      std::memcpy(&sequence, records_ + index + 8, 8);
+
+      // A record being overwritten may hold anything, so bound the copy
+      // before validating it.
+      std::size_t available = capacity_ - index - kShmRecordHeader;
+      if (type == kShmMessage)
+        msg.assign(records_ + index + kShmRecordHeader,
+                   std::min<std::size_t>(length, available));
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t intent = header_->tail_intent.load(std::memory_order_relaxed);
+      if (intent - cursor_ > capacity_ || length > available ||
+          (type != kShmMessage && type != kShmPadding))
+        return kShmOverrun;
+
+      cursor_ += ShmRecordSize(length);
+      if (type == kShmMessage) return kShmReceived;
+    }
+  }
+
+ private:
+  ShmRingReader(const ShmRingReader&);
+  ShmRingReader& operator=(const ShmRingReader&);
+
+  const ShmRingHeader* header_;
+  std::size_t size_;
+  const char* records_;
+  uint64_t capacity_;
+  uint64_t cursor_;
+};
+
+#endif  // SHM_RING_H_
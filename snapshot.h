@@ -0,0 +1,227 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "journal.h"
+
+// A server's restartable state, written periodically and mapped on startup:
+//
+//   header    magic "PSSNAP01", next_sequence, segment_count, history_count,
+//             history_bytes (u64 each, host byte order)
+//   segments  per journal segment: base, count, size, index_count, then
+//             index_count offsets (u64 each)
+//   history   history_count messages, "<msg>\n" each
+//
+// With a journal the history lives there and the snapshot records only the
+// segments' states, so reopening even a large journal reads no messages.
+// Without one the history section holds the in-memory cache, and is replayed
+// from the mapping rather than loaded.
+//
+// Snapshots are for restarting on the same host; they are written to a
+// temporary file and renamed into place, so a crash never leaves a torn one.
+enum { kSnapshotHeaderWords = 5 };
+
+class Snapshot {
+ public:
+  // Maps the snapshot at path. Throws if it cannot be read or is malformed.
+  explicit Snapshot(const std::string& path)
+    : data_(0), size_(0), next_sequence_(1), history_(0),
+      history_count_(0), history_bytes_(0) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw JournalError("open " + path);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw JournalError("stat " + path);
+    }
+
+    size_ = st.st_size;
+    void* data = size_ ? ::mmap(0, size_, PROT_READ, MAP_SHARED, fd, 0) : 0;
+    ::close(fd);
+    if (data == MAP_FAILED) throw JournalError("mmap " + path);
+    data_ = static_cast<const char*>(data);
+
+    if (!Parse()) {
+      Unmap();
+      throw std::runtime_error("malformed snapshot " + path);
+    }
+  }
+
+  ~Snapshot() {
+    Unmap();
+  }
+
+  uint64_t next_sequence() const { return next_sequence_; }
+  const std::vector<JournalSegmentState>& segments() const {
+    return segments_;
+  }
+
+  uint64_t history_count() const { return history_count_; }
+
+  // The history section, "<msg>\n" per message.
+  const char* history() const { return history_; }
+  std::size_t history_bytes() const { return history_bytes_; }
+
+  // Calls f(data, length) with each history message, without its newline.
+  template <typename F>
+  void Replay(F f) const {
+    const char* p = history_;
+    const char* end = history_ + history_bytes_;
+    while (p < end) {
+      const char* nl = static_cast<const char*>(
+          std::memchr(p, '\n', end - p));
+      f(p, nl - p);
+      p = nl + 1;
+    }
+  }
+
+ private:
+  Snapshot(const Snapshot&);
+  Snapshot& operator=(const Snapshot&);
+
+  bool Parse() {
+    const char* p = data_;
+    const char* end = data_ + size_;
+    uint64_t header[kSnapshotHeaderWords];
+    if (!Read(p, end, header, kSnapshotHeaderWords) ||
+        std::memcmp(&header[0], "PSSNAP01", 8) != 0)
+      return false;
+
+    next_sequence_ = header[1];
+    for (uint64_t i = 0; i < header[2]; ++i) {
+      uint64_t fields[4];
+      if (!Read(p, end, fields, 4) || fields[3] > uint64_t(end - p) / 8)
+        return false;
+
+      JournalSegmentState state = { fields[0], fields[1], fields[2],
+                                    std::vector<std::size_t>(fields[3]) };
+      for (std::size_t& offset : state.index) {
+        uint64_t value;
+        Read(p, end, &value, 1);
+        offset = value;
+      }
+      segments_.push_back(state);
+    }
+
+    history_count_ = header[3];
+    history_bytes_ = header[4];
+    if (history_bytes_ != uint64_t(end - p) ||
+        (history_bytes_ && p[history_bytes_ - 1] != '\n'))
+      return false;
+    history_ = p;
+    return true;
+  }
+
+  static bool Read(const char*& p, const char* end, uint64_t* words,
+                   std::size_t n) {
+    if (uint64_t(end - p) < n * 8) return false;
+    std::memcpy(words, p, n * 8);
+    p += n * 8;
+    return true;
+  }
+
+  void Unmap() {
+    if (data_) ::munmap(const_cast<char*>(data_), size_);
+    data_ = 0;
+  }
+
+  const char* data_;
+  std::size_t size_;
+  uint64_t next_sequence_;
+  std::vector<JournalSegmentState> segments_;
+  const char* history_;
+  uint64_t history_count_;
+  uint64_t history_bytes_;
+};
+
+// Writes a snapshot in the layout above: segments first, then history, then
+// Commit() to fill in the header and move the file into place.
+class SnapshotWriter {
+ public:
+  explicit SnapshotWriter(const std::string& path)
+    : path_(path),
+      temp_path_(path + ".tmp"),
+      file_(std::fopen(temp_path_.c_str(), "wb")),
+      segment_count_(0),
+      history_count_(0),
+      history_bytes_(0) {
+    if (!file_) throw JournalError("open " + temp_path_);
+
+    uint64_t header[kSnapshotHeaderWords] = { 0, 0, 0, 0, 0 };
+    Write(header, kSnapshotHeaderWords);
+  }
+
+  ~SnapshotWriter() {
+    if (file_) {
+      std::fclose(file_);
+      ::unlink(temp_path_.c_str());
+    }
+  }
+
+  void AddSegment(const JournalSegmentState& state) {
+    uint64_t fields[4] = { state.base, state.count, state.size,
+                           state.index.size() };
+    Write(fields, 4);
+    for (std::size_t offset : state.index) {
+      uint64_t value = offset;
+      Write(&value, 1);
+    }
+    ++segment_count_;
+  }
+
+  // Appends count messages already in wire form.
+  void AddHistory(const char* data, std::size_t length, uint64_t count) {
+    if (std::fwrite(data, 1, length, file_) != length)
+      throw JournalError("write " + temp_path_);
+    history_count_ += count;
+    history_bytes_ += length;
+  }
+
+  // Makes the snapshot durable and replaces any previous one.
+  void Commit(uint64_t next_sequence) {
+    uint64_t header[kSnapshotHeaderWords] = {
+        0, next_sequence, segment_count_, history_count_, history_bytes_ };
+    std::memcpy(&header[0], "PSSNAP01", 8);
+    if (std::fseek(file_, 0, SEEK_SET) != 0)
+      throw JournalError("seek " + temp_path_);
+    Write(header, kSnapshotHeaderWords);
+
+    if (std::fflush(file_) != 0 || ::fsync(::fileno(file_)) != 0)
+      throw JournalError("sync " + temp_path_);
+    std::fclose(file_);
+    file_ = 0;
+
+    if (std::rename(temp_path_.c_str(), path_.c_str()) != 0)
+      throw JournalError("rename " + temp_path_);
+  }
+
+ private:
+  SnapshotWriter(const SnapshotWriter&);
+  SnapshotWriter& operator=(const SnapshotWriter&);
+
+  void Write(const uint64_t* words, std::size_t n) {
+    if (std::fwrite(words, 8, n, file_) != n)
+      throw JournalError("write " + temp_path_);
+  }
+
+  std::string path_;
+  std::string temp_path_;
+  std::FILE* file_;
+  uint64_t segment_count_;
+  uint64_t history_count_;
+  uint64_t history_bytes_;
+};
+
+#endif  // SNAPSHOT_H_
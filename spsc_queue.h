@@ -0,0 +1,92 @@
+#ifndef SPSC_QUEUE_H_
+#define SPSC_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A bounded, lock-free queue between exactly one producer thread and one
+// consumer thread. Slots are constructed once and reused: the producer fills
+// the slot returned by Back() in place and publishes it with Push(), and the
+// consumer reads (or swaps out) Front() and releases it with Pop(), so that
+// element types like std::string keep their capacity from lap to lap and a
+// steady stream of messages allocates nothing.
+//
+// Each side caches the other's index and rereads it only when the queue looks
+// full or empty, so the shared cache lines move between cores roughly once a
+// batch rather than once a message.
+template <typename T>
+class SpscQueue {
+ public:
+  // capacity is rounded up to a power of two.
+  explicit SpscQueue(std::size_t capacity)
+    : slots_(RoundUp(capacity)),
+      mask_(slots_.size() - 1),
+      head_(0),
+      head_value_(0),
+      cached_tail_(0),
+      tail_(0),
+      tail_value_(0),
+      cached_head_(0) {}
+
+  std::size_t capacity() const { return slots_.size(); }
+
+  // Producer: the slot to fill next, or null if the queue is full.
+  T* Back() {
+    if (tail_value_ - cached_head_ == slots_.size()) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail_value_ - cached_head_ == slots_.size()) return 0;
+    }
+    return &slots_[tail_value_ & mask_];
+  }
+
+  // Producer: publishes the slot returned by Back().
+  void Push() {
+    tail_.store(++tail_value_, std::memory_order_release);
+  }
+
+  // Consumer: the oldest published slot, or null if the queue is empty.
+  T* Front() {
+    if (head_value_ == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head_value_ == cached_tail_) return 0;
+    }
+    return &slots_[head_value_ & mask_];
+  }
+
+  // Consumer: hands the slot returned by Front() back to the producer.
+  void Pop() {
+    head_.store(++head_value_, std::memory_order_release);
+  }
+
+ private:
+  SpscQueue(const SpscQueue&);
+  SpscQueue& operator=(const SpscQueue&);
+
+  static std::size_t RoundUp(std::size_t capacity) {
+    std::size_t n = 2;
+    while (n < capacity) n <<= 1;
+    return n;
+  }
+
+  // Padding keeps the consumer's and producer's fields on separate cache
+  // lines without relying on over-aligned allocation.
+  std::vector<T> slots_;
+  std::size_t mask_;
+  char pad0_[64];
+
+  // Written by the consumer.
+  std::atomic<uint64_t> head_;
+  uint64_t head_value_;
+  uint64_t cached_tail_;
+  char pad1_[64];
+
+  // Written by the producer.
+  std::atomic<uint64_t> tail_;
+  uint64_t tail_value_;
+  uint64_t cached_head_;
+  char pad2_[64];
+};
+
+#endif  // SPSC_QUEUE_H_
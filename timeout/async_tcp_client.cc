@@ -10,8 +10,8 @@
 
 #include <thread>
 
-#include <boost/asio/deadline_timer.hpp>
-#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/read_until.hpp>
 #include <boost/asio/streambuf.hpp>
@@ -20,7 +20,7 @@
 #include "boost/lexical_cast.hpp"
 #include <iostream>
 
-using boost::asio::deadline_timer;
+using boost::asio::steady_timer;
 using boost::asio::ip::tcp;
 
 //
@@ -86,17 +86,17 @@ using boost::asio::ip::tcp;
 class client
 {
 public:
-  client(boost::asio::io_service& io_service)
+  client(boost::asio::io_context& io_context)
     : stopped_(false),
-      socket_(io_service),
-      deadline_(io_service),
-      heartbeat_timer_(io_service)
+      socket_(io_context),
+      deadline_(io_context),
+      heartbeat_timer_(io_context)
   {
   }
 
   // Called by the user of the client class to initiate the connection process.
   // The endpoint iterator will have been obtained using a tcp::resolver.
-  void start(tcp::resolver::iterator endpoint_iter)
+  void start(tcp::resolver::results_type::iterator endpoint_iter)
   {
     // Start the connect actor.
     start_connect(endpoint_iter);
@@ -120,14 +120,14 @@ public:
   }
 
 private:
-  void start_connect(tcp::resolver::iterator endpoint_iter)
+  void start_connect(tcp::resolver::results_type::iterator endpoint_iter)
   {
-    if (endpoint_iter != tcp::resolver::iterator())
+    if (endpoint_iter != tcp::resolver::results_type::iterator())
     {
       std::cout << "Trying " << endpoint_iter->endpoint() << "...\n";
 
       // Set a deadline for the connect operation.
-      deadline_.expires_from_now(boost::posix_time::seconds(60));
+      deadline_.expires_after(std::chrono::seconds(60));
 
       // Start the asynchronous connect operation.
       socket_.async_connect(endpoint_iter->endpoint(),
@@ -142,7 +142,7 @@ private:
   }
 
   void handle_connect(const boost::system::error_code& ec,
-      tcp::resolver::iterator endpoint_iter)
+      tcp::resolver::results_type::iterator endpoint_iter)
   {
     if (stopped_)
       return;
@@ -187,7 +187,7 @@ private:
   void start_read()
   {
     // Set a deadline for the read operation.
-    deadline_.expires_from_now(boost::posix_time::seconds(30));
+    deadline_.expires_after(std::chrono::seconds(30));
 
     // Start an asynchronous operation to read a newline-delimited message.
     boost::asio::async_read_until(socket_, input_buffer_, '\n',
@@ -248,7 +248,7 @@ private:
     if (!ec)
     {
       // Wait 10 seconds before sending the next heartbeat.
-      heartbeat_timer_.expires_from_now(boost::posix_time::seconds(10));
+      heartbeat_timer_.expires_after(std::chrono::seconds(10));
       heartbeat_timer_.async_wait(boost::bind(&client::start_write, this));
     }
     else
@@ -267,7 +267,7 @@ private:
     // Check whether the deadline has passed. We compare the deadline against
     // the current time since a new asynchronous operation may have moved the
     // deadline before this actor had a chance to run.
-    if (deadline_.expires_at() <= deadline_timer::traits_type::now())
+    if (deadline_.expiry() <= steady_timer::clock_type::now())
     {
       // The deadline has passed. The socket is closed so that any outstanding
       // asynchronous operations are cancelled.
@@ -275,7 +275,7 @@ private:
 
       // There is no longer an active deadline. The expiry is set to positive
       // infinity so that the actor takes no action until a new deadline is set.
-      deadline_.expires_at(boost::posix_time::pos_infin);
+      deadline_.expires_at(steady_timer::time_point::max());
     }
 
     // Put the actor back to sleep.
@@ -286,8 +286,8 @@ private:
   bool stopped_;
   tcp::socket socket_;
   boost::asio::streambuf input_buffer_;
-  deadline_timer deadline_;
-  deadline_timer heartbeat_timer_;
+  steady_timer deadline_;
+  steady_timer heartbeat_timer_;
 };
 
 int main(int argc, char* argv[])
@@ -300,13 +300,13 @@ int main(int argc, char* argv[])
       return 1;
     }
 
-    boost::asio::io_service io_service;
-    tcp::resolver r(io_service);
-    client c(io_service);
+    boost::asio::io_context io_context;
+    tcp::resolver r(io_context);
+    client c(io_context);
 
-    c.start(r.resolve(tcp::resolver::query(argv[1], argv[2])));
+    c.start(r.resolve(argv[1], argv[2]).begin());
 
-    io_service.run();
+    io_context.run();
   }
   catch (std::exception& e)
   {
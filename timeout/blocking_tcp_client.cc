@@ -9,20 +9,25 @@
 //
 
 #include <boost/asio/connect.hpp>
-#include <boost/asio/deadline_timer.hpp>
-#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/read_until.hpp>
 #include <boost/asio/streambuf.hpp>
 #include <boost/system/system_error.hpp>
 #include <boost/asio/write.hpp>
+#include <chrono>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 #include <boost/lambda/bind.hpp>
 #include <boost/lambda/lambda.hpp>
+#include "../histogram.h"
 
-using boost::asio::deadline_timer;
+using boost::asio::steady_timer;
 using boost::asio::ip::tcp;
 using boost::lambda::bind;
 using boost::lambda::var;
@@ -48,36 +53,36 @@ using boost::lambda::_1;
 // and any outstanding operations are consequently cancelled. The socket
 // operations themselves use boost::lambda function objects as completion
 // handlers. For a given socket operation, the client object runs the
-// io_service to block thread execution until the actor completes.
+// io_context to block thread execution until the actor completes.
 //
 class client
 {
 public:
   client()
-    : socket_(io_service_),
-      deadline_(io_service_)
+    : socket_(io_context_),
+      deadline_(io_context_)
   {
     // No deadline is required until the first socket operation is started. We
     // set the deadline to positive infinity so that the actor takes no action
     // until a specific deadline is set.
-    deadline_.expires_at(boost::posix_time::pos_infin);
+    deadline_.expires_at(steady_timer::time_point::max());
 
     // Start the persistent actor that checks for deadline expiry.
     check_deadline();
   }
 
   void connect(const std::string& host, const std::string& service,
-      boost::posix_time::time_duration timeout)
+      steady_timer::duration timeout)
   {
     // Resolve the host name and service to a list of endpoints.
-    tcp::resolver::query query(host, service);
-    tcp::resolver::iterator iter = tcp::resolver(io_service_).resolve(query);
+    tcp::resolver::results_type endpoints =
+      tcp::resolver(io_context_).resolve(host, service);
 
     // Set a deadline for the asynchronous operation. As a host name may
     // resolve to multiple endpoints, this function uses the composed operation
     // async_connect. The deadline applies to the entire operation, rather than
     // individual connection attempts.
-    deadline_.expires_from_now(timeout);
+    deadline_.expires_after(timeout);
 
     // Set up the variable that receives the result of the asynchronous
     // operation. The error code is set to would_block to signal that the
@@ -90,10 +95,10 @@ public:
     // object is used as a callback and will update the ec variable when the
     // operation completes. The blocking_udp_client.cpp example shows how you
     // can use boost::bind rather than boost::lambda.
-    boost::asio::async_connect(socket_, iter, var(ec) = _1);
+    boost::asio::async_connect(socket_, endpoints, var(ec) = _1);
 
     // Block until the asynchronous operation has completed.
-    do io_service_.run_one(); while (ec == boost::asio::error::would_block);
+    do io_context_.run_one(); while (ec == boost::asio::error::would_block);
 
     // Determine whether a connection was successfully established. The
     // deadline actor may have had a chance to run and close our socket, even
@@ -105,12 +110,12 @@ public:
           ec ? ec : boost::asio::error::operation_aborted);
   }
 
-  std::string read_line(boost::posix_time::time_duration timeout)
+  std::string read_line(steady_timer::duration timeout)
   {
     // Set a deadline for the asynchronous operation. Since this function uses
     // a composed operation (async_read_until), the deadline applies to the
     // entire operation, rather than individual reads from the socket.
-    deadline_.expires_from_now(timeout);
+    deadline_.expires_after(timeout);
 
     // Set up the variable that receives the result of the asynchronous
     // operation. The error code is set to would_block to signal that the
@@ -126,7 +131,7 @@ public:
     boost::asio::async_read_until(socket_, input_buffer_, '\n', var(ec) = _1);
 
     // Block until the asynchronous operation has completed.
-    do io_service_.run_one(); while (ec == boost::asio::error::would_block);
+    do io_context_.run_one(); while (ec == boost::asio::error::would_block);
 
     if (ec)
       throw boost::system::system_error(ec);
@@ -138,14 +143,14 @@ public:
   }
 
   void write_line(const std::string& line,
-      boost::posix_time::time_duration timeout)
+      steady_timer::duration timeout)
   {
     std::string data = line + "\n";
 
     // Set a deadline for the asynchronous operation. Since this function uses
     // a composed operation (async_write), the deadline applies to the entire
     // operation, rather than individual writes to the socket.
-    deadline_.expires_from_now(timeout);
+    deadline_.expires_after(timeout);
 
     // Set up the variable that receives the result of the asynchronous
     // operation. The error code is set to would_block to signal that the
@@ -161,19 +166,24 @@ public:
     boost::asio::async_write(socket_, boost::asio::buffer(data), var(ec) = _1);
 
     // Block until the asynchronous operation has completed.
-    do io_service_.run_one(); while (ec == boost::asio::error::would_block);
+    do io_context_.run_one(); while (ec == boost::asio::error::would_block);
 
     if (ec)
       throw boost::system::system_error(ec);
   }
 
+  void set_no_delay(bool no_delay)
+  {
+    socket_.set_option(tcp::no_delay(no_delay));
+  }
+
 private:
   void check_deadline()
   {
     // Check whether the deadline has passed. We compare the deadline against
     // the current time since a new asynchronous operation may have moved the
     // deadline before this actor had a chance to run.
-    if (deadline_.expires_at() <= deadline_timer::traits_type::now())
+    if (deadline_.expiry() <= steady_timer::clock_type::now())
     {
       // The deadline has passed. The socket is closed so that any outstanding
       // asynchronous operations are cancelled. This allows the blocked
@@ -183,53 +193,242 @@ private:
 
       // There is no longer an active deadline. The expiry is set to positive
       // infinity so that the actor takes no action until a new deadline is set.
-      deadline_.expires_at(boost::posix_time::pos_infin);
+      deadline_.expires_at(steady_timer::time_point::max());
     }
 
     // Put the actor back to sleep.
     deadline_.async_wait(bind(&client::check_deadline, this));
   }
 
-  boost::asio::io_service io_service_;
+  boost::asio::io_context io_context_;
   tcp::socket socket_;
-  deadline_timer deadline_;
+  steady_timer deadline_;
   boost::asio::streambuf input_buffer_;
 };
 
 //----------------------------------------------------------------------
 
+//
+// Benchmark mode. Each connection sends count tagged copies of the message,
+// "<message> <connection>:<sequence>", keeping up to window of them in flight,
+// and times each one until the server echoes it back. Lines sent by other
+// connections are fanned out to every session and are skipped.
+//
+// With a target rate, message i is scheduled for start + i / rate. A blocking
+// client cannot send while it waits for a reply, so a slow reply also delays
+// the sends queued behind it and the raw round trip times understate what a
+// client sending on schedule would see. The corrected histogram measures from
+// the scheduled send time instead, accounting for this coordinated omission.
+//
+struct benchmark_options
+{
+  benchmark_options()
+    : count(0), window(1), rate(0), connections(1)
+  {
+  }
+
+  int count;
+  int window;
+  double rate;
+  int connections;
+};
+
+struct connection_result
+{
+  Histogram rtt;
+  Histogram corrected;
+  std::string error;
+};
+
+typedef std::chrono::steady_clock steady_clock;
+
+static uint64_t nanoseconds_between(steady_clock::time_point from,
+    steady_clock::time_point to)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      to - from).count();
+}
+
+void run_connection(const std::string& host, const std::string& port,
+    const std::string& message, const benchmark_options& options, int id,
+    connection_result& result)
+{
+  try
+  {
+    client c;
+    c.connect(host, port, std::chrono::seconds(10));
+
+    // Pipelined lines must not be held back by Nagle's algorithm waiting for
+    // the server to acknowledge the previous one.
+    c.set_no_delay(true);
+
+    std::string prefix = message + " " + std::to_string(id) + ":";
+    std::vector<steady_clock::time_point> sent(options.count);
+    std::vector<steady_clock::time_point> intended(options.count);
+    steady_clock::duration interval(0);
+    if (options.rate > 0)
+      interval = std::chrono::duration_cast<steady_clock::duration>(
+          std::chrono::duration<double>(1.0 / options.rate));
+
+    steady_clock::time_point start = steady_clock::now();
+    int next = 0;
+    int received = 0;
+    while (received < options.count)
+    {
+      // Send as many messages as the window and the schedule allow. If
+      // nothing is in flight, wait for the next scheduled send rather than
+      // block reading.
+      while (next < options.count && next - received < options.window)
+      {
+        steady_clock::time_point now = steady_clock::now();
+        intended[next] = options.rate > 0 ? start + next * interval : now;
+        if (now < intended[next])
+        {
+          if (next > received)
+            break;
+          std::this_thread::sleep_until(intended[next]);
+        }
+
+        sent[next] = steady_clock::now();
+        c.write_line(prefix + std::to_string(next),
+            std::chrono::seconds(10));
+        ++next;
+      }
+
+      std::string line = c.read_line(std::chrono::seconds(10));
+      steady_clock::time_point now = steady_clock::now();
+      if (line.compare(0, prefix.size(), prefix) != 0)
+        continue;
+
+      int seq = std::atoi(line.c_str() + prefix.size());
+      if (seq < 0 || seq >= next)
+        continue;
+
+      result.rtt.Record(nanoseconds_between(sent[seq], now));
+      result.corrected.Record(nanoseconds_between(intended[seq], now));
+      ++received;
+    }
+  }
+  catch (std::exception& e)
+  {
+    result.error = e.what();
+  }
+}
+
+int run_benchmark(const std::string& host, const std::string& port,
+    const std::string& message, const benchmark_options& options)
+{
+  std::unique_ptr<connection_result[]> results(
+      new connection_result[options.connections]);
+
+  steady_clock::time_point start = steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < options.connections; ++i)
+    threads.emplace_back(run_connection, std::cref(host), std::cref(port),
+        std::cref(message), std::cref(options), i, std::ref(results[i]));
+  for (std::size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+  double elapsed = std::chrono::duration<double>(
+      steady_clock::now() - start).count();
+
+  // The per-connection histograms are merged into one report.
+  Histogram rtt;
+  Histogram corrected;
+  int failed = 0;
+  for (int i = 0; i < options.connections; ++i)
+  {
+    if (!results[i].error.empty())
+    {
+      std::cerr << "Connection " << i << ": " << results[i].error << "\n";
+      ++failed;
+    }
+    rtt.Merge(results[i].rtt);
+    corrected.Merge(results[i].corrected);
+  }
+
+  std::cout << "Round trip time (us): ";
+  rtt.Print(std::cout, 1000.0);
+  std::cout << "\n";
+
+  if (options.rate > 0)
+  {
+    std::cout << "Corrected for coordinated omission (us): ";
+    corrected.Print(std::cout, 1000.0);
+    std::cout << "\n";
+  }
+
+  std::cout << "Throughput: " << static_cast<long>(rtt.Count() / elapsed)
+    << " messages/sec\n";
+  return failed ? 1 : 0;
+}
+
+bool parse_benchmark_options(int argc, char* argv[],
+    benchmark_options& options)
+{
+  for (int i = 4; i < argc; i += 2)
+  {
+    if (i + 1 >= argc)
+      return false;
+
+    std::string arg(argv[i]);
+    if (arg == "--count")
+      options.count = std::atoi(argv[i + 1]);
+    else if (arg == "--window")
+      options.window = std::atoi(argv[i + 1]);
+    else if (arg == "--rate")
+      options.rate = std::atof(argv[i + 1]);
+    else if (arg == "--connections")
+      options.connections = std::atoi(argv[i + 1]);
+    else
+      return false;
+  }
+
+  if (options.count == 0 && argc > 4)
+    options.count = 1000;
+
+  return options.count >= 0 && options.window > 0 && options.rate >= 0
+    && options.connections > 0;
+}
+
+//----------------------------------------------------------------------
+
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc != 4)
+    benchmark_options options;
+    if (argc < 4 || !parse_benchmark_options(argc, argv, options))
     {
-      std::cerr << "Usage: blocking_tcp <host> <port> <message>\n";
+      std::cerr << "Usage: blocking_tcp <host> <port> <message>"
+        " [--count <n>] [--window <n>] [--rate <msgs/sec>]"
+        " [--connections <n>]\n";
       return 1;
     }
 
+    if (options.count > 0)
+      return run_benchmark(argv[1], argv[2], argv[3], options);
+
     client c;
-    c.connect(argv[1], argv[2], boost::posix_time::seconds(10));
+    c.connect(argv[1], argv[2], std::chrono::seconds(10));
 
-    boost::posix_time::ptime time_sent =
-      boost::posix_time::microsec_clock::universal_time();
+    steady_timer::time_point time_sent = steady_timer::clock_type::now();
 
-    c.write_line(argv[3], boost::posix_time::seconds(10));
+    c.write_line(argv[3], std::chrono::seconds(10));
 
     for (;;)
     {
-      std::string line = c.read_line(boost::posix_time::seconds(10));
+      std::string line = c.read_line(std::chrono::seconds(10));
 
       // Keep going until we get back the line that was sent.
       if (line == argv[3])
         break;
     }
 
-    boost::posix_time::ptime time_received =
-      boost::posix_time::microsec_clock::universal_time();
+    steady_timer::time_point time_received = steady_timer::clock_type::now();
 
     std::cout << "Round trip time: ";
-    std::cout << (time_received - time_sent).total_microseconds();
+    std::cout << std::chrono::duration_cast<std::chrono::microseconds>(
+        time_received - time_sent).count();
     std::cout << " microseconds\n";
   }
   catch (std::exception& e)
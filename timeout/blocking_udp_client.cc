@@ -8,19 +8,101 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
-#include <boost/asio/deadline_timer.hpp>
-#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/multicast.hpp>
 #include <boost/asio/ip/udp.hpp>
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <boost/bind.hpp>
-#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#if defined(__linux__)
+# include <sys/socket.h>
+#endif
+#include "../udp_protocol.h"
 
-using boost::asio::deadline_timer;
+using boost::asio::steady_timer;
 using boost::asio::ip::udp;
 
 //----------------------------------------------------------------------
 
+//
+// A preallocated pool of datagram buffers for client::receive_batch(). After a
+// batch is received, the packets from begin() to end() hold the datagrams in
+// arrival order, each with its length and sender. The buffers are reused by
+// the next batch, so packets must be consumed before receiving again.
+//
+// A datagram longer than packet_size is cut short; its packet is marked
+// truncated and must not be parsed.
+//
+class packet_batch
+{
+public:
+  struct packet
+  {
+    char* data;
+    std::size_t length;
+    bool truncated;
+    udp::endpoint sender;
+  };
+
+  // Each buffer has a byte to spare, so that without recvmmsg() a datagram
+  // that overflows packet_size can be told from one that fills it.
+  packet_batch(std::size_t capacity = 64, std::size_t packet_size = 2048)
+    : storage_(capacity * (packet_size + 1)),
+      packets_(capacity),
+      packet_size_(packet_size),
+      size_(0)
+  {
+    for (std::size_t i = 0; i < capacity; ++i)
+    {
+      packets_[i].data = &storage_[i * (packet_size + 1)];
+      packets_[i].length = 0;
+      packets_[i].truncated = false;
+    }
+
+#if defined(__linux__)
+    // The message headers point straight at the packet buffers and sender
+    // endpoints, so recvmmsg() fills them in place.
+    iovecs_.resize(capacity);
+    headers_.resize(capacity);
+    for (std::size_t i = 0; i < capacity; ++i)
+    {
+      iovecs_[i].iov_base = packets_[i].data;
+      iovecs_[i].iov_len = packet_size;
+      std::memset(&headers_[i], 0, sizeof(headers_[i]));
+      headers_[i].msg_hdr.msg_iov = &iovecs_[i];
+      headers_[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+  }
+
+  packet* begin() { return &packets_[0]; }
+  packet* end() { return &packets_[0] + size_; }
+  std::size_t size() const { return size_; }
+  std::size_t capacity() const { return packets_.size(); }
+
+private:
+  friend class client;
+
+  std::vector<char> storage_;
+  std::vector<packet> packets_;
+  std::size_t packet_size_;
+  std::size_t size_;
+#if defined(__linux__)
+  std::vector<iovec> iovecs_;
+  std::vector<mmsghdr> headers_;
+#endif
+};
+
+//----------------------------------------------------------------------
+
 //
 // This class manages socket timeouts by applying the concept of a deadline.
 // Each asynchronous operation is given a deadline by which it must complete.
@@ -51,30 +133,55 @@ using boost::asio::ip::udp;
 //                |                |
 //                +----------------+
 //
-// The client object runs the io_service to block thread execution until the
+// The client object runs the io_context to block thread execution until the
 // actor completes.
 //
+// receive_batch() avoids a reactor cycle per datagram. It first drains
+// whatever is already queued on the socket with a single non-blocking
+// recvmmsg() call, and only when the socket is empty waits for readability
+// (an async_receive() of null_buffers) under the same deadline. One wakeup
+// can therefore deliver up to a batch's capacity of datagrams.
+//
 class client
 {
 public:
   client(const udp::endpoint& listen_endpoint)
-    : socket_(io_service_, listen_endpoint),
-      deadline_(io_service_)
+    : socket_(io_context_),
+      deadline_(io_context_)
   {
+    socket_.open(listen_endpoint.protocol());
+
+    // A multicast feed may have several consumers on the same host, each
+    // binding the group's port and joining the group. The socket is bound to
+    // the wildcard address so that it can also send NACKs and receive the
+    // unicast retransmissions that answer them.
+    if (listen_endpoint.address().is_multicast())
+    {
+      socket_.set_option(udp::socket::reuse_address(true));
+      socket_.bind(udp::endpoint(listen_endpoint.protocol(),
+            listen_endpoint.port()));
+      socket_.set_option(
+          boost::asio::ip::multicast::join_group(listen_endpoint.address()));
+    }
+    else
+    {
+      socket_.bind(listen_endpoint);
+    }
+
     // No deadline is required until the first socket operation is started. We
     // set the deadline to positive infinity so that the actor takes no action
     // until a specific deadline is set.
-    deadline_.expires_at(boost::posix_time::pos_infin);
+    deadline_.expires_at(steady_timer::time_point::max());
 
     // Start the persistent actor that checks for deadline expiry.
     check_deadline();
   }
 
   std::size_t receive(const boost::asio::mutable_buffer& buffer,
-      boost::posix_time::time_duration timeout, boost::system::error_code& ec)
+      steady_timer::duration timeout, boost::system::error_code& ec)
   {
     // Set a deadline for the asynchronous operation.
-    deadline_.expires_from_now(timeout);
+    deadline_.expires_after(timeout);
 
     // Set up the variables that receive the result of the asynchronous
     // operation. The error code is set to would_block to signal that the
@@ -90,18 +197,105 @@ public:
         boost::bind(&client::handle_receive, _1, _2, &ec, &length));
 
     // Block until the asynchronous operation has completed.
-    do io_service_.run_one(); while (ec == boost::asio::error::would_block);
+    do io_context_.run_one(); while (ec == boost::asio::error::would_block);
 
     return length;
   }
 
+  std::size_t receive_batch(packet_batch& batch,
+      steady_timer::duration timeout, boost::system::error_code& ec)
+  {
+    batch.size_ = 0;
+
+    // Set a deadline for the whole batch.
+    deadline_.expires_after(timeout);
+
+    for (;;)
+    {
+      // Take whatever is already queued without blocking.
+      if (try_receive_batch(batch, ec) || ec)
+        return batch.size_;
+
+      // The socket is empty. Wait until it becomes readable or the deadline
+      // actor cancels the wait.
+      ec = boost::asio::error::would_block;
+      std::size_t length = 0;
+      socket_.async_receive(boost::asio::null_buffers(),
+          boost::bind(&client::handle_receive, _1, _2, &ec, &length));
+
+      do io_context_.run_one(); while (ec == boost::asio::error::would_block);
+
+      if (ec)
+        return 0;
+    }
+  }
+
+  void send_to(const boost::asio::const_buffer& buffer,
+      const udp::endpoint& endpoint)
+  {
+    boost::system::error_code ignored_ec;
+    socket_.send_to(boost::asio::buffer(buffer), endpoint, 0, ignored_ec);
+  }
+
 private:
+  // Receives as many datagrams as are queued, up to the batch capacity, and
+  // returns the number received. Returns 0 with ec clear if none were queued.
+  std::size_t try_receive_batch(packet_batch& batch,
+      boost::system::error_code& ec)
+  {
+    ec = boost::system::error_code();
+
+#if defined(__linux__)
+    for (std::size_t i = 0; i < batch.capacity(); ++i)
+    {
+      udp::endpoint& sender = batch.packets_[i].sender;
+      batch.headers_[i].msg_hdr.msg_name = sender.data();
+      batch.headers_[i].msg_hdr.msg_namelen = sender.capacity();
+    }
+
+    int n = ::recvmmsg(socket_.native_handle(), &batch.headers_[0],
+        batch.capacity(), MSG_DONTWAIT, 0);
+    if (n < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        ec = boost::system::error_code(errno,
+            boost::asio::error::get_system_category());
+      return 0;
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+      packet_batch::packet& p = batch.packets_[i];
+      p.length = batch.headers_[i].msg_len;
+      p.truncated = (batch.headers_[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+      p.sender.resize(batch.headers_[i].msg_hdr.msg_namelen);
+    }
+    batch.size_ = n;
+#else
+    // Without recvmmsg() a batch is at most one datagram.
+    packet_batch::packet& p = batch.packets_[0];
+    socket_.non_blocking(true);
+    p.length = socket_.receive_from(
+        boost::asio::buffer(p.data, batch.packet_size_ + 1), p.sender, 0, ec);
+    if (ec == boost::asio::error::would_block)
+      ec = boost::system::error_code();
+    else if (!ec)
+    {
+      p.truncated = p.length > batch.packet_size_;
+      p.length = std::min(p.length, batch.packet_size_);
+      batch.size_ = 1;
+    }
+#endif
+
+    return batch.size_;
+  }
+
   void check_deadline()
   {
     // Check whether the deadline has passed. We compare the deadline against
     // the current time since a new asynchronous operation may have moved the
     // deadline before this actor had a chance to run.
-    if (deadline_.expires_at() <= deadline_timer::traits_type::now())
+    if (deadline_.expiry() <= steady_timer::clock_type::now())
     {
       // The deadline has passed. The outstanding asynchronous operation needs
       // to be cancelled so that the blocked receive() function will return.
@@ -113,7 +307,7 @@ private:
 
       // There is no longer an active deadline. The expiry is set to positive
       // infinity so that the actor takes no action until a new deadline is set.
-      deadline_.expires_at(boost::posix_time::pos_infin);
+      deadline_.expires_at(steady_timer::time_point::max());
     }
 
     // Put the actor back to sleep.
@@ -129,9 +323,170 @@ private:
   }
 
 private:
-  boost::asio::io_service io_service_;
+  boost::asio::io_context io_context_;
   udp::socket socket_;
-  deadline_timer deadline_;
+  steady_timer deadline_;
+};
+
+//----------------------------------------------------------------------
+
+//
+// Puts the server's data frames back in order and recovers lost ones. A frame
+// beyond the next expected sequence number is held back and each missing
+// range is NACKed to the frame's sender, which retransmits from its replay
+// cache over unicast. NACKs are repeated every nack_interval until the gap is
+// filled; after max_nacks unanswered attempts the missing frames are reported
+// lost and delivery moves on to the held-back frames. The server's heartbeats
+// say which frame comes next, so frames lost at the end of a burst are
+// NACKed too, without waiting for the next one to arrive.
+//
+class sequencer
+{
+public:
+  sequencer(client& c, steady_timer::duration nack_interval,
+      int max_nacks)
+    : client_(c),
+      nack_interval_(nack_interval),
+      max_nacks_(max_nacks),
+      next_(0),
+      end_(0),
+      nacked_(0),
+      nacks_(0)
+  {
+  }
+
+  void on_frame(uint64_t sequence, const std::string& payload,
+      const udp::endpoint& sender)
+  {
+    sender_ = sender;
+
+    // Join the stream at whichever frame arrives first.
+    if (next_ == 0)
+      next_ = sequence;
+
+    if (sequence < next_ || pending_.count(sequence))
+      return;
+    end_ = std::max(end_, sequence + 1);
+
+    if (sequence == next_)
+    {
+      deliver(sequence, payload);
+      ++next_;
+      drain();
+    }
+    else
+    {
+      pending_[sequence] = payload;
+    }
+
+    // A new or partly filled gap is NACKed straight away.
+    if (has_gap() && nacked_ != next_)
+      send_nacks();
+  }
+
+  // A heartbeat says that the next frame the server sends will be sequence,
+  // so any before it not yet received are missing.
+  void on_heartbeat(uint64_t sequence, const udp::endpoint& sender)
+  {
+    sender_ = sender;
+    if (next_ == 0)
+      next_ = end_ = sequence;
+
+    if (sequence <= end_)
+      return;
+    end_ = sequence;
+    send_nacks();
+  }
+
+  bool has_gap() const
+  {
+    return next_ < end_;
+  }
+
+  // Called after every receive to repeat or give up on outstanding NACKs.
+  void check_timeouts()
+  {
+    if (!has_gap() || steady_timer::clock_type::now() < next_nack_)
+      return;
+
+    if (nacks_ < max_nacks_)
+    {
+      send_nacks();
+      return;
+    }
+
+    uint64_t first_held = pending_.empty() ? end_ : pending_.begin()->first;
+    std::cout << "Lost frames #" << next_ << "-#" << first_held - 1 << "\n";
+    next_ = first_held;
+    drain();
+    if (has_gap())
+      send_nacks();
+  }
+
+private:
+  void drain()
+  {
+    while (!pending_.empty() && pending_.begin()->first == next_)
+    {
+      deliver(next_, pending_.begin()->second);
+      pending_.erase(pending_.begin());
+      ++next_;
+    }
+  }
+
+  // Sends one NACK for each missing range below end_.
+  void send_nacks()
+  {
+    if (nacked_ != next_)
+    {
+      nacked_ = next_;
+      nacks_ = 0;
+    }
+
+    uint64_t missing = next_;
+    std::map<uint64_t, std::string>::const_iterator i = pending_.begin();
+    for (; i != pending_.end(); ++i)
+    {
+      send_nack(missing, i->first);
+      missing = i->first + 1;
+    }
+    send_nack(missing, end_);
+
+    ++nacks_;
+    next_nack_ = steady_timer::clock_type::now() + nack_interval_;
+  }
+
+  // NACKs the frames [first, end), 0xffff at a time.
+  void send_nack(uint64_t first, uint64_t end)
+  {
+    for (; first < end; first += 0xffff)
+    {
+      uint64_t count = std::min<uint64_t>(end - first, 0xffff);
+      FrameHeader header = { kNackFrame, uint16_t(count), first };
+      char nack[kFrameHeaderSize];
+      EncodeFrameHeader(header, nack);
+      client_.send_to(boost::asio::buffer(nack), sender_);
+    }
+  }
+
+  void deliver(uint64_t sequence, const std::string& payload)
+  {
+    std::istringstream is(payload);
+    std::string message;
+    while (std::getline(is, message))
+      std::cout << "Received #" << sequence << ": " << message << "\n";
+  }
+
+  client& client_;
+  steady_timer::duration nack_interval_;
+  int max_nacks_;
+  uint64_t next_;
+  uint64_t end_;  // One past the last frame known to have been sent.
+  uint64_t nacked_;
+  int nacks_;
+  steady_timer::time_point next_nack_;
+  udp::endpoint sender_;
+  std::map<uint64_t, std::string> pending_;
 };
 
 //----------------------------------------------------------------------
@@ -142,24 +497,108 @@ int main(int argc, char* argv[])
   {
     using namespace std; // For atoi.
 
-    if (argc != 3)
+    bool batch_mode = false;
+    double loss = 0.0;
+    bool usage = argc < 3;
+    for (int i = 3; i < argc && !usage; ++i)
     {
-      std::cerr << "Usage: blocking_udp_timeout <listen_addr> <listen_port>\n";
+      std::string arg(argv[i]);
+      if (arg == "--batch")
+        batch_mode = true;
+      else if (arg == "--loss" && i + 1 < argc)
+        loss = std::atof(argv[++i]);
+      else
+        usage = true;
+    }
+
+    if (usage)
+    {
+      std::cerr << "Usage: blocking_udp_timeout <listen_addr> <listen_port>"
+        " [--batch [--loss <fraction>]]\n";
       return 1;
     }
 
     udp::endpoint listen_endpoint(
-        boost::asio::ip::address::from_string(argv[1]),
+        boost::asio::ip::make_address(argv[1]),
         std::atoi(argv[2]));
 
     client c(listen_endpoint);
 
+    if (batch_mode)
+    {
+      packet_batch batch;
+      sequencer seq(c, std::chrono::milliseconds(20), 10);
+      uint64_t truncated = 0;
+      for (;;)
+      {
+        // While frames are missing, wake up often enough to repeat NACKs.
+        steady_timer::duration timeout =
+          std::chrono::seconds(10);
+        if (seq.has_gap())
+          timeout = std::chrono::milliseconds(20);
+
+        boost::system::error_code ec;
+        c.receive_batch(batch, timeout, ec);
+        seq.check_timeouts();
+
+        if (ec == boost::asio::error::operation_aborted && seq.has_gap())
+          continue;
+
+        if (ec)
+        {
+          std::cout << "Receive error: " << ec.message() << "\n";
+          continue;
+        }
+
+        for (packet_batch::packet* p = batch.begin(); p != batch.end(); ++p)
+        {
+          // Parsing what is left of a cut short frame would deliver part of
+          // it as if it were whole. Dropping it leaves a gap that is NACKed.
+          if (p->truncated)
+          {
+            ++truncated;
+            std::cout << "Dropped truncated datagram from " << p->sender
+              << " (" << truncated << " so far)\n";
+            continue;
+          }
+
+          // Frames from the server's UDP fan-out pack several newline
+          // terminated messages behind a header; anything else is printed
+          // as it is.
+          FrameHeader header;
+          if (DecodeFrameHeader(p->data, p->length, header)
+              && header.type == kDataFrame)
+          {
+            // Simulated loss, to exercise recovery.
+            if (loss > 0 && std::rand() < loss * RAND_MAX)
+              continue;
+
+            seq.on_frame(header.sequence,
+                std::string(p->data + kFrameHeaderSize,
+                  p->length - kFrameHeaderSize), p->sender);
+            continue;
+          }
+
+          if (DecodeFrameHeader(p->data, p->length, header)
+              && header.type == kHeartbeatFrame)
+          {
+            seq.on_heartbeat(header.sequence, p->sender);
+            continue;
+          }
+
+          std::cout << "Received from " << p->sender << ": ";
+          std::cout.write(p->data, p->length);
+          std::cout << "\n";
+        }
+      }
+    }
+
     for (;;)
     {
       char data[1024];
       boost::system::error_code ec;
       std::size_t n = c.receive(boost::asio::buffer(data),
-          boost::posix_time::seconds(10), ec);
+          std::chrono::seconds(10), ec);
 
       if (ec)
       {
@@ -16,15 +16,15 @@
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
-#include <boost/asio/deadline_timer.hpp>
-#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
 //#include <boost/asio/ip/udp.hpp>
 #include <boost/asio/read_until.hpp>
 #include <boost/asio/streambuf.hpp>
 #include <boost/asio/write.hpp>
 
-using boost::asio::deadline_timer;
+using boost::asio::steady_timer;
 using boost::asio::ip::tcp;
 //using boost::asio::ip::udp;
 
@@ -124,8 +124,8 @@ private:
 //  +-------------+               +--------------+
 //
 // The output actor first waits for an output message to be enqueued. It does
-// this by using a deadline_timer as an asynchronous condition variable. The
-// deadline_timer will be signalled whenever the output queue is non-empty.
+// this by using a steady_timer as an asynchronous condition variable. The
+// steady_timer will be signalled whenever the output queue is non-empty.
 //
 // Once a message is available, it is sent to the client. The deadline for
 // sending a complete message is 30 seconds. After the message is successfully
@@ -136,22 +136,22 @@ class tcp_session
     public boost::enable_shared_from_this<tcp_session>
 {
 public:
-  tcp_session(boost::asio::io_service& io_service, channel& ch)
+  tcp_session(boost::asio::io_context& io_context, channel& ch)
     : channel_(ch),
-      socket_(io_service),
-      input_deadline_(io_service),
-      non_empty_output_queue_(io_service),
-      output_deadline_(io_service)
+      socket_(io_context),
+      input_deadline_(io_context),
+      non_empty_output_queue_(io_context),
+      output_deadline_(io_context)
   {
     std::cout << this << " tcp_session::tcp::session() lower flags)\n";
 
-    input_deadline_.expires_at(boost::posix_time::pos_infin);
-    output_deadline_.expires_at(boost::posix_time::pos_infin);
+    input_deadline_.expires_at(steady_timer::time_point::max());
+    output_deadline_.expires_at(steady_timer::time_point::max());
 
-    // The non_empty_output_queue_ deadline_timer is set to pos_infin whenever
-    // the output queue is empty. This ensures that the output actor stays
-    // asleep until a message is put into the queue.
-    non_empty_output_queue_.expires_at(boost::posix_time::pos_infin);
+    // The non_empty_output_queue_ steady_timer is set to time_point::max()
+    // whenever the output queue is empty. This ensures that the output actor
+    // stays asleep until a message is put into the queue.
+    non_empty_output_queue_.expires_at(steady_timer::time_point::max());
   }
 
   tcp::socket& socket()
@@ -203,14 +203,14 @@ private:
 
     // Signal that the output queue contains messages. Modifying the expiry
     // will wake the output actor, if it is waiting on the timer.
-    non_empty_output_queue_.expires_at(boost::posix_time::neg_infin);
+    non_empty_output_queue_.expires_at(steady_timer::time_point::min());
   }
 
   void start_read()
   {
     std::cout << "tcp_session::start_read() raise input_deadline(30), read_until(handle_read)\n";
     // Set a deadline for the read operation.
-    input_deadline_.expires_from_now(boost::posix_time::seconds(30));
+    input_deadline_.expires_after(std::chrono::seconds(30));
 
     // Start an asynchronous operation to read a newline-delimited message.
     boost::asio::async_read_until(socket_, input_buffer_, '\n',
@@ -246,7 +246,7 @@ private:
 
           // Signal that the output queue contains messages. Modifying the
           // expiry will wake the output actor, if it is waiting on the timer.
-          non_empty_output_queue_.expires_at(boost::posix_time::neg_infin);
+          non_empty_output_queue_.expires_at(steady_timer::time_point::min());
         }
       }
 
@@ -269,7 +269,7 @@ private:
       // There are no messages that are ready to be sent. The actor goes to
       // sleep by waiting on the non_empty_output_queue_ timer. When a new
       // message is added, the timer will be modified and the actor will wake.
-      non_empty_output_queue_.expires_at(boost::posix_time::pos_infin);
+      non_empty_output_queue_.expires_at(steady_timer::time_point::max());
       non_empty_output_queue_.async_wait(
           boost::bind(&tcp_session::await_output, shared_from_this()));
     }
@@ -283,7 +283,7 @@ private:
   {
     std::cout << "tcp_session::start_write() raise out-dl, async_write(oq.front(), handle_write)\n";
     // Set a deadline for the write operation.
-    output_deadline_.expires_from_now(boost::posix_time::seconds(30));
+    output_deadline_.expires_after(std::chrono::seconds(30));
 
     // Start an asynchronous operation to send a message.
     boost::asio::async_write(socket_,
@@ -309,7 +309,7 @@ private:
     }
   }
 
-  void check_deadline(deadline_timer* deadline)
+  void check_deadline(steady_timer* deadline)
   {
     std::cout << "tcp_session::check_deadline(dl*) recheck deadline now incase moved, stop if expired, else wait\n";
 
@@ -319,7 +319,7 @@ private:
     // Check whether the deadline has passed. We compare the deadline against
     // the current time since a new asynchronous operation may have moved the
     // deadline before this actor had a chance to run.
-    if (deadline->expires_at() <= deadline_timer::traits_type::now())
+    if (deadline->expiry() <= steady_timer::clock_type::now())
     {
       // The deadline has passed. Stop the session. The other actors will
       // terminate as soon as possible.
@@ -337,10 +337,10 @@ private:
   channel& channel_;
   tcp::socket socket_;
   boost::asio::streambuf input_buffer_;
-  deadline_timer input_deadline_;
+  steady_timer input_deadline_;
   std::deque<std::string> output_queue_;
-  deadline_timer non_empty_output_queue_;
-  deadline_timer output_deadline_;
+  steady_timer non_empty_output_queue_;
+  steady_timer output_deadline_;
 };
 
 typedef boost::shared_ptr<tcp_session> tcp_session_ptr;
@@ -351,9 +351,9 @@ typedef boost::shared_ptr<tcp_session> tcp_session_ptr;
   : public subscriber
 {
 public:
-  udp_broadcaster(boost::asio::io_service& io_service,
+  udp_broadcaster(boost::asio::io_context& io_context,
       const udp::endpoint& broadcast_endpoint)
-    : socket_(io_service)
+    : socket_(io_context)
   {
     socket_.connect(broadcast_endpoint);
   }
@@ -373,14 +373,14 @@ private:
 class server
 {
 public:
-  server(boost::asio::io_service& io_service,
+  server(boost::asio::io_context& io_context,
       const tcp::endpoint& listen_endpoint/*,
       const udp::endpoint& broadcast_endpoint*/)
-    : io_service_(io_service),
-      acceptor_(io_service, listen_endpoint)
+    : io_context_(io_context),
+      acceptor_(io_context, listen_endpoint)
   {
     std::cout << "server::server() start_accept\n";
-    //subscriber_ptr bc(new udp_broadcaster(io_service_, broadcast_endpoint));
+    //subscriber_ptr bc(new udp_broadcaster(io_context_, broadcast_endpoint));
     //channel_.join(bc);
 
     start_accept();
@@ -389,7 +389,7 @@ public:
   void start_accept()
   {
     std::cout << "server::start_accept() ptr = new_session, async_accept(handle_accept)\n";
-    tcp_session_ptr new_session(new tcp_session(io_service_, channel_));
+    tcp_session_ptr new_session(new tcp_session(io_context_, channel_));
 
     acceptor_.async_accept(new_session->socket(),
         boost::bind(&server::handle_accept, this, new_session, _1));
@@ -414,7 +414,7 @@ public:
   }
 
 private:
-  boost::asio::io_service& io_service_;
+  boost::asio::io_context& io_context_;
   tcp::acceptor acceptor_;
   channel channel_;
 };
@@ -423,7 +423,7 @@ private:
 
 int main(int argc, char* argv[])
 {
-  std::cout << "main() server(io_service, endpoint); service.run()\n";
+  std::cout << "main() server(io_context, endpoint); service.run()\n";
   try
   {
     using namespace std; // For atoi.
@@ -434,24 +434,25 @@ int main(int argc, char* argv[])
       return 1;
     }
 
-    boost::asio::io_service io_service;
+    boost::asio::io_context io_context;
 
     tcp::endpoint listen_endpoint(tcp::v4(), atoi(argv[1]));
 
     /*udp::endpoint broadcast_endpoint(
-        boost::asio::ip::address::from_string(argv[2]), atoi(argv[3]));*/
+        boost::asio::ip::make_address(argv[2]), atoi(argv[3]));*/
 
-    server s(io_service, listen_endpoint/*, broadcast_endpoint*/);
+    server s(io_context, listen_endpoint/*, broadcast_endpoint*/);
 
-    std::thread t([&](){ io_service.run(); });
+    std::thread t([&](){ io_context.run(); });
     std::string abc("abc");
     for (;;) {
-      io_service.post(boost::bind(&server::publish_message, &s, abc));
+      boost::asio::post(io_context,
+          boost::bind(&server::publish_message, &s, abc));
       sleep(1);
     }
 
     t.join();
-    //io_service.run();
+    //io_context.run();
   }
   catch (std::exception& e)
   {
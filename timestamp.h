@@ -0,0 +1,44 @@
+#ifndef TIMESTAMP_H_
+#define TIMESTAMP_H_
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+// Messages published in timestamping mode carry the publish time as a prefix,
+// "@<nanoseconds since epoch> <payload>". The wall clock is used so that the
+// stamp can be compared across processes on the same host (or hosts with
+// synchronised clocks).
+
+inline int64_t WallClockNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Builds the stamped message in stamped, reusing its capacity, so that a
+// caller that keeps stamped allocates nothing once it has grown.
+inline void Stamp(const std::string& msg, std::string& stamped) {
+  char prefix[24];
+  int length = std::snprintf(prefix, sizeof(prefix), "@%lld ",
+                             static_cast<long long>(WallClockNs()));
+  stamped.assign(prefix, length).append(msg);
+}
+
+// Splits a stamped line into its publish time and the offset of the payload.
+// Returns false, leaving the outputs untouched, if the line is not stamped.
+inline bool Unstamp(const std::string& line, int64_t& stamp_ns,
+                    std::size_t& payload) {
+  if (line.size() < 2 || line[0] != '@') return false;
+
+  char* end = 0;
+  long long ns = std::strtoll(line.c_str() + 1, &end, 10);
+  if (end == line.c_str() + 1 || *end != ' ') return false;
+
+  stamp_ns = ns;
+  payload = end + 1 - line.c_str();
+  return true;
+}
+
+#endif  // TIMESTAMP_H_
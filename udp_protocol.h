@@ -0,0 +1,91 @@
+#ifndef UDP_PROTOCOL_H_
+#define UDP_PROTOCOL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Datagram framing for UDP fan-out. Every datagram starts with a 12 byte
+// header in network byte order:
+//
+//   type:u8  reserved:u8  count:u16  sequence:u64
+//
+// A data frame carries count messages, each terminated by '\n' as on the TCP
+// sessions, and sequence numbers data frames consecutively from 1 so that
+// receivers can detect loss.
+//
+// A NACK frame is a bare header sent by a receiver back to the sender's
+// unicast address, asking for the count data frames starting at sequence to
+// be retransmitted.
+//
+// A heartbeat frame is a bare header that the sender sends to the group while
+// it has nothing to send, whose sequence is that of the next data frame. It
+// lets receivers NACK the last frames sent before a quiet spell, which no
+// later data frame would show to be missing.
+//
+// Reliable unicast sessions (udp_session.h) reuse data frames with a per
+// session sequence and add two frames sent by the receiver:
+//
+//   hello  opens a session (and keeps retrying until data arrives). The
+//          server answers a hello whose sequence is not a valid cookie for
+//          the sender's address with a hello carrying one; the session opens
+//          when the receiver says hello again with that cookie, which shows
+//          that it receives at the address it claims. A hello to an open
+//          session keeps it alive.
+//   ack    sequence is the next in-order frame expected; count selective ack
+//          blocks follow, each a pair of u64 [start, end) ranges of frames
+//          held out of order. Acks also serve as the receiver's heartbeat.
+
+enum { kFrameHeaderSize = 12 };
+
+enum FrameType {
+  kDataFrame = 1,
+  kNackFrame = 2,
+  kHelloFrame = 3,
+  kAckFrame = 4,
+  kHeartbeatFrame = 5
+};
+
+enum { kAckBlockSize = 16, kMaxAckBlocks = 16 };
+
+struct FrameHeader {
+  uint8_t type;
+  uint16_t count;
+  uint64_t sequence;
+};
+
+inline void EncodeU64(uint64_t value, char* out) {
+  unsigned char* p = reinterpret_cast<unsigned char*>(out);
+  for (int i = 0; i < 8; ++i)
+    p[i] = uint8_t(value >> (56 - 8 * i));
+}
+
+inline uint64_t DecodeU64(const char* data) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i)
+    value = value << 8 | p[i];
+  return value;
+}
+
+inline void EncodeFrameHeader(const FrameHeader& header, char* out) {
+  unsigned char* p = reinterpret_cast<unsigned char*>(out);
+  p[0] = header.type;
+  p[1] = 0;
+  p[2] = uint8_t(header.count >> 8);
+  p[3] = uint8_t(header.count);
+  EncodeU64(header.sequence, out + 4);
+}
+
+// Returns false if the datagram is too short to hold a header.
+inline bool DecodeFrameHeader(const char* data, std::size_t length,
+                              FrameHeader& header) {
+  if (length < kFrameHeaderSize) return false;
+
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  header.type = p[0];
+  header.count = uint16_t(p[2] << 8 | p[3]);
+  header.sequence = DecodeU64(data + 4);
+  return true;
+}
+
+#endif  // UDP_PROTOCOL_H_
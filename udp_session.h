@@ -0,0 +1,472 @@
+#ifndef UDP_SESSION_H_
+#define UDP_SESSION_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/intrusive_ptr.hpp>
+
+#include "metrics.h"
+#include "server.h"
+#include "udp_protocol.h"
+
+// A reliable datagram session, an alternative to TcpSession for subscribers
+// on high RTT links where a single lost segment would stall every message
+// queued behind it. Messages are packed into sequenced data frames (see
+// udp_protocol.h); the receiver acks cumulatively with selective ack blocks,
+// so one loss delays only the frames it carries.
+//
+// Sending is governed by a congestion window in frames, grown in slow start
+// and congestion avoidance and halved at most once per window on loss, and
+// new frames are paced at roughly cwnd frames per smoothed RTT rather than
+// sent in bursts. A frame is declared lost once kDupThreshold later frames
+// have been acked, or when the retransmission timer (RFC 6298 estimator,
+// exponential backoff) expires.
+//
+// Every session of a UdpListener shares its socket. A session that hears
+// nothing from its receiver for 30 seconds expires, like a TcpSession whose
+// read deadline passes. Messages waiting for the window are bounded by the
+// session limits' max_queue, beyond which the slow-consumer policy drops the
+// oldest waiting frame or expires the session.
+class UdpSession;
+typedef boost::intrusive_ptr<UdpSession> UdpSessionPtr;
+
+class UdpSession : public Subscriber {
+ public:
+  UdpSession(const asio::io_context::executor_type& executor,
+             udp::socket& socket,
+             const udp::endpoint& peer, Metrics& metrics,
+             const SessionLimits& limits, double loss,
+             std::size_t max_datagram = 1472)
+    : socket_(socket),
+      peer_(peer),
+      metrics_(metrics),
+      limits_(limits),
+      loss_(loss),
+      max_datagram_(max_datagram),
+      pending_messages_(0),
+      next_sequence_(1),
+      highest_acked_(0),
+      recovery_point_(0),
+      cwnd_(kInitialWindow),
+      ssthresh_(1e9),
+      srtt_(0),
+      rttvar_(0),
+      rto_(std::chrono::milliseconds(200)),
+      pacing_timer_(executor),
+      rto_timer_(executor),
+      rto_armed_(false),
+      pacing_armed_(false),
+      disconnecting_(false),
+      last_heard_(Clock::now()) {
+  }
+
+  void Deliver(const std::string& msg) {
+    if (disconnecting_) return;
+
+    if (limits_.max_queue && pending_messages_ >= limits_.max_queue) {
+      ServerStats& stats = metrics_.Local();
+      if (limits_.policy == kDisconnect) {
+        // Leaves the channel when the listener next sweeps, as Deliver is
+        // called while the channel iterates its subscribers.
+        disconnecting_ = true;
+        stats.slow_consumer_disconnects.Add(1);
+        return;
+      }
+
+      // Messages are queued packed into frames, so the oldest frame goes.
+      stats.slow_consumer_drops.Add(pending_counts_.front());
+      pending_messages_ -= pending_counts_.front();
+      pending_.pop_front();
+      pending_counts_.pop_front();
+    }
+
+    if (pending_.empty() ||
+        pending_.back().size() + msg.size() + 1 > max_datagram_ ||
+        pending_counts_.back() == 0xffff) {
+      pending_.push_back(std::string(kFrameHeaderSize, '\0'));
+      pending_counts_.push_back(0);
+    }
+    pending_.back().append(msg).push_back('\n');
+    ++pending_counts_.back();
+    ++pending_messages_;
+
+    TrySend();
+  }
+
+  void HandleAck(const char* data, std::size_t length) {
+    FrameHeader header;
+    if (!DecodeFrameHeader(data, length, header)) return;
+
+    last_heard_ = Clock::now();
+    Clock::time_point now = last_heard_;
+    AckBelow(header.sequence, now);
+
+    std::size_t blocks = std::min<std::size_t>(
+        header.count, (length - kFrameHeaderSize) / kAckBlockSize);
+    for (std::size_t i = 0; i < blocks; ++i) {
+      const char* block = data + kFrameHeaderSize + i * kAckBlockSize;
+      uint64_t start = DecodeU64(block);
+      uint64_t end = DecodeU64(block + 8);
+      AckRange(start, end, now);
+    }
+
+    DetectLosses(now);
+    TrySend();
+  }
+
+  void Heard() {
+    last_heard_ = Clock::now();
+  }
+
+  bool Expired() const {
+    return disconnecting_ ||
+           Clock::now() - last_heard_ > std::chrono::seconds(30);
+  }
+
+  void Stop() {
+    pacing_timer_.cancel();
+    rto_timer_.cancel();
+  }
+
+ private:
+  enum { kInitialWindow = 10, kMaxWindow = 10000, kDupThreshold = 3 };
+
+  static Clock::duration MinRto() { return std::chrono::milliseconds(20); }
+  static Clock::duration MaxRto() { return std::chrono::seconds(5); }
+
+  struct Sent {
+    std::string frame;
+    Clock::time_point sent;
+    bool retransmitted;
+  };
+
+  // Sends queued frames while the window is open, one per pacing interval.
+  void TrySend() {
+    Clock::time_point now = Clock::now();
+    while (!pending_.empty() && in_flight_.size() < std::size_t(cwnd_)) {
+      if (now < next_send_) {
+        ArmPacing(next_send_ - now);
+        return;
+      }
+
+      uint64_t sequence = next_sequence_++;
+      FrameHeader header = { kDataFrame, pending_counts_.front(), sequence };
+      EncodeFrameHeader(header, &pending_.front()[0]);
+
+      Sent& sent = in_flight_[sequence];
+      sent.frame.swap(pending_.front());
+      sent.sent = now;
+      sent.retransmitted = false;
+      pending_messages_ -= pending_counts_.front();
+      pending_.pop_front();
+      pending_counts_.pop_front();
+
+      Transmit(sent.frame);
+      metrics_.Local().rudp_frames_sent.Add(1);
+      next_send_ = now + PacingInterval();
+    }
+
+    ArmRto();
+  }
+
+  // Pace at 1.25 x cwnd frames per smoothed RTT; before the first RTT sample
+  // the initial window is sent unpaced.
+  Clock::duration PacingInterval() const {
+    if (srtt_ == Clock::duration(0)) return Clock::duration(0);
+    return Clock::duration(
+        Clock::duration::rep(srtt_.count() / (1.25 * cwnd_)));
+  }
+
+  void Transmit(const std::string& frame) {
+    // Simulated loss, to exercise recovery over loopback.
+    if (loss_ > 0 && std::rand() < loss_ * RAND_MAX) return;
+
+    error_code ignored_ec;
+    socket_.send_to(asio::buffer(frame), peer_, 0, ignored_ec);
+  }
+
+  void Retransmit(Sent& sent, Clock::time_point now) {
+    sent.sent = now;
+    sent.retransmitted = true;
+    Transmit(sent.frame);
+    metrics_.Local().rudp_retransmits.Add(1);
+  }
+
+  void AckBelow(uint64_t cumulative, Clock::time_point now) {
+    while (!in_flight_.empty() && in_flight_.begin()->first < cumulative)
+      Acked(in_flight_.begin(), now);
+  }
+
+  void AckRange(uint64_t start, uint64_t end, Clock::time_point now) {
+    std::map<uint64_t, Sent>::iterator i = in_flight_.lower_bound(start);
+    while (i != in_flight_.end() && i->first < end)
+      Acked(i++, now);
+  }
+
+  void Acked(std::map<uint64_t, Sent>::iterator i, Clock::time_point now) {
+    // Karn's algorithm: only frames sent once give an unambiguous RTT.
+    if (!i->second.retransmitted)
+      SampleRtt(now - i->second.sent);
+
+    highest_acked_ = std::max(highest_acked_, i->first);
+    in_flight_.erase(i);
+
+    if (cwnd_ < ssthresh_)
+      cwnd_ += 1;
+    else
+      cwnd_ += 1 / cwnd_;
+    cwnd_ = std::min(cwnd_, double(kMaxWindow));
+  }
+
+  void SampleRtt(Clock::duration rtt) {
+    if (srtt_ == Clock::duration(0)) {
+      srtt_ = rtt;
+      rttvar_ = rtt / 2;
+    } else {
+      Clock::duration delta = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+      rttvar_ = (3 * rttvar_ + delta) / 4;
+      srtt_ = (7 * srtt_ + rtt) / 8;
+    }
+    rto_ = std::min(std::max(srtt_ + 4 * rttvar_, MinRto()), MaxRto());
+  }
+
+  // Frames kDupThreshold or more below the highest acked frame are lost.
+  void DetectLosses(Clock::time_point now) {
+    bool lost = false;
+    std::map<uint64_t, Sent>::iterator i = in_flight_.begin();
+    for (; i != in_flight_.end() && i->first + kDupThreshold <= highest_acked_;
+         ++i) {
+      // Give a retransmission a round trip before declaring it lost again.
+      if (i->second.retransmitted && now - i->second.sent < srtt_) continue;
+      Retransmit(i->second, now);
+      if (i->first > recovery_point_) lost = true;
+    }
+
+    if (lost) {
+      ssthresh_ = std::max(cwnd_ / 2, 2.0);
+      cwnd_ = ssthresh_;
+      recovery_point_ = next_sequence_ - 1;
+    }
+  }
+
+  void ArmPacing(Clock::duration delay) {
+    if (pacing_armed_) return;
+    pacing_armed_ = true;
+    pacing_timer_.expires_after(delay);
+    pacing_timer_.async_wait(
+        bind(&UdpSession::HandlePacing, UdpSessionPtr(this), _1));
+  }
+
+  void HandlePacing(const error_code& ec) {
+    pacing_armed_ = false;
+    if (!ec) TrySend();
+  }
+
+  void ArmRto() {
+    if (rto_armed_ || in_flight_.empty()) return;
+    rto_armed_ = true;
+    rto_timer_.expires_after(rto_);
+    rto_timer_.async_wait(
+        bind(&UdpSession::HandleRto, UdpSessionPtr(this), _1));
+  }
+
+  // The oldest frame has gone unacked for a full RTO: retransmit everything
+  // that has timed out, collapse the window and back off.
+  void HandleRto(const error_code& ec) {
+    rto_armed_ = false;
+    if (ec) return;
+
+    Clock::time_point now = Clock::now();
+    bool timed_out = false;
+    std::map<uint64_t, Sent>::iterator i = in_flight_.begin();
+    for (; i != in_flight_.end(); ++i) {
+      if (now - i->second.sent < rto_) continue;
+      Retransmit(i->second, now);
+      timed_out = true;
+    }
+
+    if (timed_out) {
+      metrics_.Local().rudp_timeouts.Add(1);
+      ssthresh_ = std::max(cwnd_ / 2, 2.0);
+      cwnd_ = 1;
+      recovery_point_ = next_sequence_ - 1;
+      rto_ = std::min(rto_ * 2, MaxRto());
+    }
+
+    ArmRto();
+  }
+
+  udp::socket& socket_;
+  udp::endpoint peer_;
+  Metrics& metrics_;
+  SessionLimits limits_;
+  double loss_;
+  std::size_t max_datagram_;
+  std::deque<std::string> pending_;
+  std::deque<uint16_t> pending_counts_;
+  std::size_t pending_messages_;
+  std::map<uint64_t, Sent> in_flight_;
+  uint64_t next_sequence_;
+  uint64_t highest_acked_;
+  uint64_t recovery_point_;
+  double cwnd_;
+  double ssthresh_;
+  Clock::duration srtt_;
+  Clock::duration rttvar_;
+  Clock::duration rto_;
+  Clock::time_point next_send_;
+  steady_timer pacing_timer_;
+  steady_timer rto_timer_;
+  bool rto_armed_;
+  bool pacing_armed_;
+  bool disconnecting_;
+  Clock::time_point last_heard_;
+};
+
+// Accepts reliable UDP sessions on one socket. A hello from a new endpoint
+// is answered with a cookie (see udp_protocol.h), and a hello bearing a
+// valid one creates a session, which is caught up from the server's cache
+// and joins the channel. Cookies are stateless, so a flood of forged hellos
+// costs no memory and replays no history to the forged addresses. Acks are
+// routed to the session for their source endpoint. Expired sessions are
+// swept once a second.
+class UdpListener {
+ public:
+  UdpListener(const asio::io_context::executor_type& executor,
+              const udp::endpoint& listen_endpoint,
+              Server& server, Metrics& metrics, double loss = 0.0)
+    : executor_(executor),
+      socket_(executor, listen_endpoint),
+      server_(server),
+      metrics_(metrics),
+      loss_(loss),
+      sweep_timer_(executor) {
+    std::random_device random;
+    for (uint64_t& word : secret_)
+      word = uint64_t(random()) << 32 | random();
+    StartReceive();
+    StartSweep();
+  }
+
+ private:
+  typedef std::map<udp::endpoint, UdpSessionPtr> SessionMap;
+
+  // Seconds for which a cookie is issued; one from the previous period is
+  // still accepted.
+  enum { kCookieSecs = 30 };
+
+  void StartReceive() {
+    socket_.async_receive_from(asio::buffer(buffer_), sender_,
+        bind(&UdpListener::HandleReceive, this, _1, _2));
+  }
+
+  void HandleReceive(const error_code& ec, std::size_t length) {
+    if (ec == asio::error::operation_aborted) return;
+
+    FrameHeader header;
+    if (!ec && DecodeFrameHeader(buffer_, length, header)) {
+      SessionMap::iterator i = sessions_.find(sender_);
+      if (header.type == kHelloFrame && i != sessions_.end()) {
+        i->second->Heard();
+      } else if (header.type == kHelloFrame && !ValidCookie(header.sequence)) {
+        SendCookie();
+      } else if (header.type == kHelloFrame) {
+        UdpSessionPtr session(new UdpSession(executor_, socket_, sender_,
+                                             metrics_,
+                                             server_.session_limits(),
+                                             loss_));
+        sessions_[sender_] = session;
+        metrics_.Local().rudp_sessions_opened.Add(1);
+        server_.CatchUp(*session);
+        server_.Join(session);
+      } else if (header.type == kAckFrame && i != sessions_.end()) {
+        i->second->HandleAck(buffer_, length);
+      }
+    }
+
+    StartReceive();
+  }
+
+  static int64_t CookiePeriod() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        Clock::now().time_since_epoch()).count() / kCookieSecs;
+  }
+
+  static uint64_t Mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  // A keyed hash of sender_'s address and the period, never zero.
+  uint64_t Cookie(int64_t period) const {
+    const unsigned char* p =
+        static_cast<const unsigned char*>(static_cast<const void*>(
+            sender_.data()));
+    uint64_t h = Mix(secret_[0] ^ uint64_t(period));
+    for (std::size_t i = 0; i < sender_.size(); ++i)
+      h = Mix(h ^ p[i]);
+    return Mix(h ^ secret_[1]) | 1;
+  }
+
+  bool ValidCookie(uint64_t cookie) const {
+    int64_t period = CookiePeriod();
+    return cookie == Cookie(period) || cookie == Cookie(period - 1);
+  }
+
+  // The reply is no larger than the hello, so it amplifies nothing.
+  void SendCookie() {
+    char frame[kFrameHeaderSize];
+    FrameHeader header = { kHelloFrame, 0, Cookie(CookiePeriod()) };
+    EncodeFrameHeader(header, frame);
+
+    error_code ignored_ec;
+    socket_.send_to(asio::buffer(frame), sender_, 0, ignored_ec);
+  }
+
+  void StartSweep() {
+    sweep_timer_.expires_after(std::chrono::seconds(1));
+    sweep_timer_.async_wait(bind(&UdpListener::HandleSweep, this, _1));
+  }
+
+  void HandleSweep(const error_code& ec) {
+    if (ec) return;
+
+    for (SessionMap::iterator i = sessions_.begin(); i != sessions_.end();) {
+      if (i->second->Expired()) {
+        metrics_.Local().rudp_sessions_expired.Add(1);
+        server_.Leave(i->second);
+        i->second->Stop();
+        sessions_.erase(i++);
+      } else {
+        ++i;
+      }
+    }
+
+    StartSweep();
+  }
+
+  asio::io_context::executor_type executor_;
+  udp::socket socket_;
+  Server& server_;
+  Metrics& metrics_;
+  double loss_;
+  steady_timer sweep_timer_;
+  char buffer_[kFrameHeaderSize + kMaxAckBlocks * kAckBlockSize];
+  udp::endpoint sender_;
+  SessionMap sessions_;
+  uint64_t secret_[2];
+};
+
+#endif  // UDP_SESSION_H_
@@ -0,0 +1,418 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <boost/asio/execution_context.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/system/system_error.hpp>
+
+#include "metrics.h"
+
+// An io_uring engine for one io_context, which sessions built with
+// SESSION_IO_URING use for their reads and writes in place of asio's epoll
+// reactor. It talks to the kernel directly rather than through liburing:
+//
+// - Each session has one multishot receive outstanding for its lifetime,
+//   drawing buffers from a ring of provided buffers, so reading takes no
+//   system call per read and no re-arming.
+// - Writes are sends from registered buffers: a session gathers as much of
+//   its output queue as fits into a fixed slot and sends it with one
+//   operation. Without a free slot it sends straight from its queue.
+// - Submissions accumulate over a turn of the io_context and are submitted
+//   together by one io_uring_enter, covering every session on the thread.
+// - The ring's descriptor is itself watched by the io_context's reactor, so
+//   timers, accepts and the rest of asio carry on as before.
+//
+// The io_context must be run by one thread, as the engine's rings are used
+// without locks.
+class UringOp {
+ public:
+  // result is the operation's return value or -errno; flags are the CQE's.
+  virtual void Complete(int result, uint32_t flags) = 0;
+
+ protected:
+  ~UringOp() {}
+};
+
+inline boost::system::system_error UringError(const char* what, int error) {
+  return boost::system::system_error(
+      boost::system::error_code(error, boost::system::system_category()),
+      what);
+}
+
+class Uring
+    : public boost::asio::detail::execution_context_service_base<Uring> {
+ public:
+  enum {
+    kEntries = 4096,         // Submission queue; completions get four times.
+    kRecvBuffers = 4096,     // Provided receive buffers, shared by sessions.
+    kRecvBufferSize = 2048,
+    kWriteSlots = 256,       // Registered write buffers.
+    kWriteSlotSize = 64 * 1024,
+    kRecvGroup = 0
+  };
+
+  explicit Uring(boost::asio::io_context& io_context)
+    : boost::asio::detail::execution_context_service_base<Uring>(io_context),
+      io_context_(io_context),
+      descriptor_(io_context),
+      sq_ring_(0), cq_ring_(0), sqes_(0),
+      sq_ring_size_(0), cq_ring_size_(0),
+      sq_tail_(0), sq_submitted_(0),
+      buf_ring_(0), buf_ring_tail_(0), recv_buffers_(0),
+      write_buffers_(std::size_t(kWriteSlots) * kWriteSlotSize),
+      fixed_writes_(false),
+      flush_pending_(false) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * kEntries;
+    int fd = ::syscall(__NR_io_uring_setup, kEntries, &params);
+    if (fd < 0) throw UringError("io_uring_setup", errno);
+    descriptor_.assign(fd);
+
+    MapRings(params);
+    SetUpRecvBuffers();
+    SetUpWriteSlots();
+    Wait();
+  }
+
+  ~Uring() {
+    if (recv_buffers_) ::munmap(recv_buffers_, RecvBuffersSize());
+    if (buf_ring_) ::munmap(buf_ring_, BufRingSize());
+    if (sqes_) ::munmap(sqes_, sq_entries_ * sizeof(io_uring_sqe));
+    if (cq_ring_ && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_) ::munmap(sq_ring_, sq_ring_size_);
+  }
+
+  void shutdown() {
+    boost::system::error_code ignored_ec;
+    descriptor_.close(ignored_ec);
+  }
+
+  // Starts a multishot receive on fd into provided buffers. op completes
+  // once per chunk received, with IORING_CQE_F_MORE set until the receive
+  // ends; the chunk is RecvBuffer(flags) and must be released.
+  void Receive(int fd, UringOp* op) {
+    io_uring_sqe* sqe = Sqe(IORING_OP_RECV, fd, op);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kRecvGroup;
+  }
+
+  const char* RecvBuffer(uint32_t flags) const {
+    return &recv_buffers_[BufferId(flags) * std::size_t(kRecvBufferSize)];
+  }
+
+  // Hands a completion's receive buffer back to the kernel.
+  void ReleaseRecvBuffer(uint32_t flags) {
+    AddRecvBuffer(BufferId(flags));
+    PublishRecvBuffers();
+  }
+
+  // A registered write buffer of kWriteSlotSize bytes, or -1 if none is
+  // free.
+  int AcquireSlot() {
+    if (free_slots_.empty()) return -1;
+    int slot = free_slots_.back();
+    free_slots_.pop_back();
+    return slot;
+  }
+
+  char* Slot(int slot) {
+    return &write_buffers_[std::size_t(slot) * kWriteSlotSize];
+  }
+
+  void ReleaseSlot(int slot) {
+    free_slots_.push_back(slot);
+  }
+
+  // Sends length bytes from data, which lies in slot unless slot is -1.
+  void Send(int fd, const char* data, std::size_t length, int slot,
+            UringOp* op) {
+    io_uring_sqe* sqe = Sqe(IORING_OP_SEND, fd, op);
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    if (slot >= 0 && fixed_writes_) {
+      sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+      sqe->buf_index = slot;
+    }
+  }
+
+  // Cancels op's outstanding operations; each completes with -ECANCELED
+  // unless it finishes first.
+  void Cancel(UringOp* op) {
+    io_uring_sqe* sqe = Sqe(IORING_OP_ASYNC_CANCEL, -1, 0);
+    sqe->addr = reinterpret_cast<uint64_t>(op);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+  }
+
+  // Whether sends from the write slots use them as registered buffers.
+  bool fixed_writes() const { return fixed_writes_; }
+
+  // System calls made, operations submitted and completions reaped.
+  const Counter& enters() const { return enters_; }
+  const Counter& submissions() const { return submissions_; }
+  const Counter& completions() const { return completions_; }
+
+ private:
+  static uint16_t BufferId(uint32_t flags) {
+    return flags >> IORING_CQE_BUFFER_SHIFT;
+  }
+
+  static std::size_t BufRingSize() {
+    return kRecvBuffers * sizeof(io_uring_buf);
+  }
+
+  static std::size_t RecvBuffersSize() {
+    return std::size_t(kRecvBuffers) * kRecvBufferSize;
+  }
+
+  void MapRings(const io_uring_params& params) {
+    int fd = descriptor_.native_handle();
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes +
+                    params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_ring_size_ > sq_ring_size_)
+      sq_ring_size_ = cq_ring_size_;
+
+    sq_ring_ = Map(fd, sq_ring_size_, IORING_OFF_SQ_RING);
+    cq_ring_ = single ? sq_ring_ : Map(fd, cq_ring_size_, IORING_OFF_CQ_RING);
+    sq_entries_ = params.sq_entries;
+    sqes_ = static_cast<io_uring_sqe*>(
+        Map(fd, sq_entries_ * sizeof(io_uring_sqe), IORING_OFF_SQES));
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_khead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_ktail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_khead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_ktail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    sq_tail_ = sq_submitted_ = *sq_ktail_;
+  }
+
+  static void* Map(int fd, std::size_t size, off_t offset) {
+    void* p = ::mmap(0, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (p == MAP_FAILED) throw UringError("io_uring mmap", errno);
+    return p;
+  }
+
+  // The buffers are mapped rather than allocated so that a receive still
+  // completing as the ring is torn down cannot write into reused memory.
+  void SetUpRecvBuffers() {
+    void* p = ::mmap(0, RecvBuffersSize(), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw UringError("io_uring buffers", errno);
+    recv_buffers_ = static_cast<char*>(p);
+
+    p = ::mmap(0, BufRingSize(), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw UringError("io_uring buffer ring", errno);
+    buf_ring_ = static_cast<io_uring_buf*>(p);
+
+    // Touching the ring first gives the kernel the page we write to, not
+    // the shared zero page.
+    std::memset(buf_ring_, 0, BufRingSize());
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+    reg.ring_entries = kRecvBuffers;
+    reg.bgid = kRecvGroup;
+    if (Register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+      throw UringError("io_uring register buffer ring", errno);
+
+    for (int i = 0; i < kRecvBuffers; ++i)
+      AddRecvBuffer(i);
+    PublishRecvBuffers();
+  }
+
+  // The ring is an array of io_uring_buf whose tail overlays the first
+  // entry's resv field. (io_uring_buf_ring says as much, but its flexible
+  // array is laid out differently when compiled as C++.)
+  void PublishRecvBuffers() {
+    __atomic_store_n(&buf_ring_[0].resv, buf_ring_tail_, __ATOMIC_RELEASE);
+  }
+
+  void AddRecvBuffer(uint16_t id) {
+    io_uring_buf& buf = buf_ring_[buf_ring_tail_ & (kRecvBuffers - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(
+        &recv_buffers_[id * std::size_t(kRecvBufferSize)]);
+    buf.len = kRecvBufferSize;
+    buf.bid = id;
+    ++buf_ring_tail_;
+  }
+
+  // Registering the write slots pins them once rather than on every send.
+  // Where that is not allowed (e.g. by RLIMIT_MEMLOCK), or the kernel cannot
+  // send from registered buffers, the slots are used unregistered.
+  void SetUpWriteSlots() {
+    std::vector<iovec> iovs(kWriteSlots);
+    for (int i = 0; i < kWriteSlots; ++i) {
+      iovs[i].iov_base = Slot(i);
+      iovs[i].iov_len = kWriteSlotSize;
+      free_slots_.push_back(kWriteSlots - 1 - i);
+    }
+    fixed_writes_ =
+        Register(IORING_REGISTER_BUFFERS, iovs.data(), kWriteSlots) == 0 &&
+        ProbeFixedSend();
+  }
+
+  // Sends nothing from a registered buffer, which fails with EINVAL on
+  // kernels that only accept them for zero copy sends.
+  bool ProbeFixedSend() {
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+      return false;
+    io_uring_sqe* sqe = Sqe(IORING_OP_SEND, fds[0], 0);
+    sqe->addr = reinterpret_cast<uint64_t>(Slot(0));
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+    sqe->buf_index = 0;
+    int result = Enter(1, IORING_ENTER_GETEVENTS) < 0 ? -errno : 0;
+    if (result == 0) {
+      unsigned head = *cq_khead_;
+      result = cqes_[head & cq_mask_].res;
+      __atomic_store_n(cq_khead_, head + 1, __ATOMIC_RELEASE);
+    }
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return result == 1;
+  }
+
+  int Register(unsigned opcode, void* arg, unsigned count) {
+    return ::syscall(__NR_io_uring_register, descriptor_.native_handle(),
+                     opcode, arg, count);
+  }
+
+  int Enter(unsigned to_submit, unsigned flags) {
+    enters_.Add(1);
+    int n = ::syscall(__NR_io_uring_enter, descriptor_.native_handle(),
+                      to_submit, flags & IORING_ENTER_GETEVENTS ? 1 : 0,
+                      flags, 0, 0);
+    if (n > 0) {
+      sq_submitted_ += n;
+      submissions_.Add(n);
+    }
+    return n;
+  }
+
+  // The next submission queue entry, to be submitted at the end of the
+  // io_context's current turn. Submits early only if the queue is full.
+  io_uring_sqe* Sqe(uint8_t opcode, int fd, UringOp* op) {
+    while (sq_tail_ - __atomic_load_n(sq_khead_, __ATOMIC_ACQUIRE) ==
+           sq_entries_) {
+      if (Submit() <= 0) Reap();
+    }
+
+    unsigned index = sq_tail_ & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = reinterpret_cast<uint64_t>(op);
+    sq_array_[index] = index;
+    ++sq_tail_;
+    __atomic_store_n(sq_ktail_, sq_tail_, __ATOMIC_RELEASE);
+
+    if (!flush_pending_) {
+      flush_pending_ = true;
+      boost::asio::post(io_context_, [this]() { Flush(); });
+    }
+    return sqe;
+  }
+
+  int Submit() {
+    unsigned pending = sq_tail_ - sq_submitted_;
+    if (!pending) return 0;
+    int n = Enter(pending, 0);
+    if (n < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR)
+      throw UringError("io_uring_enter", errno);
+    return n;
+  }
+
+  // Submits the turn's operations and handles whatever completed inline.
+  void Flush() {
+    flush_pending_ = false;
+    Submit();
+    Reap();
+  }
+
+  void Wait() {
+    descriptor_.async_wait(boost::asio::posix::descriptor_base::wait_read,
+        [this](const boost::system::error_code& ec) {
+          if (ec) return;
+          Reap();
+          Wait();
+        });
+  }
+
+  void Reap() {
+    unsigned head = *cq_khead_;
+    while (head != __atomic_load_n(cq_ktail_, __ATOMIC_ACQUIRE)) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      UringOp* op = reinterpret_cast<UringOp*>(cqe.user_data);
+      int result = cqe.res;
+      uint32_t flags = cqe.flags;
+      __atomic_store_n(cq_khead_, ++head, __ATOMIC_RELEASE);
+
+      completions_.Add(1);
+      if (op) op->Complete(result, flags);
+      head = *cq_khead_;
+    }
+  }
+
+  boost::asio::io_context& io_context_;
+  boost::asio::posix::stream_descriptor descriptor_;
+  void* sq_ring_;
+  void* cq_ring_;
+  io_uring_sqe* sqes_;
+  std::size_t sq_ring_size_;
+  std::size_t cq_ring_size_;
+  unsigned sq_entries_;
+  unsigned* sq_khead_;
+  unsigned* sq_ktail_;
+  unsigned sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_khead_;
+  unsigned* cq_ktail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+  unsigned sq_tail_;
+  unsigned sq_submitted_;
+  io_uring_buf* buf_ring_;
+  uint16_t buf_ring_tail_;
+  char* recv_buffers_;
+  std::vector<char> write_buffers_;
+  std::vector<int> free_slots_;
+  bool fixed_writes_;
+  bool flush_pending_;
+  Counter enters_;
+  Counter submissions_;
+  Counter completions_;
+};
+
+#endif  // URING_H_